@@ -0,0 +1,85 @@
+/* Growable bump-pointer arena, see arena.h */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "arena.h"
+
+#define ARENA_CHUNK_SIZE 4096
+#define ARENA_ALIGN (sizeof(void *))
+
+static ArenaChunk *new_chunk(size_t size)
+{
+  ArenaChunk *c = malloc(sizeof(ArenaChunk) + size);
+  if (c == NULL)
+  {
+    perror("arena");
+    exit(1);
+  }
+  c->next = NULL;
+  c->size = size;
+  c->used = 0;
+  return c;
+}
+
+void *arena_alloc(Arena *a, size_t size)
+{
+  size = (size + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+
+  if (a->head == NULL || a->head->size - a->head->used < size)
+  {
+    // Chunks at least double so a long line needs few of them
+    size_t want = a->head ? 2 * a->head->size : ARENA_CHUNK_SIZE;
+    while (want < size)
+      want *= 2;
+    ArenaChunk *c = new_chunk(want);
+    c->next = a->head;
+    a->head = c;
+  }
+
+  void *p = a->head->data + a->head->used;
+  a->head->used += size;
+  return p;
+}
+
+char *arena_strndup(Arena *a, const char *s, size_t len)
+{
+  char *p = arena_alloc(a, len + 1);
+  memcpy(p, s, len);
+  p[len] = '\0';
+  return p;
+}
+
+/* Rewind the arena. If the last round needed more than one chunk they are
+ * merged into one big enough for all of it, so the next line of the same
+ * size is served without touching malloc.
+ */
+void arena_reset(Arena *a)
+{
+  if (a->head == NULL)
+    return;
+
+  if (a->head->next)
+  {
+    size_t total = 0;
+    for (ArenaChunk *c = a->head; c; c = c->next)
+      total += c->size;
+    arena_free(a);
+    a->head = new_chunk(total);
+  }
+  a->head->used = 0;
+}
+
+void arena_free(Arena *a)
+{
+  ArenaChunk *c = a->head;
+  while (c)
+  {
+    ArenaChunk *next = c->next;
+    free(c);
+    c = next;
+  }
+  a->head = NULL;
+}
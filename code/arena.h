@@ -0,0 +1,29 @@
+/* Bump-pointer arena. Memory is handed out from chunks that are only
+ * released by arena_free(); arena_reset() rewinds the arena so the same
+ * chunks are reused, which makes per-line parsing malloc free once the
+ * arena has grown to fit the longest line seen so far.
+ */
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+
+typedef struct arena_chunk
+{
+  struct arena_chunk *next;
+  size_t size; // usable bytes in data
+  size_t used;
+  char data[];
+} ArenaChunk;
+
+typedef struct
+{
+  ArenaChunk *head; // chunk currently allocated from, newest first
+} Arena;
+
+extern void *arena_alloc(Arena *a, size_t size);
+extern char *arena_strndup(Arena *a, const char *s, size_t len);
+extern void arena_reset(Arena *a);
+extern void arena_free(Arena *a);
+
+#endif
@@ -0,0 +1,204 @@
+/* The tokenizer as it was before the table-driven one in parse.c, kept
+ * so lsh_bench can measure the two against each other and check that
+ * they build the same Commands. Not used by the shell.
+ */
+
+#include <ctype.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../arena.h"
+#include "legacy_parse.h"
+
+#define PIPE ('|')
+#define BG ('&')
+#define RIN ('<')
+#define RUT ('>')
+
+#define ispipe(c) ((c) == PIPE)
+#define isbg(c) ((c) == BG)
+#define isrin(c) ((c) == RIN)
+#define isrut(c) ((c) == RUT)
+#define isspec(c) (ispipe(c) || isbg(c) || isrin(c) || isrut(c))
+
+/* Everything legacy_parse() returns lives in this arena until the next call.
+ * Arguments of the Pgm being built are collected in argbuf first and
+ * copied to the arena once the Pgm is complete; argbuf only grows.
+ */
+static Arena arena;
+static char **argbuf;
+static size_t argcap;
+
+static int legacy_nexttoken(char *, char **);
+static int legacy_acmd(char *, Pgm **);
+static int legacy_isidentifier(char *);
+static void legacy_init(void);
+
+int legacy_parse(char *buf, Command *c)
+{
+  int n;
+  Pgm *cmd0;
+
+  char *t = buf;
+  char *tok;
+
+  legacy_init();
+  c->rstdin = NULL;
+  c->rstdout = NULL;
+  c->rstderr = NULL;
+  c->background = false;
+  c->pgm = NULL;
+
+newcmd:
+  if ((n = legacy_acmd(t, &cmd0)) <= 0)
+  {
+    return -1;
+  }
+
+  t += n;
+
+  cmd0->next = c->pgm;
+  c->pgm = cmd0;
+
+newtoken:
+  n = legacy_nexttoken(t, &tok);
+  if (n == 0)
+  {
+    return 1;
+  }
+  t += n;
+
+  switch (*tok)
+  {
+  case PIPE:
+    goto newcmd;
+  case BG:
+    n = legacy_nexttoken(t, &tok);
+    if (n == 0)
+    {
+      c->background = 1;
+      return 1;
+    }
+    else
+    {
+      fprintf(stderr, "illegal bakgrounding\n");
+      return -1;
+    }
+  case RIN:
+    if (c->rstdin != NULL)
+    {
+      fprintf(stderr, "duplicate redirection of stdin\n");
+      return -1;
+    }
+    if ((n = legacy_nexttoken(t, &(c->rstdin))) < 0)
+    {
+      return -1;
+    }
+    if (!legacy_isidentifier(c->rstdin))
+    {
+      fprintf(stderr, "Illegal filename: \"%s\"\n", c->rstdin);
+      return -1;
+    }
+    t += n;
+    goto newtoken;
+  case RUT:
+    if (c->rstdout != NULL)
+    {
+      fprintf(stderr, "duplicate redirection of stdout\n");
+      return -1;
+    }
+    if ((n = legacy_nexttoken(t, &(c->rstdout))) < 0)
+    {
+      return -1;
+    }
+    if (!legacy_isidentifier(c->rstdout))
+    {
+      fprintf(stderr, "Illegal filename: \"%s\"\n", c->rstdout);
+      return -1;
+    }
+    t += n;
+    goto newtoken;
+  default:
+    return -1;
+  }
+}
+
+static void legacy_init(void)
+{
+  arena_reset(&arena);
+}
+
+static int legacy_nexttoken(char *s, char **tok)
+{
+  char *s0 = s;
+  char *start;
+  char c;
+
+  while (isspace(c = *s) && c)
+    s++;
+  if (c == '\0')
+  {
+    *tok = arena_strndup(&arena, s, 0);
+    return 0;
+  }
+  start = s++;
+  if (!isspec(c))
+  {
+    while (!isspace(c = *s) && !isspec(c) && (c != '\0'))
+      s++;
+  }
+  *tok = arena_strndup(&arena, start, (size_t)(s - start));
+  return (int)(s - s0);
+}
+
+static int legacy_acmd(char *s, Pgm **cmd)
+{
+  char *tok;
+  int n, cnt = 0;
+  size_t argc = 0;
+  Pgm *cmd0 = arena_alloc(&arena, sizeof(Pgm));
+  cmd0->next = NULL;
+
+next:
+  if (argc == argcap)
+  {
+    argcap = argcap ? 2 * argcap : 64;
+    argbuf = realloc(argbuf, argcap * sizeof(*argbuf));
+    if (argbuf == NULL)
+    {
+      perror("acmd");
+      exit(1);
+    }
+  }
+  n = legacy_nexttoken(s, &tok);
+  if (n == 0 || isspec(*tok))
+  {
+    argbuf[argc++] = NULL;
+    cmd0->pgmlist = arena_alloc(&arena, argc * sizeof(char *));
+    memcpy(cmd0->pgmlist, argbuf, argc * sizeof(char *));
+    *cmd = cmd0;
+    return cnt;
+  }
+  else
+  {
+    argbuf[argc++] = tok;
+    cnt += n;
+    s += n;
+    goto next;
+  }
+}
+
+#define IDCHARS "_-.,/~+"
+
+static int legacy_isidentifier(char *s)
+{
+  while (*s)
+  {
+    char *p = strrchr(IDCHARS, *s);
+    if (!isalnum(*s++) && (p == NULL))
+      return 0;
+  }
+  return 1;
+}
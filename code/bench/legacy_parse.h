@@ -0,0 +1,8 @@
+#ifndef LEGACY_PARSE_H
+#define LEGACY_PARSE_H
+
+#include "../parse.h"
+
+extern int legacy_parse(char *, Command *);
+
+#endif
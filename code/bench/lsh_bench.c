@@ -0,0 +1,550 @@
+/*
+ * Microbenchmarks for lsh. Each benchmark prints one JSON object per line
+ * on stdout, so results can be collected and compared between builds:
+ *
+ *   {"bench":"parse","ops":200000,"seconds":0.162,"ns_per_op":812.4,...}
+ *
+ * parse      parse() over a corpus of typical command lines, in process,
+ *            against the previous tokenizer (bench/legacy_parse.c)
+ * parse_long the same over generated lines of 1 to 8 KiB
+ * spawn      lsh running /bin/true over and over, once per spawn engine
+ * pipeline   cat bigfile | cat | cat | cat | wc -c through lsh, MB/s, with
+ *            default and 1 MiB pipe buffers, then cat bigfile | tee | wc -c
+ *            with the tee built-in and with tee(1), and cat < bigfile | wc -c
+ *            with and without the feeder
+ * reap       lsh starting "/bin/true &" over and over, then "wait"
+ * script     lsh running lines of built-ins, with and without its cache
+ * glob       lsh expanding a wildcard over a directory of 20000 files,
+ *            with and without the directory listing cache
+ * startup    lsh started 1000 times on a one-line script, from exec to
+ *            its exit after running the line, so the time is the cost of
+ *            loading and setting up the shell
+ *
+ * The shell benchmarks drive the lsh binary built next to this one (or
+ * the one given with --lsh) in batch mode.
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <spawn.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../parse.h"
+#include "legacy_parse.h"
+
+#ifndef LSH_PATH
+#define LSH_PATH "./lsh"
+#endif
+
+extern char **environ;
+
+static const char *lsh_path = LSH_PATH;
+static int quick; // --quick: a tenth of the work, for CI smoke runs
+
+/* Command lines of the kind the shell sees, small and large */
+static const char *const corpus[] = {
+    "ls",
+    "ls -l -a /usr/bin",
+    "cat file.txt | grep -v '^#' | sort | uniq -c | sort -rn | head -20 > top.txt",
+    "make -j8 all &",
+    "gcc -O2 -Wall -Wextra -o prog main.c util.c parse.c -lm",
+    "sort < input.txt > output.txt",
+    "find . -name *.c | xargs wc -l | tail -1",
+    "sleep 10 &",
+    "echo the quick brown fox jumps over the lazy dog",
+    "ps aux | grep lsh | grep -v grep | awk {print} | wc -l",
+    "tar -czf backup.tar.gz src include docs tests README.md LICENSE",
+    "cd /tmp",
+};
+
+static double now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+/* One result line. ru, if not NULL, is the usage of the shell and its
+ * children: voluntary context switches are mostly stages blocking on a
+ * full or empty pipe, so "vcsw" counts the pipe stalls.
+ */
+static void report(const char *bench, const char *variant, long ops, double seconds, double bytes,
+                   const struct rusage *ru)
+{
+  printf("{\"bench\":\"%s\"", bench);
+  if (variant)
+    printf(",\"variant\":\"%s\"", variant);
+  printf(",\"ops\":%ld,\"seconds\":%.6f,\"ns_per_op\":%.1f,\"ops_per_sec\":%.1f", ops, seconds,
+         seconds * 1e9 / (double)ops, (double)ops / seconds);
+  if (bytes > 0)
+    printf(",\"bytes\":%.0f,\"mb_per_sec\":%.1f", bytes, bytes / seconds / 1e6);
+  if (ru)
+    printf(",\"vcsw\":%ld,\"ivcsw\":%ld", ru->ru_nvcsw, ru->ru_nivcsw);
+  printf("}\n");
+  fflush(stdout);
+}
+
+/* Write text to a fresh temporary file and return its name */
+static char *temp_file(const char *text, size_t len)
+{
+  const char *dir = getenv("TMPDIR");
+  char *name;
+  if (asprintf(&name, "%s/lsh_bench.XXXXXX", dir ? dir : "/tmp") < 0)
+    return NULL;
+  int fd = mkstemp(name);
+  if (fd < 0)
+  {
+    perror(name);
+    exit(1);
+  }
+  while (len > 0)
+  {
+    ssize_t n = write(fd, text, len);
+    if (n < 0)
+    {
+      perror(name);
+      exit(1);
+    }
+    text += n;
+    len -= (size_t)n;
+  }
+  close(fd);
+  return name;
+}
+
+/* Usage of the last run_lsh(), the shell and everything it waited for */
+static struct rusage lsh_usage;
+
+/* Run lsh on a script with stdout to /dev/null and the environment
+ * variable var (if not NULL) set to value, return the time it took
+ */
+static double run_lsh(const char *script, const char *var, const char *value)
+{
+  struct rusage before, after;
+  posix_spawn_file_actions_t fa;
+  char *argv[] = {(char *)lsh_path, (char *)script, NULL};
+  pid_t pid;
+  int status;
+
+  if (var)
+    setenv(var, value, 1);
+  posix_spawn_file_actions_init(&fa);
+  posix_spawn_file_actions_addopen(&fa, STDOUT_FILENO, "/dev/null", O_WRONLY, 0);
+
+  getrusage(RUSAGE_CHILDREN, &before);
+  double start = now();
+  int err = posix_spawn(&pid, lsh_path, &fa, NULL, argv, environ);
+  if (err != 0)
+  {
+    fprintf(stderr, "%s: %s\n", lsh_path, strerror(err));
+    exit(1);
+  }
+  while (waitpid(pid, &status, 0) < 0 && errno == EINTR)
+    ;
+  double secs = now() - start;
+  getrusage(RUSAGE_CHILDREN, &after);
+  lsh_usage.ru_nvcsw = after.ru_nvcsw - before.ru_nvcsw;
+  lsh_usage.ru_nivcsw = after.ru_nivcsw - before.ru_nivcsw;
+
+  posix_spawn_file_actions_destroy(&fa);
+  if (var)
+    unsetenv(var);
+  if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+  {
+    fprintf(stderr, "lsh_bench: %s %s failed\n", lsh_path, script);
+    exit(1);
+  }
+  return secs;
+}
+
+/* A script repeating line n times, followed by tail if not NULL */
+static char *repeat_script(const char *line, long n, const char *tail)
+{
+  size_t len = strlen(line), tlen = tail ? strlen(tail) : 0;
+  char *text = malloc(len * (size_t)n + tlen);
+  if (text == NULL)
+  {
+    perror("lsh_bench");
+    exit(1);
+  }
+  for (long i = 0; i < n; i++)
+    memcpy(text + (size_t)i * len, line, len);
+  memcpy(text + (size_t)n * len, tail, tlen);
+  char *name = temp_file(text, len * (size_t)n + tlen);
+  free(text);
+  return name;
+}
+
+typedef int ParseFn(char *, Command *);
+
+static int same_strings(const char *a, const char *b)
+{
+  return (a == NULL && b == NULL) || (a && b && strcmp(a, b) == 0);
+}
+
+/* Whether both parsers built the same Command */
+static int same_command(const Command *a, const Command *b)
+{
+  const Pgm *p = a->pgm, *q = b->pgm;
+  for (; p && q; p = p->next, q = q->next)
+  {
+    char **x = p->pgmlist, **y = q->pgmlist;
+    for (; *x && *y; x++, y++)
+    {
+      if (strcmp(*x, *y) != 0)
+        return 0;
+    }
+    if (*x || *y)
+      return 0;
+  }
+  return p == NULL && q == NULL && a->background == b->background && same_strings(a->rstdin, b->rstdin) &&
+         same_strings(a->rstdout, b->rstdout) && same_strings(a->rstderr, b->rstderr);
+}
+
+static void time_parse(const char *bench, const char *variant, ParseFn *fn, char **lines, size_t nlines,
+                       long rounds)
+{
+  double bytes = 0;
+  Command cmd;
+
+  double start = now();
+  for (long r = 0; r < rounds; r++)
+  {
+    for (size_t i = 0; i < nlines; i++)
+    {
+      if (fn(lines[i], &cmd) != 1)
+      {
+        fprintf(stderr, "lsh_bench: cannot parse \"%s\"\n", lines[i]);
+        exit(1);
+      }
+    }
+  }
+  double secs = now() - start;
+
+  for (size_t i = 0; i < nlines; i++)
+    bytes += (double)strlen(lines[i]) * (double)rounds;
+  report(bench, variant, rounds * (long)nlines, secs, bytes, NULL);
+}
+
+/* Run both tokenizers over the same lines, after checking they agree */
+static void compare_parsers(const char *bench, char **lines, size_t nlines, long rounds)
+{
+  for (size_t i = 0; i < nlines; i++)
+  {
+    Command a, b;
+    if (parse(lines[i], &a) != legacy_parse(lines[i], &b) || !same_command(&a, &b))
+    {
+      fprintf(stderr, "lsh_bench: parsers disagree on \"%s\"\n", lines[i]);
+      exit(1);
+    }
+  }
+  time_parse(bench, "legacy", legacy_parse, lines, nlines, rounds);
+  time_parse(bench, "table", parse, lines, nlines, rounds);
+}
+
+/* A generated pipeline of about len bytes, like the ones our scripts
+ * produce: many long arguments, a few stages and redirections.
+ */
+static char *long_line(size_t len, unsigned seed)
+{
+  char *line = malloc(len + 64);
+  size_t n = (size_t)sprintf(line, "gen_input --seed %u", seed);
+  unsigned i = 0;
+
+  while (n < len)
+  {
+    if (++i % 97 == 0)
+      n += (size_t)sprintf(line + n, " | filter_%u -k%u", i, i % 7);
+    else
+      n += (size_t)sprintf(line + n, " --option-%u=value_%u,/path/to/file.%u~", i, i * seed, i % 13);
+  }
+  sprintf(line + n, " < /data/input_%u.txt > /data/output_%u.txt", seed, seed);
+  return line;
+}
+
+static void bench_parse(void)
+{
+  size_t nlines = sizeof(corpus) / sizeof(corpus[0]);
+  char *lines[sizeof(corpus) / sizeof(corpus[0])];
+
+  for (size_t i = 0; i < nlines; i++)
+    lines[i] = strdup(corpus[i]);
+  compare_parsers("parse", lines, nlines, quick ? 2000 : 20000);
+  for (size_t i = 0; i < nlines; i++)
+    free(lines[i]);
+
+  char *long_lines[8];
+  for (unsigned i = 0; i < 8; i++)
+    long_lines[i] = long_line(1024u << (i % 4), i + 1);
+  compare_parsers("parse_long", long_lines, 8, quick ? 100 : 1000);
+  for (unsigned i = 0; i < 8; i++)
+    free(long_lines[i]);
+}
+
+static void bench_spawn(void)
+{
+  static const char *const engines[] = {"posix_spawn", "fork"};
+  long n = quick ? 1000 : 10000;
+  char *script = repeat_script("/bin/true\n", n, NULL); // not the built-in
+
+  for (size_t i = 0; i < sizeof(engines) / sizeof(engines[0]); i++)
+  {
+    double secs = run_lsh(script, "LSH_SPAWN", engines[i]);
+    report("spawn", engines[i], n, secs, 0, &lsh_usage);
+  }
+  unlink(script);
+  free(script);
+}
+
+static void bench_pipeline(void)
+{
+  size_t size = (quick ? 16 : 256) << 20;
+  char *data = malloc(size);
+  if (data == NULL)
+  {
+    perror("lsh_bench");
+    exit(1);
+  }
+  for (size_t i = 0; i < size; i++)
+    data[i] = (char)('a' + i % 26);
+  char *big = temp_file(data, size);
+  free(data);
+
+  char *line;
+  if (asprintf(&line, "cat %s | cat | cat | cat | wc -c\n", big) < 0)
+    exit(1);
+  char *script = temp_file(line, strlen(line));
+  // With the default 64 KiB pipes and with 1 MiB ones (if allowed)
+  static const char *const sizes[] = {"default", "1m"};
+  for (size_t i = 0; i < 2; i++)
+  {
+    double secs = run_lsh(script, "LSH_PIPESIZE", sizes[i]);
+    report("pipeline", sizes[i], 1, secs, (double)size, &lsh_usage);
+  }
+  unlink(script);
+  free(script);
+  free(line);
+
+  // Fan-out through the tee built-in, then through tee(1)
+  static const char *const tees[] = {"tee", "/usr/bin/tee"};
+  for (size_t i = 0; i < 2; i++)
+  {
+    if (asprintf(&line, "cat %s | %s /dev/null | wc -c\n", big, tees[i]) < 0)
+      exit(1);
+    script = temp_file(line, strlen(line));
+    double secs = run_lsh(script, NULL, NULL);
+    report("tee", i == 0 ? "builtin" : "external", 1, secs, (double)size, &lsh_usage);
+    unlink(script);
+    free(script);
+    free(line);
+  }
+
+  // Input redirection opened by the first stage, then spliced in by a
+  // feed stage
+  if (asprintf(&line, "cat < %s | wc -c\n", big) < 0)
+    exit(1);
+  script = temp_file(line, strlen(line));
+  static const char *const feeders[] = {"off", "on"};
+  for (size_t i = 0; i < 2; i++)
+  {
+    double secs = run_lsh(script, "LSH_FEEDER", feeders[i]);
+    report("feed", i == 0 ? "open" : "splice", 1, secs, (double)size, &lsh_usage);
+  }
+  unlink(script);
+  free(script);
+  free(line);
+
+  unlink(big);
+  free(big);
+}
+
+static void bench_reap(void)
+{
+  long n = quick ? 500 : 5000;
+  char *script = repeat_script("/bin/true &\n", n, "wait\n");
+  double secs = run_lsh(script, NULL, NULL);
+  report("reap", NULL, n, secs, 0, &lsh_usage);
+  unlink(script);
+  free(script);
+}
+
+/* A script of built-ins only, so the time goes to reading and parsing;
+ * with and without the parsed-command cache
+ */
+static void bench_script(void)
+{
+  static const char *const lines[] = {
+      "echo the quick brown fox jumps over the lazy dog --again and --again > /dev/null\n",
+      "test -n some_fairly_long_argument_value,/with/a/path/in/it.txt\n",
+      "false\n",
+      // Last, so the script ends with a command that succeeds
+      "[ 100 -lt 200 ]\n",
+  };
+  long n = quick ? 1000 : 10000;
+  size_t len = 0;
+  for (size_t i = 0; i < 4; i++)
+    len += strlen(lines[i]);
+
+  char *text = malloc(len * (size_t)n), *t = text;
+  if (text == NULL)
+  {
+    perror("lsh_bench");
+    exit(1);
+  }
+  for (long r = 0; r < n; r++)
+  {
+    for (size_t i = 0; i < 4; i++)
+      t = stpcpy(t, lines[i]);
+  }
+  char *script = temp_file(text, len * (size_t)n);
+  free(text);
+
+  double secs = run_lsh(script, "LSH_CMDCACHE", "256");
+  report("script", "cached", 4 * n, secs, 0, &lsh_usage);
+  secs = run_lsh(script, "LSH_CMDCACHE", "0");
+  report("script", "uncached", 4 * n, secs, 0, &lsh_usage);
+  unlink(script);
+  free(script);
+}
+
+/* The same glob over a big directory again and again, so the time goes
+ * to expanding it; with and without the directory listing cache
+ */
+static void bench_glob(void)
+{
+  long files = quick ? 2000 : 20000, n = quick ? 20 : 200;
+  const char *tmp = getenv("TMPDIR");
+  char *dir, *path, *line;
+  if (asprintf(&dir, "%s/lsh_bench_glob.XXXXXX", tmp ? tmp : "/tmp") < 0 || mkdtemp(dir) == NULL)
+  {
+    perror("lsh_bench");
+    exit(1);
+  }
+  for (long i = 0; i < files; i++)
+  {
+    if (asprintf(&path, "%s/file%06ld.txt", dir, i) < 0)
+      exit(1);
+    int fd = open(path, O_WRONLY | O_CREAT | O_EXCL, 0644);
+    if (fd < 0)
+    {
+      perror(path);
+      exit(1);
+    }
+    close(fd);
+    free(path);
+  }
+  // Listings of a directory changed in the last seconds are not trusted
+  struct timespec old[2] = {{.tv_sec = 0}, {.tv_sec = 0}};
+  utimensat(AT_FDCWD, dir, old, 0);
+
+  if (asprintf(&line, "echo %s/file*7.txt > /dev/null\n", dir) < 0)
+    exit(1);
+  char *script = repeat_script(line, n, NULL);
+  double secs = run_lsh(script, "LSH_GLOBCACHE", "64");
+  report("glob", "cached", n, secs, 0, &lsh_usage);
+  secs = run_lsh(script, "LSH_GLOBCACHE", "0");
+  report("glob", "uncached", n, secs, 0, &lsh_usage);
+  unlink(script);
+  free(script);
+  free(line);
+
+  for (long i = 0; i < files; i++)
+  {
+    if (asprintf(&path, "%s/file%06ld.txt", dir, i) < 0)
+      exit(1);
+    unlink(path);
+    free(path);
+  }
+  rmdir(dir);
+  free(dir);
+}
+
+/* Short-lived shells: each run pays for the dynamic loader, the shell's
+ * setup and one built-in, which is what a cron job's lsh mostly costs
+ */
+static void bench_startup(void)
+{
+  long n = quick ? 100 : 1000;
+  char *script = temp_file("true\n", 5);
+  struct rusage ru = {0};
+  double secs = 0;
+
+  for (long i = 0; i < n; i++)
+  {
+    secs += run_lsh(script, NULL, NULL);
+    ru.ru_nvcsw += lsh_usage.ru_nvcsw;
+    ru.ru_nivcsw += lsh_usage.ru_nivcsw;
+  }
+  report("startup", NULL, n, secs, 0, &ru);
+  unlink(script);
+  free(script);
+}
+
+static const struct
+{
+  const char *name;
+  void (*run)(void);
+} benches[] = {
+    {"parse", bench_parse},
+    {"spawn", bench_spawn},
+    {"pipeline", bench_pipeline},
+    {"reap", bench_reap},
+    {"script", bench_script},
+    {"glob", bench_glob},
+    {"startup", bench_startup},
+};
+
+static void usage(void)
+{
+  fprintf(stderr, "usage: lsh_bench [--quick] [--lsh path] [parse|spawn|pipeline|reap|script|glob|startup]...\n");
+  exit(2);
+}
+
+int main(int argc, char **argv)
+{
+  const size_t nbenches = sizeof(benches) / sizeof(benches[0]);
+  int selected = 0;
+
+  for (int i = 1; i < argc; i++)
+  {
+    if (strcmp(argv[i], "--quick") == 0)
+      quick = 1;
+    else if (strcmp(argv[i], "--lsh") == 0)
+    {
+      if (++i == argc)
+        usage();
+      lsh_path = argv[i];
+    }
+    else if (argv[i][0] == '-')
+      usage();
+  }
+
+  for (int i = 1; i < argc; i++)
+  {
+    if (argv[i][0] == '-')
+    {
+      i += strcmp(argv[i], "--lsh") == 0;
+      continue;
+    }
+    size_t b = 0;
+    while (b < nbenches && strcmp(benches[b].name, argv[i]) != 0)
+      b++;
+    if (b == nbenches)
+      usage();
+    benches[b].run();
+    selected = 1;
+  }
+
+  if (!selected)
+  {
+    for (size_t b = 0; b < nbenches; b++)
+      benches[b].run();
+  }
+  return 0;
+}
@@ -0,0 +1,449 @@
+/* Stateless built-ins, see builtins.h */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "builtins.h"
+
+/* echo [-n] [arg]... */
+int builtin_echo(char **argv, int argc)
+{
+  int i = 1, newline = 1;
+
+  if (argc > 1 && strcmp(argv[1], "-n") == 0)
+  {
+    newline = 0;
+    i++;
+  }
+  for (; i < argc; i++)
+  {
+    fputs(argv[i], stdout);
+    if (i < argc - 1)
+      putchar(' ');
+  }
+  if (newline)
+    putchar('\n');
+  return ferror(stdout) ? 1 : 0;
+}
+
+int builtin_true(char **argv, int argc)
+{
+  (void)argv;
+  (void)argc;
+  return 0;
+}
+
+int builtin_false(char **argv, int argc)
+{
+  (void)argv;
+  (void)argc;
+  return 1;
+}
+
+int builtin_pwd(char **argv, int argc)
+{
+  char cwd[PATH_MAX];
+  (void)argv;
+  (void)argc;
+
+  if (getcwd(cwd, sizeof(cwd)) == NULL)
+  {
+    perror("pwd");
+    return 1;
+  }
+  puts(cwd);
+  return 0;
+}
+
+static int test_unary(const char *op, const char *arg)
+{
+  struct stat st;
+
+  if (strcmp(op, "-n") == 0)
+    return *arg != '\0';
+  if (strcmp(op, "-z") == 0)
+    return *arg == '\0';
+  if (strcmp(op, "-r") == 0)
+    return access(arg, R_OK) == 0;
+  if (strcmp(op, "-w") == 0)
+    return access(arg, W_OK) == 0;
+  if (strcmp(op, "-x") == 0)
+    return access(arg, X_OK) == 0;
+
+  int found = stat(arg, &st) == 0;
+  if (strcmp(op, "-e") == 0)
+    return found;
+  if (strcmp(op, "-f") == 0)
+    return found && S_ISREG(st.st_mode);
+  if (strcmp(op, "-d") == 0)
+    return found && S_ISDIR(st.st_mode);
+  if (strcmp(op, "-s") == 0)
+    return found && st.st_size > 0;
+  return -1;
+}
+
+static int test_integer(const char *s, long *n)
+{
+  char *end;
+  *n = strtol(s, &end, 10);
+  return *s != '\0' && *end == '\0';
+}
+
+static int test_binary(const char *a, const char *op, const char *b)
+{
+  static const char *const ops[] = {"-eq", "-ne", "-lt", "-le", "-gt", "-ge"};
+  long x, y;
+
+  if (strcmp(op, "=") == 0)
+    return strcmp(a, b) == 0;
+  if (strcmp(op, "!=") == 0)
+    return strcmp(a, b) != 0;
+
+  for (int i = 0; i < 6; i++)
+  {
+    if (strcmp(op, ops[i]) != 0)
+      continue;
+    if (!test_integer(a, &x) || !test_integer(b, &y))
+      return -1;
+    switch (i)
+    {
+    case 0:
+      return x == y;
+    case 1:
+      return x != y;
+    case 2:
+      return x < y;
+    case 3:
+      return x <= y;
+    case 4:
+      return x > y;
+    default:
+      return x >= y;
+    }
+  }
+  return -1;
+}
+
+/* Evaluate a test expression of up to three words (four with '!') */
+static int test_eval(char **args, int n)
+{
+  if (n > 0 && strcmp(args[0], "!") == 0)
+  {
+    int r = test_eval(args + 1, n - 1);
+    return r < 0 ? r : !r;
+  }
+  switch (n)
+  {
+  case 0:
+    return 0;
+  case 1:
+    return *args[0] != '\0';
+  case 2:
+    return test_unary(args[0], args[1]);
+  case 3:
+    return test_binary(args[0], args[1], args[2]);
+  default:
+    return -1;
+  }
+}
+
+/* test expr, or [ expr ]. Exit status 0 for true, 1 for false and 2 for
+ * a malformed expression.
+ */
+int builtin_test(char **argv, int argc)
+{
+  if (strcmp(argv[0], "[") == 0)
+  {
+    if (strcmp(argv[argc - 1], "]") != 0)
+    {
+      fprintf(stderr, "[: missing ]\n");
+      return 2;
+    }
+    argc--;
+  }
+
+  int r = test_eval(argv + 1, argc - 1);
+  if (r < 0)
+  {
+    fprintf(stderr, "%s: syntax error\n", argv[0]);
+    return 2;
+  }
+  return r ? 0 : 1;
+}
+
+static int is_pipe(int fd)
+{
+  struct stat st;
+  return fstat(fd, &st) == 0 && S_ISFIFO(st.st_mode);
+}
+
+static int write_all(int fd, const char *buf, size_t len)
+{
+  while (len > 0)
+  {
+    ssize_t n = write(fd, buf, len);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n < 0)
+      return -1;
+    buf += n;
+    len -= (size_t)n;
+  }
+  return 0;
+}
+
+/* Move len bytes from the pipe on in to fd, in the kernel if fd takes
+ * splice() and through a buffer if it does not. Returns how many of them
+ * could not be moved, 0 if all went.
+ */
+static size_t splice_all(int in, int fd, size_t len)
+{
+  char buf[65536];
+
+  while (len > 0)
+  {
+    ssize_t n = splice(in, NULL, fd, NULL, len, SPLICE_F_MOVE);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n < 0 && errno == EINVAL)
+    {
+      n = read(in, buf, len < sizeof(buf) ? len : sizeof(buf));
+      if (n <= 0)
+        return len;
+      if (write_all(fd, buf, (size_t)n) < 0)
+        return len - (size_t)n; // read, so no longer in the pipe
+    }
+    else if (n <= 0)
+      return len;
+    len -= (size_t)n;
+  }
+  return 0;
+}
+
+/* Throw away len bytes known to be in the pipe on in */
+static void discard(int in, size_t len)
+{
+  char buf[65536];
+
+  while (len > 0)
+  {
+    ssize_t n = read(in, buf, len < sizeof(buf) ? len : sizeof(buf));
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return;
+    len -= (size_t)n;
+  }
+}
+
+/* Plain read/write copy, for when stdin or stdout is not a pipe */
+static int tee_copy(const int *fds, int nfds)
+{
+  char buf[65536];
+  ssize_t n;
+  int ret = 0;
+
+  while ((n = read(STDIN_FILENO, buf, sizeof(buf))) != 0)
+  {
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n < 0)
+      return 1;
+    if (write_all(STDOUT_FILENO, buf, (size_t)n) < 0)
+      return 1;
+    for (int i = 0; i < nfds; i++)
+    {
+      if (fds[i] >= 0 && write_all(fds[i], buf, (size_t)n) < 0)
+        ret = 1;
+    }
+  }
+  return ret;
+}
+
+/* Pipe to pipe: tee(2) duplicates what is in stdin into stdout without
+ * consuming it, then splice(2) moves it on to the last file. Every other
+ * file gets its own copy through an intermediate pipe. No byte is copied
+ * to user space. A file that fails to take its copy is closed and left
+ * out from then on, with what it did not take thrown away, so the pipes
+ * never fill up with it. Returns -1 if it cannot be done this way at all.
+ */
+static int tee_splice(int *fds, int nfds)
+{
+  int chunk = fcntl(STDIN_FILENO, F_GETPIPE_SZ);
+  int spare[2] = {-1, -1};
+  int last = -1, ret = 0;
+
+  for (int i = 0; i < nfds; i++)
+  {
+    if (fds[i] >= 0)
+      last = i;
+  }
+  if (chunk <= 0)
+    return -1;
+  // tee(2) always duplicates from the head of the pipe, so the spare
+  // pipe must take a whole chunk in one go.
+  if (last > 0 && (pipe2(spare, O_CLOEXEC) < 0 || fcntl(spare[1], F_SETPIPE_SZ, chunk) < chunk))
+  {
+    if (spare[0] >= 0)
+      close(spare[0]), close(spare[1]);
+    return -1;
+  }
+
+  for (int first = 1;; first = 0)
+  {
+    ssize_t len;
+    if (last < 0)
+      len = splice(STDIN_FILENO, NULL, STDOUT_FILENO, NULL, (size_t)chunk, SPLICE_F_MOVE);
+    else
+      len = tee(STDIN_FILENO, STDOUT_FILENO, (size_t)chunk, 0);
+    if (len < 0 && errno == EINTR)
+      continue;
+    if (len < 0 && first && errno == EINVAL)
+    {
+      ret = -1; // nothing moved yet, let the caller copy instead
+      break;
+    }
+    if (len <= 0)
+    {
+      if (len < 0)
+        ret = 1;
+      break;
+    }
+    if (last < 0)
+      continue;
+
+    for (int i = 0; i < last; i++)
+    {
+      if (fds[i] < 0)
+        continue;
+      ssize_t copied = tee(STDIN_FILENO, spare[1], (size_t)len, 0);
+      size_t left = copied > 0 ? splice_all(spare[0], fds[i], (size_t)copied) : 0;
+      if (copied != len || left > 0)
+      {
+        discard(spare[0], left);
+        close(fds[i]);
+        fds[i] = -1;
+        ret = 1;
+      }
+    }
+    size_t left = splice_all(STDIN_FILENO, fds[last], (size_t)len);
+    if (left > 0)
+    {
+      // stdout has all of it already, so stdin must give it up anyway
+      discard(STDIN_FILENO, left);
+      close(fds[last]);
+      fds[last] = -1;
+      ret = 1;
+      while (last >= 0 && fds[last] < 0)
+        last--;
+    }
+  }
+
+  if (spare[0] >= 0)
+    close(spare[0]), close(spare[1]);
+  return ret;
+}
+
+/* tee [-a] [file]..., copy stdin to stdout and to every file. Meant as a
+ * pipeline stage, where the data goes from pipe to pipe in the kernel.
+ */
+int builtin_tee(char **argv, int argc)
+{
+  int i = 1, append = 0, ret = 0;
+
+  if (argc > 1 && strcmp(argv[1], "-a") == 0)
+  {
+    append = 1;
+    i++;
+  }
+
+  int nfds = argc - i;
+  int *fds = malloc((size_t)(nfds + 1) * sizeof(int));
+  if (fds == NULL)
+  {
+    perror("tee");
+    return 1;
+  }
+  for (int k = 0; k < nfds; k++)
+  {
+    // No O_APPEND: splice() does not write to such files. We are the
+    // only writer here, so seeking to the end once does the same.
+    fds[k] = open(argv[i + k], O_WRONLY | O_CREAT | O_CLOEXEC | (append ? 0 : O_TRUNC), 0644);
+    if (fds[k] < 0)
+    {
+      perror(argv[i + k]);
+      ret = 1;
+    }
+    else if (append)
+      lseek(fds[k], 0, SEEK_END);
+  }
+
+  int r = -1;
+  if (is_pipe(STDIN_FILENO) && is_pipe(STDOUT_FILENO))
+    r = tee_splice(fds, nfds);
+  if (r < 0)
+    r = tee_copy(fds, nfds);
+
+  for (int k = 0; k < nfds; k++)
+  {
+    if (fds[k] >= 0)
+      close(fds[k]);
+  }
+  free(fds);
+  return ret | r;
+}
+
+/* Copy a file into the pipe on stdout. splice(2) moves page-cache pages
+ * into the pipe instead of copying them through a buffer, in chunks as
+ * big as the pipe, and POSIX_FADV_SEQUENTIAL doubles the readahead.
+ */
+int builtin_feed(char **argv, int argc)
+{
+  (void)argc;
+
+  int fd = open(argv[1], O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+  {
+    perror("open input file");
+    return 1;
+  }
+  posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+  // Ask for a bigger pipe unless the pipesize option already set one
+  int chunk = fcntl(STDOUT_FILENO, F_GETPIPE_SZ);
+  if (chunk < 1 << 20 && fcntl(STDOUT_FILENO, F_SETPIPE_SZ, 1 << 20) > 0)
+    chunk = fcntl(STDOUT_FILENO, F_GETPIPE_SZ);
+  if (chunk <= 0)
+    chunk = 65536;
+
+  int ret = 0;
+  for (;;)
+  {
+    ssize_t n = splice(fd, NULL, STDOUT_FILENO, NULL, (size_t)chunk, SPLICE_F_MOVE | SPLICE_F_MORE);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n < 0 && errno == EINVAL)
+    {
+      // Not something splice() reads from (a tty, some /proc files)
+      char buf[65536];
+      while ((n = read(fd, buf, sizeof(buf))) > 0 && write_all(STDOUT_FILENO, buf, (size_t)n) == 0)
+        ;
+    }
+    if (n < 0)
+    {
+      if (errno != EPIPE)
+        perror("feed");
+      ret = 1;
+    }
+    if (n <= 0)
+      break;
+  }
+  close(fd);
+  return ret;
+}
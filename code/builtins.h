@@ -0,0 +1,23 @@
+/* Built-ins that need nothing from the shell's state. They run in the
+ * shell when they are a command of their own, and in a forked child that
+ * never execs when they are a pipeline stage. Each takes the stage's argv
+ * and returns its exit status.
+ */
+#ifndef BUILTINS_H
+#define BUILTINS_H
+
+typedef int BuiltinFn(char **argv, int argc);
+
+extern BuiltinFn builtin_echo;
+extern BuiltinFn builtin_false;
+extern BuiltinFn builtin_pwd;
+extern BuiltinFn builtin_tee;
+extern BuiltinFn builtin_test;
+extern BuiltinFn builtin_true;
+
+/* Not a command: the helper stage that feeds "< file" into a pipeline when
+ * the feeder option is on. argv is {"feed", file, NULL}.
+ */
+extern BuiltinFn builtin_feed;
+
+#endif
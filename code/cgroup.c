@@ -0,0 +1,377 @@
+/* cgroup v2 leaves for jobs, see cgroup.h */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "cgroup.h"
+
+#ifndef CLONE_INTO_CGROUP
+#define CLONE_INTO_CGROUP 0x200000000ULL
+#endif
+
+struct cgroup_leaf
+{
+  int fd;      // the leaf's directory
+  unsigned id; // named job-<id>
+  int limited;
+};
+
+static int enabled; // the cgroup option
+
+/* lsh-<pid>, the parent of the leaves. Made on first use by the process
+ * that needs it, so every server worker gets one of its own.
+ */
+static int base_fd = -1;
+static pid_t base_pid;
+static char base_path[PATH_MAX];
+static unsigned next_id = 1;
+
+static int no_clone3; // clone3(CLONE_INTO_CGROUP) not supported
+
+static int write_file(int dirfd, const char *name, const char *text)
+{
+  int fd = openat(dirfd, name, O_WRONLY | O_CLOEXEC);
+  if (fd < 0)
+    return -1;
+  ssize_t n = write(fd, text, strlen(text));
+  int err = errno;
+  close(fd);
+  errno = err;
+  return n == (ssize_t)strlen(text) ? 0 : -1;
+}
+
+static int read_file(int dirfd, const char *name, char *buf, size_t size)
+{
+  int fd = openat(dirfd, name, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return -1;
+  ssize_t n = read(fd, buf, size - 1);
+  close(fd);
+  if (n < 0)
+    return -1;
+  buf[n] = '\0';
+  return 0;
+}
+
+/* Where cgroup2 is mounted, from /proc/self/mountinfo */
+static int find_mount(char *mount, size_t size)
+{
+  char line[4096];
+  int found = 0;
+  FILE *f = fopen("/proc/self/mountinfo", "re");
+  if (f == NULL)
+    return -1;
+  while (!found && fgets(line, sizeof(line), f))
+  {
+    // id parent dev root mountpoint options [optional...] - fstype ...
+    char *sep = strstr(line, " - ");
+    char point[PATH_MAX], fstype[64];
+    if (sep && sscanf(line, "%*s %*s %*s %*s %4095s", point) == 1 && sscanf(sep + 3, "%63s", fstype) == 1 &&
+        strcmp(fstype, "cgroup2") == 0 && strlen(point) < size)
+    {
+      strcpy(mount, point);
+      found = 1;
+    }
+  }
+  fclose(f);
+  return found ? 0 : -1;
+}
+
+/* The shell's own cgroup v2 path, the "0::" line of /proc/self/cgroup */
+static int find_own(char *path, size_t size)
+{
+  char line[4096];
+  int found = 0;
+  FILE *f = fopen("/proc/self/cgroup", "re");
+  if (f == NULL)
+    return -1;
+  while (!found && fgets(line, sizeof(line), f))
+  {
+    if (strncmp(line, "0::", 3) != 0)
+      continue;
+    line[strcspn(line, "\n")] = '\0';
+    if (strlen(line + 3) < size)
+    {
+      strcpy(path, strcmp(line + 3, "/") == 0 ? "" : line + 3);
+      found = 1;
+    }
+  }
+  fclose(f);
+  return found ? 0 : -1;
+}
+
+/* Limits only work with the controllers enabled all the way down. This
+ * fails in a cgroup that has processes of its own (other than the root),
+ * in which case jobs are still placed and accounted, just not limited.
+ */
+static void enable_controllers(const char *dir)
+{
+  int fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd < 0)
+    return;
+  write_file(fd, "cgroup.subtree_control", "+cpu");
+  write_file(fd, "cgroup.subtree_control", "+memory");
+  close(fd);
+}
+
+static void remove_base(void)
+{
+  if (base_fd >= 0 && base_pid == getpid())
+    rmdir(base_path);
+}
+
+static int open_base(void)
+{
+  static int registered;
+  char mount[PATH_MAX], own[PATH_MAX], parent[PATH_MAX];
+
+  if (base_fd >= 0 && base_pid == getpid())
+    return base_fd;
+  if (base_fd >= 0)
+    close(base_fd); // inherited from the server's parent
+  base_fd = -1;
+
+  if (find_mount(mount, sizeof(mount)) != 0 || find_own(own, sizeof(own)) != 0)
+  {
+    errno = ENOENT;
+    return -1;
+  }
+  if (snprintf(parent, sizeof(parent), "%s%s", mount, own) >= (int)sizeof(parent) ||
+      snprintf(base_path, sizeof(base_path), "%s/lsh-%d", parent, (int)getpid()) >= (int)sizeof(base_path))
+  {
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+  if (mkdir(base_path, 0755) != 0 && errno != EEXIST)
+    return -1;
+  enable_controllers(parent);
+  enable_controllers(base_path);
+
+  base_fd = open(base_path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  base_pid = getpid();
+  if (!registered)
+    registered = atexit(remove_base) == 0;
+  return base_fd;
+}
+
+/* "cpu=50%" (of one CPU), "cpu=1.5" (CPUs) or "mem=512m". Returns -1 if
+ * arg is not one of those.
+ */
+int cgroup_parse_limit(const char *arg, CgroupLimits *limits)
+{
+  char *end;
+  if (strncmp(arg, "cpu=", 4) == 0)
+  {
+    double cpus = strtod(arg + 4, &end);
+    if (*end == '%')
+    {
+      cpus /= 100;
+      end++;
+    }
+    // The kernel wants at least 1ms per period
+    if (end == arg + 4 || *end != '\0' || cpus * CGROUP_PERIOD < 1000 || cpus > 4096)
+      return -1;
+    limits->cpu_quota = (long)(cpus * CGROUP_PERIOD);
+    return 0;
+  }
+  if (strncmp(arg, "mem=", 4) == 0)
+  {
+    long long n = strtoll(arg + 4, &end, 10);
+    switch (*end)
+    {
+    case 'g':
+    case 'G':
+      n *= 1024;
+      // fall through
+    case 'm':
+    case 'M':
+      n *= 1024;
+      // fall through
+    case 'k':
+    case 'K':
+      n *= 1024;
+      end++;
+    }
+    if (end == arg + 4 || *end != '\0' || n <= 0)
+      return -1;
+    limits->mem_max = n;
+    return 0;
+  }
+  return -1;
+}
+
+/* Whether a job with these limits gets a cgroup of its own */
+int cgroup_wanted(const CgroupLimits *limits)
+{
+  return enabled || limits->cpu_quota > 0 || limits->mem_max > 0;
+}
+
+/* Make a leaf for a job and apply its limits. Prints why and returns NULL
+ * if that fails.
+ */
+CgroupLeaf *cgroup_leaf_new(const CgroupLimits *limits)
+{
+  int base = open_base();
+  if (base < 0)
+  {
+    fprintf(stderr, "cgroup: no cgroup v2 hierarchy to use: %s\n", strerror(errno));
+    return NULL;
+  }
+  CgroupLeaf *leaf = malloc(sizeof(CgroupLeaf));
+  if (leaf == NULL)
+    return NULL;
+  leaf->id = next_id++;
+  leaf->limited = limits->cpu_quota > 0 || limits->mem_max > 0;
+
+  char name[32], value[64];
+  snprintf(name, sizeof(name), "job-%u", leaf->id);
+  if (mkdirat(base, name, 0755) != 0 || (leaf->fd = openat(base, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0)
+  {
+    perror("cgroup");
+    unlinkat(base, name, AT_REMOVEDIR);
+    free(leaf);
+    return NULL;
+  }
+
+  const char *failed = NULL;
+  if (limits->cpu_quota > 0)
+  {
+    snprintf(value, sizeof(value), "%ld %d", limits->cpu_quota, CGROUP_PERIOD);
+    if (write_file(leaf->fd, "cpu.max", value) != 0)
+      failed = "cpu.max";
+  }
+  if (!failed && limits->mem_max > 0)
+  {
+    snprintf(value, sizeof(value), "%lld", limits->mem_max);
+    if (write_file(leaf->fd, "memory.max", value) != 0)
+      failed = "memory.max";
+  }
+  if (failed)
+  {
+    fprintf(stderr, "limit: cannot set %s: %s\n", failed, strerror(errno));
+    cgroup_leaf_free(leaf);
+    return NULL;
+  }
+  return leaf;
+}
+
+int cgroup_leaf_fd(const CgroupLeaf *leaf)
+{
+  return leaf ? leaf->fd : -1;
+}
+
+int cgroup_leaf_limited(const CgroupLeaf *leaf)
+{
+  return leaf && leaf->limited;
+}
+
+static long long stat_field(const char *stat, const char *key)
+{
+  size_t len = strlen(key);
+  const char *p = stat;
+  while (p)
+  {
+    if (strncmp(p, key, len) == 0 && p[len] == ' ')
+      return strtoll(p + len + 1, NULL, 10);
+    p = strchr(p, '\n');
+    if (p)
+      p++;
+  }
+  return -1;
+}
+
+/* One line with what the job's cgroup used, once it is done */
+void cgroup_leaf_report(const CgroupLeaf *leaf, FILE *out)
+{
+  char stat[1024], peak[32];
+  if (leaf == NULL)
+    return;
+
+  fprintf(out, "cgroup job-%u:", leaf->id);
+  if (read_file(leaf->fd, "cpu.stat", stat, sizeof(stat)) == 0)
+  {
+    fprintf(out, " cpu %.3fs (user %.3fs, sys %.3fs)", stat_field(stat, "usage_usec") / 1e6,
+            stat_field(stat, "user_usec") / 1e6, stat_field(stat, "system_usec") / 1e6);
+    long long throttled = stat_field(stat, "nr_throttled");
+    if (throttled >= 0)
+      fprintf(out, ", throttled %lld times for %.3fs", throttled, stat_field(stat, "throttled_usec") / 1e6);
+  }
+  if (read_file(leaf->fd, "memory.peak", peak, sizeof(peak)) == 0)
+    fprintf(out, ", memory peak %.1fMB", strtoll(peak, NULL, 10) / 1048576.0);
+  fputc('\n', out);
+}
+
+/* Remove the leaf. One still holding processes (a stage that daemonized)
+ * is left in place.
+ */
+void cgroup_leaf_free(CgroupLeaf *leaf)
+{
+  char name[32];
+  if (leaf == NULL)
+    return;
+  close(leaf->fd);
+  snprintf(name, sizeof(name), "job-%u", leaf->id);
+  if (base_fd >= 0)
+    unlinkat(base_fd, name, AT_REMOVEDIR);
+  free(leaf);
+}
+
+/* fork() into the cgroup at fd. Without clone3(CLONE_INTO_CGROUP) the
+ * child moves itself before returning, so it never runs anything of the
+ * job outside it either.
+ */
+pid_t cgroup_fork(int fd)
+{
+#ifdef SYS_clone3
+  if (!no_clone3)
+  {
+    struct
+    {
+      uint64_t flags, pidfd, child_tid, parent_tid, exit_signal, stack, stack_size, tls, set_tid, set_tid_size,
+          cgroup;
+    } args = {.flags = CLONE_INTO_CGROUP, .exit_signal = SIGCHLD, .cgroup = (uint64_t)fd};
+    long pid = syscall(SYS_clone3, &args, sizeof(args));
+    if (pid >= 0)
+      return (pid_t)pid;
+    if (errno != ENOSYS && errno != EINVAL && errno != E2BIG)
+      return -1;
+    no_clone3 = 1;
+  }
+#endif
+  pid_t pid = fork();
+  if (pid == 0 && write_file(fd, "cgroup.procs", "0") != 0)
+  {
+    perror("cgroup.procs");
+    _exit(126);
+  }
+  return pid;
+}
+
+int cgroup_set_mode(const char *value)
+{
+  if (strcmp(value, "on") == 0)
+  {
+    // Better to find out now than at every job
+    if (open_base() < 0)
+      return -1;
+    enabled = 1;
+  }
+  else if (strcmp(value, "off") == 0)
+    enabled = 0;
+  else
+    return -1;
+  return 0;
+}
+
+const char *cgroup_get_mode(void)
+{
+  return enabled ? "on" : "off";
+}
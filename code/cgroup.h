@@ -0,0 +1,37 @@
+/* cgroup v2 placement of jobs. With the cgroup option on, or a "limit"
+ * prefix, a pipeline gets a leaf cgroup of its own, job-<n> under an
+ * lsh-<pid> cgroup the shell creates below its own. Stages are cloned
+ * straight into it with clone3(CLONE_INTO_CGROUP), or move themselves
+ * there before exec on kernels without it, so no process of the job ever
+ * runs outside its limits. Once the job is done its cpu.stat and
+ * memory.peak can be reported and the leaf is removed.
+ */
+#ifndef CGROUP_H
+#define CGROUP_H
+
+#include <stdio.h>
+#include <sys/types.h>
+
+#define CGROUP_PERIOD 100000 // cpu.max period, in microseconds
+
+typedef struct
+{
+  long cpu_quota; // microseconds per CGROUP_PERIOD, 0 for no limit
+  long long mem_max; // bytes, 0 for no limit
+} CgroupLimits;
+
+typedef struct cgroup_leaf CgroupLeaf;
+
+extern int cgroup_parse_limit(const char *arg, CgroupLimits *limits);
+extern int cgroup_wanted(const CgroupLimits *limits);
+extern CgroupLeaf *cgroup_leaf_new(const CgroupLimits *limits);
+extern int cgroup_leaf_fd(const CgroupLeaf *leaf);
+extern int cgroup_leaf_limited(const CgroupLeaf *leaf);
+extern void cgroup_leaf_report(const CgroupLeaf *leaf, FILE *out);
+extern void cgroup_leaf_free(CgroupLeaf *leaf);
+extern pid_t cgroup_fork(int fd);
+
+extern int cgroup_set_mode(const char *value);
+extern const char *cgroup_get_mode(void);
+
+#endif
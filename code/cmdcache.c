@@ -0,0 +1,188 @@
+/* Parsed-command LRU cache, see cmdcache.h */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cmdcache.h"
+
+typedef struct entry
+{
+  uint64_t hash;
+  size_t len;
+  char *line;
+  Command *cmd; // from cmd_clone(), owned by the entry
+  struct entry *prev, *next; // LRU list, most recently used first
+} Entry;
+
+static Entry **table; // open addressing, linear probing, NULL for free
+static size_t capacity; // power of two, at least twice the entry limit
+static size_t used;
+static size_t limit = 256; // 0 turns the cache off
+static Entry *mru, *lru;
+
+/* Lines can be kilobytes long, so hash them eight bytes at a time: a
+ * byte-wise hash would take longer than parsing them.
+ */
+static uint64_t hash_line(const char *s, size_t len)
+{
+  uint64_t h = len * 0x9e3779b97f4a7c15ull, w;
+
+  for (; len >= 8; s += 8, len -= 8)
+  {
+    memcpy(&w, s, 8);
+    h = (h ^ w) * 0xff51afd7ed558ccdull;
+    h ^= h >> 32;
+  }
+  w = 0;
+  memcpy(&w, s, len);
+  h = (h ^ w) * 0xff51afd7ed558ccdull;
+  return h ^ (h >> 29);
+}
+
+static size_t find_slot(uint64_t hash, const char *line, size_t len)
+{
+  size_t i = (size_t)hash & (capacity - 1);
+  while (table[i] && (table[i]->hash != hash || table[i]->len != len || memcmp(table[i]->line, line, len) != 0))
+    i = (i + 1) & (capacity - 1);
+  return i;
+}
+
+static void unlink_entry(Entry *e)
+{
+  *(e->prev ? &e->prev->next : &mru) = e->next;
+  *(e->next ? &e->next->prev : &lru) = e->prev;
+}
+
+static void push_front(Entry *e)
+{
+  e->prev = NULL;
+  e->next = mru;
+  *(mru ? &mru->prev : &lru) = e;
+  mru = e;
+}
+
+static void free_entry(Entry *e)
+{
+  free(e->line);
+  free(e->cmd);
+  free(e);
+}
+
+/* Take an entry out of the table, re-inserting the rest of its probe
+ * chain so that lookups don't stop early
+ */
+static void remove_entry(Entry *e)
+{
+  size_t i = find_slot(e->hash, e->line, e->len);
+  table[i] = NULL;
+  used--;
+  for (i = (i + 1) & (capacity - 1); table[i]; i = (i + 1) & (capacity - 1))
+  {
+    Entry *moved = table[i];
+    table[i] = NULL;
+    table[find_slot(moved->hash, moved->line, moved->len)] = moved;
+  }
+  unlink_entry(e);
+  free_entry(e);
+}
+
+/* Make the table big enough for the current limit */
+static int grow(void)
+{
+  size_t newcap = 16;
+  while (newcap < 2 * limit)
+    newcap *= 2;
+  if (newcap <= capacity)
+    return 0;
+
+  Entry **old = table;
+  size_t oldcap = capacity;
+  table = calloc(newcap, sizeof(*table));
+  if (table == NULL)
+  {
+    table = old;
+    return -1;
+  }
+  capacity = newcap;
+  for (size_t i = 0; i < oldcap; i++)
+  {
+    if (old[i])
+      table[find_slot(old[i]->hash, old[i]->line, old[i]->len)] = old[i];
+  }
+  free(old);
+  return 0;
+}
+
+/* The cached Command for line (len bytes), or NULL on a miss. It stays
+ * valid until the next cmdcache_put(), and whoever runs it must leave it
+ * as it was.
+ */
+Command *cmdcache_get(const char *line, size_t len)
+{
+  if (used == 0 || limit == 0)
+    return NULL;
+
+  uint64_t hash = hash_line(line, len);
+  Entry *e = table[find_slot(hash, line, len)];
+  if (e == NULL)
+    return NULL;
+  if (e != mru)
+  {
+    unlink_entry(e);
+    push_front(e);
+  }
+  return e->cmd;
+}
+
+/* Remember the parse of line, evicting least recently used entries if
+ * the cache is full.
+ */
+void cmdcache_put(const char *line, size_t len, const Command *cmd)
+{
+  // Shrinking the cache takes effect here rather than in "set", which
+  // may itself be running from a cached Command.
+  while (used > 0 && used >= limit)
+    remove_entry(lru);
+  if (limit == 0 || grow() != 0)
+    return;
+
+  uint64_t hash = hash_line(line, len);
+  size_t slot = find_slot(hash, line, len);
+  if (table[slot])
+    return; // already there
+
+  Entry *e = malloc(sizeof(Entry));
+  if (e == NULL || (e->line = malloc(len + 1)) == NULL || (e->cmd = cmd_clone(cmd)) == NULL)
+  {
+    if (e)
+      free(e->line);
+    free(e);
+    return;
+  }
+  memcpy(e->line, line, len + 1);
+  e->len = len;
+  e->hash = hash;
+  table[slot] = e;
+  used++;
+  push_front(e);
+}
+
+/* "set cmdcache <entries>", 0 to turn the cache off */
+int cmdcache_set_size(const char *value)
+{
+  char *end;
+  long n = strtol(value, &end, 10);
+  if (*value == '\0' || *end != '\0' || n < 0 || n > 1 << 20)
+    return -1;
+  limit = (size_t)n;
+  return 0;
+}
+
+const char *cmdcache_get_size(void)
+{
+  static char buf[24];
+  snprintf(buf, sizeof(buf), "%zu", limit);
+  return buf;
+}
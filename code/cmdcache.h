@@ -0,0 +1,19 @@
+/* Cache of parsed command lines for batch mode, where scripts run the
+ * same lines over and over. Entries are keyed by a hash of the stripped
+ * line, hold a self-contained copy of its Command (see cmd_clone()) and
+ * are evicted least recently used first. A hit skips parse() entirely and
+ * hands out the cached Command itself, no copy.
+ */
+#ifndef CMDCACHE_H
+#define CMDCACHE_H
+
+#include "parse.h"
+
+#include <stddef.h>
+
+extern Command *cmdcache_get(const char *line, size_t len);
+extern void cmdcache_put(const char *line, size_t len, const Command *cmd);
+extern int cmdcache_set_size(const char *value);
+extern const char *cmdcache_get_size(void);
+
+#endif
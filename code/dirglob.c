@@ -0,0 +1,413 @@
+/* Glob expansion over cached directory listings, see dirglob.h */
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "dirglob.h"
+
+#define DENTS_SIZE (256 * 1024) // bytes asked of each getdents64()
+
+struct linux_dirent64
+{
+  uint64_t d_ino;
+  int64_t d_off;
+  unsigned short d_reclen;
+  unsigned char d_type;
+  char d_name[];
+};
+
+/* The names of one directory, sorted. Each name in buf is preceded by a
+ * byte holding its d_type, so names[i][-1] is the type of names[i].
+ */
+typedef struct listing
+{
+  dev_t dev;
+  ino_t ino;
+  struct timespec mtime;
+  int racy; // read too soon after it changed to trust the mtime
+  int busy; // the expansion running now is going through it
+  size_t n;
+  char **names;
+  char *buf;
+  struct listing *prev, *next; // LRU list, most recently used first
+} Listing;
+
+static Listing *mru, *lru;
+static size_t cached;
+static size_t limit = 64; // directories; 0 keeps none between expansions
+
+static char *dents; // getdents64() buffer, allocated on first use
+
+/* Matches of the word being expanded, NUL separated in buf */
+typedef struct
+{
+  char *buf;
+  size_t len, cap;
+  size_t *off;
+  size_t n, ncap;
+  int failed; // out of memory
+} Matches;
+
+static int has_magic(const char *s, size_t len)
+{
+  for (size_t i = 0; i < len; i++)
+  {
+    if (s[i] == '*' || s[i] == '?' || s[i] == '[')
+      return 1;
+  }
+  return 0;
+}
+
+static int by_name(const void *a, const void *b)
+{
+  return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+static void unlink_listing(Listing *l)
+{
+  *(l->prev ? &l->prev->next : &mru) = l->next;
+  *(l->next ? &l->next->prev : &lru) = l->prev;
+}
+
+static void push_front(Listing *l)
+{
+  l->prev = NULL;
+  l->next = mru;
+  *(mru ? &mru->prev : &lru) = l;
+  mru = l;
+}
+
+static void drop_listing(Listing *l)
+{
+  unlink_listing(l);
+  cached--;
+  free(l->names);
+  free(l->buf);
+  free(l);
+}
+
+/* Evict least recently used listings down to the limit, except the ones
+ * the running expansion is still going through
+ */
+static void trim(void)
+{
+  Listing *l = lru;
+  while (l && cached > limit)
+  {
+    Listing *prev = l->prev;
+    if (!l->busy)
+      drop_listing(l);
+    l = prev;
+  }
+}
+
+/* Read the directory open at fd. A listing read within a couple of
+ * seconds of the directory's last change is marked racy: an entry added
+ * in the same timestamp tick would not move the mtime, so it is read
+ * again next time.
+ */
+static Listing *read_listing(int fd, const struct stat *st)
+{
+  size_t cap = 0, noffs = 0, ncap = 0;
+  size_t *offs = NULL;
+  Listing *l = calloc(1, sizeof(Listing));
+  if (l == NULL || (dents == NULL && (dents = malloc(DENTS_SIZE)) == NULL))
+    goto fail;
+
+  size_t len = 0;
+  long got;
+  while ((got = syscall(SYS_getdents64, fd, dents, DENTS_SIZE)) > 0)
+  {
+    for (long pos = 0; pos < got;)
+    {
+      struct linux_dirent64 *d = (struct linux_dirent64 *)(dents + pos);
+      pos += d->d_reclen;
+      const char *name = d->d_name;
+      if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0')))
+        continue;
+
+      size_t size = strlen(name) + 2; // type byte and NUL
+      if (len + size > cap)
+      {
+        cap = cap ? 2 * cap : 16384;
+        while (cap < len + size)
+          cap *= 2;
+        char *p = realloc(l->buf, cap);
+        if (p == NULL)
+          goto fail;
+        l->buf = p;
+      }
+      if (noffs == ncap)
+      {
+        ncap = ncap ? 2 * ncap : 256;
+        size_t *p = realloc(offs, ncap * sizeof(size_t));
+        if (p == NULL)
+          goto fail;
+        offs = p;
+      }
+      l->buf[len] = (char)d->d_type;
+      memcpy(l->buf + len + 1, name, size - 1);
+      offs[noffs++] = len + 1;
+      len += size;
+    }
+  }
+  if (got < 0 || (noffs > 0 && (l->names = malloc(noffs * sizeof(char *))) == NULL))
+    goto fail;
+
+  // Only now is buf where it stays
+  for (size_t i = 0; i < noffs; i++)
+    l->names[i] = l->buf + offs[i];
+  qsort(l->names, noffs, sizeof(char *), by_name);
+  free(offs);
+
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+  l->n = noffs;
+  l->dev = st->st_dev;
+  l->ino = st->st_ino;
+  l->mtime = st->st_mtim;
+  l->racy = now.tv_sec - st->st_mtim.tv_sec < 2;
+  return l;
+
+fail:
+  if (l)
+    free(l->buf);
+  free(l);
+  free(offs);
+  return NULL;
+}
+
+/* The listing of dir, from the cache while the directory is unchanged.
+ * It is returned busy, so it stays put until the caller is done with it.
+ */
+static Listing *get_listing(const char *dir)
+{
+  int fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  struct stat st;
+  if (fd < 0)
+    return NULL;
+  if (fstat(fd, &st) != 0)
+  {
+    close(fd);
+    return NULL;
+  }
+
+  Listing *l = mru;
+  while (l && (l->dev != st.st_dev || l->ino != st.st_ino))
+    l = l->next;
+  // One the expansion is going through (reached again through a link)
+  // stays as it is until the expansion is done
+  if (l && !l->busy &&
+      (l->racy || l->mtime.tv_sec != st.st_mtim.tv_sec || l->mtime.tv_nsec != st.st_mtim.tv_nsec))
+  {
+    drop_listing(l);
+    l = NULL;
+  }
+
+  if (l == NULL)
+  {
+    l = read_listing(fd, &st);
+    if (l)
+    {
+      push_front(l);
+      cached++;
+      l->busy++;
+      trim();
+    }
+  }
+  else
+  {
+    if (l != mru)
+    {
+      unlink_listing(l);
+      push_front(l);
+    }
+    l->busy++;
+  }
+  close(fd);
+  return l;
+}
+
+static void add_match(Matches *m, const char *path, size_t len)
+{
+  if (m->failed)
+    return;
+  if (m->len + len + 1 > m->cap)
+  {
+    size_t cap = m->cap ? 2 * m->cap : 4096;
+    while (cap < m->len + len + 1)
+      cap *= 2;
+    char *p = realloc(m->buf, cap);
+    if (p == NULL)
+    {
+      m->failed = 1;
+      return;
+    }
+    m->buf = p;
+    m->cap = cap;
+  }
+  if (m->n == m->ncap)
+  {
+    size_t ncap = m->ncap ? 2 * m->ncap : 64;
+    size_t *p = realloc(m->off, ncap * sizeof(size_t));
+    if (p == NULL)
+    {
+      m->failed = 1;
+      return;
+    }
+    m->off = p;
+    m->ncap = ncap;
+  }
+  memcpy(m->buf + m->len, path, len + 1);
+  m->off[m->n++] = m->len;
+  m->len += len + 1;
+}
+
+static int is_dir(const char *path, unsigned char type)
+{
+  struct stat st;
+  if (type == DT_DIR)
+    return 1;
+  if (type != DT_UNKNOWN && type != DT_LNK)
+    return 0;
+  return stat(path, &st) == 0 && S_ISDIR(st.st_mode);
+}
+
+/* Expand what is left of the word, pattern, below the path[0..plen) built
+ * so far. listed is set if the last component came from a listing, so the
+ * path is known to exist.
+ */
+static void expand(char *path, size_t plen, const char *pattern, int listed, Matches *m)
+{
+  while (*pattern == '/')
+  {
+    if (plen + 1 >= PATH_MAX)
+      return;
+    path[plen++] = *pattern++;
+  }
+  path[plen] = '\0';
+
+  if (*pattern == '\0')
+  {
+    struct stat st;
+    if (listed || stat(path, &st) == 0 || lstat(path, &st) == 0)
+      add_match(m, path, plen);
+    return;
+  }
+
+  const char *end = strchrnul(pattern, '/');
+  size_t clen = (size_t)(end - pattern);
+  if (!has_magic(pattern, clen))
+  {
+    if (plen + clen >= PATH_MAX)
+      return;
+    memcpy(path + plen, pattern, clen);
+    expand(path, plen + clen, end, 0, m);
+    return;
+  }
+
+  char comp[NAME_MAX + 1];
+  if (clen > NAME_MAX)
+    return;
+  memcpy(comp, pattern, clen);
+  comp[clen] = '\0';
+
+  Listing *l = get_listing(plen ? path : ".");
+  if (l == NULL)
+    return;
+
+  // Only names starting with the pattern's literal prefix can match, and
+  // in a sorted listing they are all in one run
+  size_t lit = strcspn(comp, "*?[\\");
+  size_t lo = 0, hi = l->n;
+  while (lo < hi)
+  {
+    size_t mid = lo + (hi - lo) / 2;
+    if (strncmp(l->names[mid], comp, lit) < 0)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  for (size_t i = lo; i < l->n && !m->failed && strncmp(l->names[i], comp, lit) == 0; i++)
+  {
+    const char *name = l->names[i];
+    if (fnmatch(comp, name, FNM_PERIOD) != 0)
+      continue;
+    size_t nlen = strlen(name);
+    if (plen + nlen >= PATH_MAX)
+      continue;
+    memcpy(path + plen, name, nlen + 1);
+    if (*end == '/' && !is_dir(path, (unsigned char)name[-1]))
+      continue;
+    expand(path, plen + nlen, end, 1, m);
+  }
+  l->busy--;
+}
+
+/* Expand word, calling add for every match in sorted order. Returns the
+ * number of matches; 0 (word has no wildcards or matches nothing) means
+ * the word stays as it is.
+ */
+int dirglob_expand(const char *word, GlobAddFn *add, void *ctx)
+{
+  if (!has_magic(word, strlen(word)))
+    return 0;
+
+  char path[PATH_MAX];
+  Matches m = {0};
+  expand(path, 0, word, 0, &m);
+  trim();
+
+  char **v = NULL;
+  if (m.failed || (m.n > 0 && (v = malloc(m.n * sizeof(char *))) == NULL))
+  {
+    perror("glob");
+    m.n = 0;
+  }
+  int sorted = 1;
+  for (size_t i = 0; i < m.n; i++)
+  {
+    v[i] = m.buf + m.off[i];
+    if (i > 0 && strcmp(v[i - 1], v[i]) > 0)
+      sorted = 0;
+  }
+  // A single listing comes out sorted already, nested ones need not
+  if (!sorted)
+    qsort(v, m.n, sizeof(char *), by_name);
+  for (size_t i = 0; i < m.n; i++)
+    add(v[i], strlen(v[i]), ctx);
+
+  free(v);
+  free(m.buf);
+  free(m.off);
+  return (int)m.n;
+}
+
+/* "set globcache <directories>", 0 to keep no listings */
+int dirglob_set_size(const char *value)
+{
+  char *end;
+  long n = strtol(value, &end, 10);
+  if (*value == '\0' || *end != '\0' || n < 0 || n > 1 << 16)
+    return -1;
+  limit = (size_t)n;
+  trim();
+  return 0;
+}
+
+const char *dirglob_get_size(void)
+{
+  static char buf[24];
+  snprintf(buf, sizeof(buf), "%zu", limit);
+  return buf;
+}
@@ -0,0 +1,21 @@
+/* Wildcard expansion of arguments: "*", "?" and "[...]" in any path
+ * component, matched with fnmatch(3); hidden names only match a pattern
+ * that starts with ".". Matches come out sorted, and a word that matches
+ * nothing is left as it is.
+ *
+ * Directories are read with getdents64() in large batches and their
+ * sorted listings kept in an LRU cache keyed by device and inode. A
+ * listing is reused as long as the directory's mtime is unchanged, so
+ * globbing the same big directory again costs an fstat() rather than a
+ * rescan. The globcache option sets how many directories are kept.
+ */
+#ifndef DIRGLOB_H
+#define DIRGLOB_H
+
+#include "parse.h"
+
+extern int dirglob_expand(const char *word, GlobAddFn *add, void *ctx);
+extern int dirglob_set_size(const char *value);
+extern const char *dirglob_get_size(void);
+
+#endif
@@ -0,0 +1,248 @@
+/* signalfd/pidfd/epoll event loop, see event.h */
+
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "event.h"
+
+#define MAX_EVENTS 64
+
+void (*event_sigint_hook)(void);
+
+static int epfd = -1;
+static int sigfd = -1;
+
+// Tags for the epoll sources that are not a stage's pidfd
+static char signal_tag, input_tag;
+
+static int input_fd = -1;   // fd currently registered as input
+static int input_ready;     // set when the input fd fired
+static unsigned unwatched;  // children we could not get a pidfd for
+
+static EventFd **fds; // added with event_add_fd()
+static int nfds, fds_cap;
+
+static struct epoll_event *pending; // events event_run() is handling
+static int npending;
+
+static int pidfd_open(pid_t pid)
+{
+#ifdef SYS_pidfd_open
+  return (int)syscall(SYS_pidfd_open, pid, 0);
+#else
+  (void)pid;
+  errno = ENOSYS;
+  return -1;
+#endif
+}
+
+int event_init(void)
+{
+  sigset_t set;
+  sigemptyset(&set);
+  sigaddset(&set, SIGCHLD);
+  sigaddset(&set, SIGINT);
+
+  // The dispositions must not be SIG_IGN or the signals never get queued
+  signal(SIGCHLD, SIG_DFL);
+  signal(SIGINT, SIG_DFL);
+  if (sigprocmask(SIG_BLOCK, &set, NULL) < 0)
+    return -1;
+
+  sigfd = signalfd(-1, &set, SFD_NONBLOCK | SFD_CLOEXEC);
+  epfd = epoll_create1(EPOLL_CLOEXEC);
+  if (sigfd < 0 || epfd < 0)
+    return -1;
+
+  struct epoll_event ev = {.events = EPOLLIN, .data.ptr = &signal_tag};
+  return epoll_ctl(epfd, EPOLL_CTL_ADD, sigfd, &ev);
+}
+
+/* Get a pidfd for a freshly started stage. If that fails (old kernel, out
+ * of fds) the stage is reaped through the SIGCHLD fallback instead.
+ */
+void event_watch(Stage *st)
+{
+  st->pidfd = pidfd_open(st->pid);
+  if (st->pidfd >= 0)
+  {
+    struct epoll_event ev = {.events = EPOLLIN, .data.ptr = st};
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, st->pidfd, &ev) == 0)
+      return;
+    close(st->pidfd);
+    st->pidfd = -1;
+  }
+  unwatched++;
+}
+
+int event_add_fd(EventFd *ev)
+{
+  if (nfds == fds_cap)
+  {
+    int cap = fds_cap ? 2 * fds_cap : 8;
+    EventFd **p = realloc(fds, cap * sizeof(EventFd *));
+    if (p == NULL)
+      return -1;
+    fds = p;
+    fds_cap = cap;
+  }
+  struct epoll_event e = {.events = EPOLLIN, .data.ptr = ev};
+  if (epoll_ctl(epfd, EPOLL_CTL_ADD, ev->fd, &e) < 0)
+    return -1;
+  fds[nfds++] = ev;
+  return 0;
+}
+
+void event_del_fd(EventFd *ev)
+{
+  for (int i = 0; i < nfds; i++)
+  {
+    if (fds[i] == ev)
+    {
+      epoll_ctl(epfd, EPOLL_CTL_DEL, ev->fd, NULL);
+      fds[i] = fds[--nfds];
+      // It may have fired in the batch being handled
+      for (int j = 0; j < npending; j++)
+      {
+        if (pending[j].data.ptr == ev)
+          pending[j].data.ptr = NULL;
+      }
+      return;
+    }
+  }
+}
+
+static EventFd *find_fd(void *tag)
+{
+  for (int i = 0; i < nfds; i++)
+  {
+    if (fds[i] == tag)
+      return fds[i];
+  }
+  return NULL;
+}
+
+static void reaped(Stage *st)
+{
+  if (st == NULL)
+    return;
+  if (st->pidfd >= 0)
+  {
+    close(st->pidfd); // also takes it out of the epoll set
+    st->pidfd = -1;
+  }
+  else if (unwatched > 0)
+    unwatched--;
+}
+
+static void reap_stage(Stage *st)
+{
+  struct rusage ru;
+  int status;
+  pid_t pid;
+
+  if (st->reaped)
+    return; // already swept up by reap_unwatched()
+  do
+    pid = wait4(st->pid, &status, WNOHANG, &ru);
+  while (pid < 0 && errno == EINTR);
+  if (pid == st->pid)
+    reaped(jobs_reaped(pid, status, &ru));
+}
+
+/* SIGCHLD only matters for children without a pidfd; since we cannot tell
+ * which ones exited, sweep them all into the job table.
+ */
+static void reap_unwatched(void)
+{
+  struct rusage ru;
+  int status;
+  pid_t pid;
+
+  while (unwatched > 0 && (pid = wait4(-1, &status, WNOHANG, &ru)) > 0)
+    reaped(jobs_reaped(pid, status, &ru));
+}
+
+static void handle_signals(void)
+{
+  struct signalfd_siginfo si;
+  int chld = 0, intr = 0;
+
+  while (read(sigfd, &si, sizeof(si)) == sizeof(si))
+  {
+    if (si.ssi_signo == SIGCHLD)
+      chld = 1;
+    else if (si.ssi_signo == SIGINT)
+      intr = 1;
+  }
+  if (chld)
+    reap_unwatched();
+  if (intr && event_sigint_hook)
+    event_sigint_hook();
+}
+
+/* Wait for events for at most timeout_ms (-1 for ever) and handle them */
+void event_run(int timeout_ms)
+{
+  struct epoll_event evs[MAX_EVENTS];
+  int n = epoll_wait(epfd, evs, MAX_EVENTS, timeout_ms);
+
+  struct epoll_event *outer = pending; // in case a handler runs the loop
+  int nouter = npending;
+  pending = evs;
+  npending = n > 0 ? n : 0;
+  for (int i = 0; i < n; i++)
+  {
+    void *tag = evs[i].data.ptr;
+    EventFd *ev;
+    if (tag == NULL)
+      continue; // deleted by an earlier event of the batch
+    if (tag == &signal_tag)
+      handle_signals();
+    else if (tag == &input_tag)
+      input_ready = 1;
+    else if ((ev = find_fd(tag)) != NULL)
+      ev->ready(ev);
+    else
+      reap_stage(tag);
+  }
+  pending = outer;
+  npending = nouter;
+}
+
+void event_wait_job(Job *job)
+{
+  while (job->remaining > 0)
+    event_run(-1);
+}
+
+/* Run the loop until fd has input. The fd is armed one-shot so input that
+ * arrives while a foreground job runs does not spin the loop.
+ */
+void event_wait_input(int fd)
+{
+  struct epoll_event ev = {.events = EPOLLIN | EPOLLONESHOT, .data.ptr = &input_tag};
+
+  if (fd != input_fd)
+  {
+    if (input_fd >= 0)
+      epoll_ctl(epfd, EPOLL_CTL_DEL, input_fd, NULL);
+    input_fd = -1;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) < 0)
+      return; // EPERM: a regular file, always readable
+    input_fd = fd;
+  }
+  else if (epoll_ctl(epfd, EPOLL_CTL_MOD, fd, &ev) < 0)
+    return;
+
+  input_ready = 0;
+  while (!input_ready)
+    event_run(-1);
+}
@@ -0,0 +1,36 @@
+/* Event loop. SIGCHLD and SIGINT are blocked for good and read from a
+ * signalfd; every started stage gets a pidfd, and epoll waits on those,
+ * the signalfd and the shell's input together. Children are therefore
+ * reaped one by one from the loop, never from a signal handler, and a
+ * burst of exits is never merged into a single notification.
+ */
+#ifndef EVENT_H
+#define EVENT_H
+
+#include "jobs.h"
+#include "spawn.h"
+
+extern int event_init(void);
+extern void event_watch(Stage *st);
+extern void event_run(int timeout_ms);
+extern void event_wait_job(Job *job);
+extern void event_wait_input(int fd);
+
+/* Any other fd for the loop to watch: ready is called from the loop while
+ * fd is readable (or at end of file), until event_del_fd(). That may be
+ * called from anywhere, even while the loop is handling events, but not
+ * from inside ev's own ready.
+ */
+typedef struct event_fd
+{
+  int fd;
+  void (*ready)(struct event_fd *ev);
+} EventFd;
+
+extern int event_add_fd(EventFd *ev);
+extern void event_del_fd(EventFd *ev);
+
+/* Called from the loop when the shell itself receives SIGINT */
+extern void (*event_sigint_hook)(void);
+
+#endif
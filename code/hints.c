@@ -0,0 +1,330 @@
+/* Per-stage scheduling hints, see hints.h */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "hints.h"
+
+// From <linux/mempolicy.h>, which not every libc installs
+#define MPOL_DEFAULT 0
+#define MPOL_INTERLEAVE 3
+#define MPOL_LOCAL 4
+
+#define NODE_DIR "/sys/devices/system/node"
+
+typedef enum
+{
+  AFFINITY_OFF,
+  AFFINITY_LIST, // every stage on affinity_list
+  AFFINITY_PACK, // one CPU per stage, see hints_plan()
+} Affinity;
+
+static Affinity affinity;
+static cpu_set_t affinity_list;
+static char affinity_text[128] = "off";
+static int nice_inc;
+static int sched_policy = SCHED_OTHER;
+static int numa_mode = MPOL_DEFAULT;
+
+/* CPUs the shell may run on, grouped by NUMA node; for "pack". Entry i
+ * belongs to the node whose entries are group_start[i] .. group_end[i]-1.
+ */
+static int *cpu_order;
+static int *group_start, *group_end;
+static int ncpus, largest_group;
+static unsigned next_cpu; // where the next packed pipeline starts
+
+static cpu_set_t *plan; // CPU of each stage of the pipeline being started
+static int plan_cap, plan_len;
+
+/* "0-3,8" into set. Returns -1 if it is not a list of CPUs. */
+static int parse_list(const char *s, cpu_set_t *set)
+{
+  CPU_ZERO(set);
+  while (*s)
+  {
+    char *end;
+    long lo = strtol(s, &end, 10), hi = lo;
+    if (end == s || lo < 0)
+      return -1;
+    if (*end == '-')
+    {
+      s = end + 1;
+      hi = strtol(s, &end, 10);
+      if (end == s || hi < lo)
+        return -1;
+    }
+    if (hi >= CPU_SETSIZE)
+      return -1;
+    for (long c = lo; c <= hi; c++)
+      CPU_SET((int)c, set);
+    s = end;
+    if (*s == ',')
+      s++;
+    else if (*s && *s != '\n')
+      return -1;
+    else
+      break;
+  }
+  return 0;
+}
+
+static int read_list(const char *path, cpu_set_t *set)
+{
+  char buf[4096];
+  FILE *f = fopen(path, "re");
+  if (f == NULL)
+    return -1;
+  int ok = fgets(buf, sizeof(buf), f) != NULL;
+  fclose(f);
+  return ok ? parse_list(buf, set) : -1;
+}
+
+/* Order the CPUs the shell may use by node, for "pack" */
+static int load_topology(void)
+{
+  cpu_set_t allowed, nodes, node_cpus, placed;
+  if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0)
+    return -1;
+  int n = CPU_COUNT(&allowed);
+
+  free(cpu_order);
+  free(group_start);
+  free(group_end);
+  cpu_order = malloc(n * sizeof(int));
+  group_start = malloc(n * sizeof(int));
+  group_end = malloc(n * sizeof(int));
+  if (cpu_order == NULL || group_start == NULL || group_end == NULL)
+    return -1;
+
+  // Nodes in order, then whatever sysfs did not place (no NUMA support)
+  CPU_ZERO(&placed);
+  ncpus = largest_group = 0;
+  int have_nodes = read_list(NODE_DIR "/online", &nodes) == 0;
+  for (int node = 0; node <= CPU_SETSIZE; node++)
+  {
+    char path[64];
+    if (node < CPU_SETSIZE)
+    {
+      if (!have_nodes || !CPU_ISSET(node, &nodes))
+        continue;
+      snprintf(path, sizeof(path), NODE_DIR "/node%d/cpulist", node);
+      if (read_list(path, &node_cpus) != 0)
+        continue;
+    }
+    else
+      CPU_XOR(&node_cpus, &allowed, &placed);
+
+    int start = ncpus;
+    for (int c = 0; c < CPU_SETSIZE; c++)
+    {
+      if (CPU_ISSET(c, &node_cpus) && CPU_ISSET(c, &allowed) && !CPU_ISSET(c, &placed))
+      {
+        CPU_SET(c, &placed);
+        cpu_order[ncpus++] = c;
+      }
+    }
+    for (int i = start; i < ncpus; i++)
+    {
+      group_start[i] = start;
+      group_end[i] = ncpus;
+    }
+    if (ncpus - start > largest_group)
+      largest_group = ncpus - start;
+  }
+  return ncpus > 0 ? 0 : -1;
+}
+
+int hints_active(void)
+{
+  return affinity != AFFINITY_OFF || nice_inc != 0 || sched_policy != SCHED_OTHER || numa_mode != MPOL_DEFAULT;
+}
+
+/* Pick the CPUs of a pipeline about to be started, for "pack" */
+void hints_plan(int nstages)
+{
+  plan_len = 0;
+  if (affinity != AFFINITY_PACK || ncpus == 0)
+    return;
+  if (nstages > plan_cap)
+  {
+    cpu_set_t *p = realloc(plan, nstages * sizeof(cpu_set_t));
+    if (p == NULL)
+      return;
+    plan = p;
+    plan_cap = nstages;
+  }
+
+  // Move on to the next node if the rest of this one is too small
+  int start = (int)(next_cpu % (unsigned)ncpus);
+  if (nstages <= largest_group)
+  {
+    for (int tries = 0; tries < ncpus && group_end[start] - start < nstages; tries++)
+      start = group_end[start] % ncpus;
+  }
+
+  for (int i = 0; i < nstages; i++)
+  {
+    CPU_ZERO(&plan[i]);
+    CPU_SET(cpu_order[(start + i) % ncpus], &plan[i]);
+  }
+  plan_len = nstages;
+  next_cpu = (unsigned)(start + nstages);
+}
+
+/* CPUs for stage of the planned pipeline, NULL to leave it alone */
+const cpu_set_t *hints_cpus(int stage)
+{
+  if (affinity == AFFINITY_LIST)
+    return &affinity_list;
+  if (affinity == AFFINITY_PACK && stage < plan_len)
+    return &plan[stage];
+  return NULL;
+}
+
+static void set_numa_policy(void)
+{
+  unsigned long mask[CPU_SETSIZE / (8 * sizeof(unsigned long))] = {0};
+  unsigned long maxnode = 0;
+  cpu_set_t nodes;
+
+  if (numa_mode == MPOL_INTERLEAVE)
+  {
+    if (read_list(NODE_DIR "/online", &nodes) != 0)
+      return; // no NUMA here, nothing to interleave over
+    for (int n = 0; n < CPU_SETSIZE; n++)
+    {
+      if (CPU_ISSET(n, &nodes))
+        mask[n / (8 * sizeof(unsigned long))] |= 1ul << (n % (8 * sizeof(unsigned long)));
+    }
+    maxnode = CPU_SETSIZE;
+  }
+  if (syscall(SYS_set_mempolicy, numa_mode, maxnode ? mask : NULL, maxnode) != 0 && errno != ENOSYS)
+    perror("set_mempolicy");
+}
+
+/* In a forked stage, just before it execs */
+void hints_apply(const cpu_set_t *cpus)
+{
+  if (cpus && sched_setaffinity(0, sizeof(cpu_set_t), cpus) != 0)
+    perror("sched_setaffinity");
+  if (sched_policy != SCHED_OTHER)
+  {
+    struct sched_param param = {.sched_priority = 0};
+    if (sched_setscheduler(0, sched_policy, &param) != 0)
+      perror("sched_setscheduler");
+  }
+  if (nice_inc != 0)
+  {
+    errno = 0;
+    if (nice(nice_inc) == -1 && errno != 0)
+      perror("nice");
+  }
+  if (numa_mode != MPOL_DEFAULT)
+    set_numa_policy();
+}
+
+int hints_set_affinity(const char *value)
+{
+  if (strlen(value) >= sizeof(affinity_text))
+    return -1;
+  if (strcmp(value, "off") == 0)
+    affinity = AFFINITY_OFF;
+  else if (strcmp(value, "pack") == 0)
+  {
+    if (load_topology() != 0)
+      return -1;
+    affinity = AFFINITY_PACK;
+  }
+  else
+  {
+    // Only CPUs the shell itself may use
+    cpu_set_t list, allowed;
+    if (parse_list(value, &list) != 0 || sched_getaffinity(0, sizeof(allowed), &allowed) != 0)
+      return -1;
+    CPU_AND(&list, &list, &allowed);
+    if (CPU_COUNT(&list) == 0)
+      return -1;
+    affinity_list = list;
+    affinity = AFFINITY_LIST;
+  }
+  strcpy(affinity_text, value);
+  return 0;
+}
+
+const char *hints_get_affinity(void)
+{
+  return affinity_text;
+}
+
+int hints_set_nice(const char *value)
+{
+  char *end;
+  long n = strtol(value, &end, 10);
+  if (*value == '\0' || *end != '\0' || n < -20 || n > 19)
+    return -1;
+  nice_inc = (int)n;
+  return 0;
+}
+
+const char *hints_get_nice(void)
+{
+  static char buf[8];
+  snprintf(buf, sizeof(buf), "%d", nice_inc);
+  return buf;
+}
+
+static const struct
+{
+  const char *name;
+  int policy;
+} policies[] = {
+    {"other", SCHED_OTHER},
+    {"batch", SCHED_BATCH},
+    {"idle", SCHED_IDLE},
+};
+
+int hints_set_sched(const char *value)
+{
+  for (size_t i = 0; i < sizeof(policies) / sizeof(policies[0]); i++)
+  {
+    if (strcmp(policies[i].name, value) == 0)
+    {
+      sched_policy = policies[i].policy;
+      return 0;
+    }
+  }
+  return -1;
+}
+
+const char *hints_get_sched(void)
+{
+  for (size_t i = 0; i < sizeof(policies) / sizeof(policies[0]); i++)
+  {
+    if (policies[i].policy == sched_policy)
+      return policies[i].name;
+  }
+  return "other";
+}
+
+int hints_set_numa(const char *value)
+{
+  if (strcmp(value, "off") == 0)
+    numa_mode = MPOL_DEFAULT;
+  else if (strcmp(value, "local") == 0)
+    numa_mode = MPOL_LOCAL;
+  else if (strcmp(value, "interleave") == 0)
+    numa_mode = MPOL_INTERLEAVE;
+  else
+    return -1;
+  return 0;
+}
+
+const char *hints_get_numa(void)
+{
+  return numa_mode == MPOL_LOCAL ? "local" : numa_mode == MPOL_INTERLEAVE ? "interleave" : "off";
+}
@@ -0,0 +1,31 @@
+/* Scheduling hints for pipeline stages, set with the affinity, nice, sched
+ * and numa shell options. Each forked stage applies them to itself right
+ * before it execs, so stages that get hints are always started with the
+ * fork engine (posix_spawn() has no room for them).
+ *
+ * affinity is "off", a CPU list ("0-3,8") every stage is confined to, or
+ * "pack": every stage pinned to a CPU of its own, neighbours in the
+ * pipeline on neighbouring CPUs of one NUMA node where the pipeline fits,
+ * so pipe traffic stays in a shared cache. Successive pipelines move on
+ * to the next CPUs.
+ */
+#ifndef HINTS_H
+#define HINTS_H
+
+#include <sched.h>
+
+extern int hints_active(void);
+extern void hints_plan(int nstages);
+extern const cpu_set_t *hints_cpus(int stage);
+extern void hints_apply(const cpu_set_t *cpus);
+
+extern int hints_set_affinity(const char *value);
+extern const char *hints_get_affinity(void);
+extern int hints_set_nice(const char *value);
+extern const char *hints_get_nice(void);
+extern int hints_set_sched(const char *value);
+extern const char *hints_get_sched(void);
+extern int hints_set_numa(const char *value);
+extern const char *hints_get_numa(void);
+
+#endif
@@ -0,0 +1,438 @@
+/* History ring and history file, see histstore.h */
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "histstore.h"
+#include "lineedit.h"
+
+#define BUCKET_BITS 9 // 512 trigram buckets in the search index
+#define NBUCKETS (1u << BUCKET_BITS)
+#define MAX_QUERY_TRIGRAMS 64
+
+typedef struct
+{
+  const char *text; // not NUL terminated, may point into the loaded block
+  size_t len;
+  uint32_t hash;
+  int owned; // text was malloc'ed
+  int live;  // cleared when evicted or entered again
+} Entry;
+
+static size_t limit = 1000; // histsize
+
+/* Entries in the order they were entered. Dead ones stay in place until
+ * the array fills up and compact() squeezes them out, so slot numbers are
+ * stable between two hist_add() calls.
+ */
+static Entry *slots;
+static size_t nslots, maxslots;
+static size_t first; // no live entry below this slot
+static size_t live;
+
+/* index[b] is a bitmap over the slots holding a trigram that hashes to
+ * bucket b. A query's candidates are the AND of its trigrams' buckets.
+ */
+static uint64_t *index_bits;
+static size_t words; // per bucket
+
+static int histfd = -1; // history file, append only
+
+static uint32_t line_hash(const char *s, size_t len)
+{
+  uint32_t h = 2166136261u; // FNV-1a
+  for (size_t i = 0; i < len; i++)
+    h = (h ^ (unsigned char)s[i]) * 16777619u;
+  return h;
+}
+
+static unsigned trigram_bucket(const char *p)
+{
+  uint32_t t = (unsigned char)p[0] | (unsigned char)p[1] << 8 | (uint32_t)(unsigned char)p[2] << 16;
+  return (t * 2654435769u) >> (32 - BUCKET_BITS);
+}
+
+static void index_update(size_t slot, int on)
+{
+  const Entry *e = &slots[slot];
+  uint64_t bit = (uint64_t)1 << (slot % 64);
+  for (size_t i = 0; i + 3 <= e->len; i++)
+  {
+    uint64_t *w = &index_bits[trigram_bucket(e->text + i) * words + slot / 64];
+    *w = on ? *w | bit : *w & ~bit;
+  }
+}
+
+/* NUL terminated copy of an entry, valid until the next call */
+static const char *entry_string(const Entry *e)
+{
+  static char *buf;
+  static size_t cap;
+  if (e->len + 1 > cap)
+  {
+    char *p = realloc(buf, e->len + 1);
+    if (p == NULL)
+      return "";
+    buf = p;
+    cap = e->len + 1;
+  }
+  memcpy(buf, e->text, e->len);
+  buf[e->len] = '\0';
+  return buf;
+}
+
+/* Drop a live entry, from readline's list too once it is loaded */
+static void entry_kill(size_t slot)
+{
+  int pos = 0;
+  for (size_t i = first; i < slot; i++)
+    pos += slots[i].live;
+  HIST_ENTRY *h = rl.loaded ? rl.remove_history(pos) : NULL;
+  if (h)
+    rl.free_history_entry(h);
+
+  Entry *e = &slots[slot];
+  index_update(slot, 0);
+  if (e->owned)
+    free((char *)e->text);
+  e->live = 0;
+  live--;
+  while (first < nslots && !slots[first].live)
+    first++;
+}
+
+/* Squeeze out dead entries, resizing for the current limit */
+static int compact(void)
+{
+  size_t newmax = 2 * limit;
+  size_t n = 0;
+  for (size_t i = first; i < nslots; i++)
+  {
+    if (slots[i].live)
+      slots[n++] = slots[i];
+  }
+  if (newmax != maxslots)
+  {
+    Entry *s = realloc(slots, (newmax ? newmax : 1) * sizeof(Entry));
+    if (s == NULL)
+      return -1;
+    slots = s;
+    maxslots = newmax;
+  }
+  nslots = n;
+  first = 0;
+
+  words = (maxslots + 63) / 64;
+  free(index_bits);
+  index_bits = calloc(NBUCKETS * (words ? words : 1), sizeof(uint64_t));
+  if (index_bits == NULL)
+    return -1;
+  for (size_t i = 0; i < nslots; i++)
+    index_update(i, 1);
+  return 0;
+}
+
+static void evict_to_limit(void)
+{
+  while (live > limit)
+    entry_kill(first);
+}
+
+/* Append an entry (and to readline's list). Takes ownership of text if
+ * owned is set.
+ */
+static int entry_add(const char *text, size_t len, uint32_t hash, int owned)
+{
+  if (nslots == maxslots && compact() != 0)
+    return -1;
+  Entry *e = &slots[nslots];
+  e->text = text;
+  e->len = len;
+  e->hash = hash;
+  e->owned = owned;
+  e->live = 1;
+  index_update(nslots, 1);
+  nslots++;
+  live++;
+  if (rl.loaded)
+    rl.add_history(entry_string(e));
+  evict_to_limit();
+  return 0;
+}
+
+static ssize_t find_entry(const char *text, size_t len, uint32_t hash)
+{
+  for (size_t i = nslots; i-- > first;)
+  {
+    const Entry *e = &slots[i];
+    if (e->live && e->hash == hash && e->len == len && memcmp(e->text, text, len) == 0)
+      return (ssize_t)i;
+  }
+  return -1;
+}
+
+/* Replace the file with the lines in the ring, once most of it is stale */
+static void rewrite_file(const char *path)
+{
+  size_t plen = strlen(path);
+  char *tmp = malloc(plen + 5);
+  if (tmp == NULL)
+    return;
+  memcpy(tmp, path, plen);
+  memcpy(tmp + plen, ".new", 5);
+
+  int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+  int ok = fd >= 0;
+  for (size_t i = first; ok && i < nslots; i++)
+  {
+    if (!slots[i].live)
+      continue;
+    struct iovec iov[2] = {{(void *)slots[i].text, slots[i].len}, {"\n", 1}};
+    ok = writev(fd, iov, 2) == (ssize_t)(slots[i].len + 1);
+  }
+  if (fd >= 0 && close(fd) != 0)
+    ok = 0;
+  if (!ok || rename(tmp, path) != 0)
+    unlink(tmp);
+  free(tmp);
+}
+
+/* Map the file and take the newest distinct lines from its tail. They are
+ * copied to one block that is kept for good, the loaded entries point into
+ * it: pages of a mapping raise SIGBUS once the file is truncated under it,
+ * by "history -c" in another session or by anything else.
+ */
+static void load_file(const char *path)
+{
+  if (limit == 0)
+    return;
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return;
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size <= 0)
+  {
+    close(fd);
+    return;
+  }
+  size_t size = (size_t)st.st_size;
+  const char *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED)
+    return;
+
+  // Walk back line by line. Newest first, so later copies of a line win;
+  // seen is a set of found[] indexes (plus one) keyed by line hash.
+  size_t setsize = 2;
+  while (setsize < 2 * limit)
+    setsize *= 2;
+  Entry *found = malloc(limit * sizeof(Entry));
+  uint32_t *seen = calloc(setsize, sizeof(uint32_t));
+  if (found == NULL || seen == NULL)
+  {
+    free(found);
+    free(seen);
+    munmap((void *)map, size);
+    return;
+  }
+  size_t nfound = 0, end = size;
+  while (nfound < limit && end > 0)
+  {
+    const char *nl = end > 1 ? memrchr(map, '\n', end - 1) : NULL;
+    size_t start = nl ? (size_t)(nl - map) + 1 : 0;
+    size_t len = end - start;
+    if (map[end - 1] == '\n')
+      len--;
+    end = start;
+    if (len == 0)
+      continue;
+
+    uint32_t hash = line_hash(map + start, len);
+    size_t j = hash & (setsize - 1);
+    for (; seen[j]; j = (j + 1) & (setsize - 1))
+    {
+      const Entry *f = &found[seen[j] - 1];
+      if (f->hash == hash && f->len == len && memcmp(f->text, map + start, len) == 0)
+        break;
+    }
+    if (seen[j] == 0)
+    {
+      found[nfound++] = (Entry){map + start, len, hash, 0, 1};
+      seen[j] = (uint32_t)nfound;
+    }
+  }
+  free(seen);
+  size_t kept = 0;
+  for (size_t i = 0; i < nfound; i++)
+    kept += found[i].len + 1;
+  char *block = malloc(kept ? kept : 1), *p = block;
+  for (size_t i = nfound; block && i-- > 0;)
+  {
+    memcpy(p, found[i].text, found[i].len);
+    entry_add(p, found[i].len, found[i].hash, 0);
+    p += found[i].len;
+  }
+  free(found);
+  munmap((void *)map, size);
+  if (block == NULL)
+    return;
+
+  // The rest is duplicates and lines beyond the limit
+  if (kept < size / 2)
+    rewrite_file(path);
+}
+
+/* Load the history file at path (NULL or "" to keep history in memory
+ * only) and append new lines to it from now on.
+ */
+void hist_open(const char *path)
+{
+  if (maxslots == 0 && compact() != 0)
+    return;
+  if (path == NULL || *path == '\0')
+    return;
+  load_file(path);
+  histfd = open(path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+}
+
+void hist_add(const char *line)
+{
+  size_t len = strlen(line);
+  if (limit == 0 || len == 0)
+    return;
+  if (maxslots == 0 && compact() != 0)
+    return;
+
+  // Entering a line again moves it to the front
+  uint32_t hash = line_hash(line, len);
+  ssize_t old = find_entry(line, len, hash);
+  if (old >= 0)
+    entry_kill((size_t)old);
+
+  char *copy = malloc(len);
+  if (copy == NULL)
+    return;
+  memcpy(copy, line, len);
+  if (entry_add(copy, len, hash, 1) != 0)
+  {
+    free(copy);
+    return;
+  }
+
+  // One write per line, so shells sharing the file don't interleave
+  if (histfd >= 0)
+  {
+    struct iovec iov[2] = {{copy, len}, {"\n", 1}};
+    if (writev(histfd, iov, 2) < 0)
+    {
+      close(histfd);
+      histfd = -1;
+    }
+  }
+}
+
+/* Forget every entry, and empty the history file */
+void hist_clear(void)
+{
+  while (live > 0)
+    entry_kill(first);
+  if (rl.loaded)
+    rl.clear_history();
+  if (histfd >= 0 && ftruncate(histfd, 0) != 0)
+    perror("history");
+}
+
+/* One past the highest slot number, the starting point of a search */
+int hist_count(void)
+{
+  return (int)nslots;
+}
+
+/* The entry in slot n, NUL terminated; valid until the next hist_ call */
+const char *hist_get(int n)
+{
+  if (n < 0 || (size_t)n >= nslots || !slots[n].live)
+    return NULL;
+  return entry_string(&slots[n]);
+}
+
+/* Slot of the newest entry below slot before containing text, or -1.
+ * Queries of three or more bytes only look at slots that have all of
+ * the query's trigrams in the index.
+ */
+int hist_search(const char *text, int before)
+{
+  size_t tlen = strlen(text);
+  size_t end = before < 0 ? 0 : (size_t)before;
+  if (end > nslots)
+    end = nslots;
+
+  if (tlen < 3)
+  {
+    for (size_t i = end; i-- > first;)
+    {
+      if (slots[i].live && memmem(slots[i].text, slots[i].len, text, tlen))
+        return (int)i;
+    }
+    return -1;
+  }
+
+  unsigned buckets[MAX_QUERY_TRIGRAMS];
+  size_t nb = 0;
+  for (size_t i = 0; i + 3 <= tlen && nb < MAX_QUERY_TRIGRAMS; i++)
+    buckets[nb++] = trigram_bucket(text + i);
+
+  for (size_t w = (end + 63) / 64; w-- > first / 64;)
+  {
+    uint64_t cand = ~(uint64_t)0;
+    if ((w + 1) * 64 > end)
+      cand = end % 64 ? ((uint64_t)1 << (end % 64)) - 1 : cand;
+    for (size_t b = 0; b < nb && cand; b++)
+      cand &= index_bits[buckets[b] * words + w];
+    while (cand)
+    {
+      int bit = 63 - __builtin_clzll(cand);
+      size_t i = w * 64 + (size_t)bit;
+      if (memmem(slots[i].text, slots[i].len, text, tlen))
+        return (int)i;
+      cand &= ~((uint64_t)1 << bit);
+    }
+  }
+  return -1;
+}
+
+void hist_list(FILE *out)
+{
+  int n = 0;
+  for (size_t i = first; i < nslots; i++)
+  {
+    if (slots[i].live)
+      fprintf(out, "%5d  %.*s\n", ++n, (int)slots[i].len, slots[i].text);
+  }
+}
+
+int hist_set_size(const char *value)
+{
+  char *end;
+  long n = strtol(value, &end, 10);
+  if (*value == '\0' || *end != '\0' || n < 0 || n > 1 << 20)
+    return -1;
+  limit = (size_t)n;
+  if (maxslots == 0)
+    return 0; // nothing loaded yet
+  evict_to_limit();
+  return compact();
+}
+
+const char *hist_get_size(void)
+{
+  static char buf[24];
+  snprintf(buf, sizeof(buf), "%zu", limit);
+  return buf;
+}
@@ -0,0 +1,23 @@
+/* Interactive history: a capped ring of distinct lines, newest last, kept
+ * in step with readline's own history list. Lines are appended to a
+ * history file as they are entered. At startup the file is mapped and
+ * only its tail is read, back to the newest histsize distinct lines, so
+ * loading costs the same however long the file has grown. A trigram index
+ * over the ring makes substring searches skip most entries.
+ */
+#ifndef HISTSTORE_H
+#define HISTSTORE_H
+
+#include <stdio.h>
+
+extern void hist_open(const char *path);
+extern void hist_add(const char *line);
+extern void hist_clear(void);
+extern int hist_count(void);
+extern const char *hist_get(int n);
+extern int hist_search(const char *text, int before);
+extern void hist_list(FILE *out);
+extern int hist_set_size(const char *value);
+extern const char *hist_get_size(void);
+
+#endif
@@ -0,0 +1,142 @@
+/* Buffered line reader, see input.h */
+
+#include <ctype.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "input.h"
+
+#define READER_BLOCK (64 * 1024)
+
+static void reserve(LineReader *r, size_t need)
+{
+  if (r->cap >= need)
+    return;
+  size_t cap = r->cap ? r->cap : READER_BLOCK;
+  while (cap < need)
+    cap *= 2;
+  r->buf = realloc(r->buf, cap);
+  if (r->buf == NULL)
+  {
+    perror("reader");
+    exit(1);
+  }
+  r->cap = cap;
+}
+
+void reader_open_fd(LineReader *r, int fd)
+{
+  memset(r, 0, sizeof(*r));
+  r->fd = fd;
+  reserve(r, READER_BLOCK + 1);
+}
+
+void reader_open_string(LineReader *r, const char *s)
+{
+  size_t len = strlen(s);
+  memset(r, 0, sizeof(*r));
+  r->fd = -1;
+  reserve(r, len + 1);
+  memcpy(r->buf, s, len);
+  r->end = len;
+  r->eof = 1;
+}
+
+/* Fill the buffer with another block, moving the unread tail to the
+ * front first. Returns 0 at end of input.
+ */
+static int fill(LineReader *r)
+{
+  if (r->eof)
+    return 0;
+
+  if (r->start > 0)
+  {
+    memmove(r->buf, r->buf + r->start, r->end - r->start);
+    r->end -= r->start;
+    r->start = 0;
+  }
+  // Always leave room for a block plus the terminating NUL
+  reserve(r, r->end + READER_BLOCK + 1);
+
+  if (r->wait)
+    r->wait(r->fd);
+
+  ssize_t n;
+  do
+    n = read(r->fd, r->buf + r->end, r->cap - r->end - 1);
+  while (n < 0 && errno == EINTR);
+
+  if (n <= 0)
+  {
+    if (n < 0)
+      perror("read");
+    r->eof = 1;
+    return 0;
+  }
+  r->end += (size_t)n;
+  return 1;
+}
+
+/* Returns the next line without its newline, or NULL at end of input.
+ * The line stays valid (and writable) until the next call.
+ */
+char *reader_getline(LineReader *r)
+{
+  size_t scanned = r->start;
+
+  for (;;)
+  {
+    char *nl = memchr(r->buf + scanned, '\n', r->end - scanned);
+    if (nl)
+    {
+      char *line = r->buf + r->start;
+      *nl = '\0';
+      r->start = (size_t)(nl - r->buf) + 1;
+      return line;
+    }
+    scanned = r->end - r->start;
+    if (!fill(r))
+      break;
+    scanned += r->start;
+  }
+
+  // Last line without a trailing newline
+  if (r->start == r->end)
+    return NULL;
+  char *line = r->buf + r->start;
+  r->buf[r->end] = '\0';
+  r->start = r->end;
+  return line;
+}
+
+/* Whether nothing but blank lines follows the line just returned, known
+ * without reading on: the input is a string, or a regular file read to
+ * its end. A pipe or a terminal may always have more to come.
+ */
+int reader_done(const LineReader *r)
+{
+  for (size_t i = r->start; i < r->end; i++)
+  {
+    if (!isspace((unsigned char)r->buf[i]))
+      return 0;
+  }
+  if (r->eof)
+    return 1;
+
+  struct stat st;
+  off_t pos = lseek(r->fd, 0, SEEK_CUR);
+  return pos >= 0 && fstat(r->fd, &st) == 0 && S_ISREG(st.st_mode) && pos >= st.st_size;
+}
+
+void reader_close(LineReader *r)
+{
+  if (r->fd > STDERR_FILENO)
+    close(r->fd);
+  free(r->buf);
+  memset(r, 0, sizeof(*r));
+}
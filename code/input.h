@@ -0,0 +1,26 @@
+/* Buffered line reader used in batch mode. Input is read in large blocks
+ * and handed out one line at a time, straight from the buffer.
+ */
+#ifndef INPUT_H
+#define INPUT_H
+
+#include <stddef.h>
+
+typedef struct
+{
+  int fd; // -1 when reading from a fixed string
+  char *buf;
+  size_t cap;
+  size_t start; // first byte not yet returned
+  size_t end;   // end of valid data
+  int eof;
+  void (*wait)(int fd); // called before blocking on fd, may be NULL
+} LineReader;
+
+extern void reader_open_fd(LineReader *r, int fd);
+extern void reader_open_string(LineReader *r, const char *s);
+extern char *reader_getline(LineReader *r);
+extern int reader_done(const LineReader *r);
+extern void reader_close(LineReader *r);
+
+#endif
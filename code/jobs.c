@@ -0,0 +1,362 @@
+/* Per-pgid job table, see jobs.h */
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+
+#include "jobs.h"
+#include "timeout.h"
+#include "trace.h"
+
+/* pid -> (job, stage) map, open addressing with linear probing */
+typedef struct
+{
+  pid_t pid; // 0 for a free slot
+  Job *job;
+  int stage;
+} PidSlot;
+
+static PidSlot *pidmap;
+static size_t pidcap; // power of two
+static size_t pidused;
+
+static Job *jobs; // newest last
+static Job **jobs_tail = &jobs;
+static int next_job_id = 1;
+
+void (*jobs_done_hook)(Job *job);
+
+static size_t pid_hash(pid_t pid)
+{
+  // Fibonacci hashing, pids are sequential so spread them out
+  return (size_t)((unsigned)pid * 2654435769u);
+}
+
+static PidSlot *pid_slot(PidSlot *map, size_t cap, pid_t pid)
+{
+  size_t i = pid_hash(pid) & (cap - 1);
+  while (map[i].pid && map[i].pid != pid)
+    i = (i + 1) & (cap - 1);
+  return &map[i];
+}
+
+static int pid_insert(pid_t pid, Job *job, int stage)
+{
+  if (2 * (pidused + 1) > pidcap)
+  {
+    size_t newcap = pidcap ? 2 * pidcap : 64;
+    PidSlot *newmap = calloc(newcap, sizeof(PidSlot));
+    if (newmap == NULL)
+      return -1;
+    for (size_t i = 0; i < pidcap; i++)
+    {
+      if (pidmap[i].pid)
+        *pid_slot(newmap, newcap, pidmap[i].pid) = pidmap[i];
+    }
+    free(pidmap);
+    pidmap = newmap;
+    pidcap = newcap;
+  }
+  PidSlot *s = pid_slot(pidmap, pidcap, pid);
+  s->pid = pid;
+  s->job = job;
+  s->stage = stage;
+  pidused++;
+  return 0;
+}
+
+static void pid_delete(pid_t pid)
+{
+  if (pidcap == 0)
+    return;
+  PidSlot *s = pid_slot(pidmap, pidcap, pid);
+  if (s->pid == 0)
+    return;
+  s->pid = 0;
+  pidused--;
+
+  // Re-insert the rest of the probe chain so lookups don't stop early
+  size_t i = (size_t)(s - pidmap);
+  for (i = (i + 1) & (pidcap - 1); pidmap[i].pid; i = (i + 1) & (pidcap - 1))
+  {
+    PidSlot moved = pidmap[i];
+    pidmap[i].pid = 0;
+    *pid_slot(pidmap, pidcap, moved.pid) = moved;
+  }
+}
+
+/* "ls -l | wc &" style text of a job, built from the stage argvs */
+static char *job_text(Stage *stages, int nstages, int background)
+{
+  size_t len = 3;
+  for (int i = 0; i < nstages; i++)
+  {
+    if (stages[i].hidden)
+      continue;
+    for (char **a = stages[i].argv; *a; a++)
+      len += strlen(*a) + 1;
+    len += 3;
+  }
+
+  char *text = malloc(len);
+  if (text == NULL)
+    return NULL;
+  char *t = text;
+  for (int i = 0; i < nstages; i++)
+  {
+    if (stages[i].hidden)
+      continue;
+    if (t > text)
+      t = stpcpy(t, "| ");
+    for (char **a = stages[i].argv; *a; a++)
+    {
+      t = stpcpy(t, *a);
+      *t++ = ' ';
+    }
+  }
+  if (background)
+    *t++ = '&';
+  else if (t > text)
+    t--;
+  *t = '\0';
+  return text;
+}
+
+/* Register a started pipeline. The job takes ownership of stages. Their
+ * argv pointers are only valid until the next parse(), so for background
+ * jobs they are cleared once the job text has been made.
+ */
+Job *job_add(Stage *stages, int nstages, pid_t pgid, int background)
+{
+  Job *job = calloc(1, sizeof(Job));
+  if (job == NULL)
+    return NULL;
+
+  job->id = next_job_id++;
+  job->pgid = pgid;
+  job->stages = stages;
+  job->nstages = nstages;
+  job->background = background;
+  job->text = job_text(stages, nstages, background);
+
+  for (int i = 0; i < nstages; i++)
+  {
+    if (background)
+      stages[i].argv = NULL;
+    if (stages[i].pid <= 0)
+      continue;
+    if (pid_insert(stages[i].pid, job, i) == 0)
+      job->remaining++;
+  }
+
+  *jobs_tail = job;
+  jobs_tail = &job->next;
+  return job;
+}
+
+/* Whether every stage ran to its end: started, reaped, not killed and
+ * not stopped for running out of time. The capture tee must also have
+ * written everything.
+ */
+static int job_exited(const Job *job)
+{
+  for (int i = 0; i < job->nstages; i++)
+  {
+    const Stage *st = &job->stages[i];
+    if (st->pid <= 0 || !st->reaped || !WIFEXITED(st->status) || (st->hidden && WEXITSTATUS(st->status) != 0))
+      return 0;
+  }
+  return !timeout_expired(job->timer);
+}
+
+void job_remove(Job *job)
+{
+  Job **p = &jobs;
+  while (*p && *p != job)
+    p = &(*p)->next;
+  if (*p == NULL)
+    return;
+  *p = job->next;
+  if (jobs_tail == &job->next)
+    jobs_tail = p;
+
+  for (int i = 0; i < job->nstages; i++)
+  {
+    if (job->stages[i].pid > 0)
+      pid_delete(job->stages[i].pid);
+  }
+
+  // Reuse job numbers once the table drains, like other shells do
+  if (jobs == NULL)
+    next_job_id = 1;
+
+  outcache_finish(job->capture, job_exited(job), job_exit_status(job));
+  cgroup_leaf_free(job->cgroup);
+  timeout_free(job->timer);
+  free(job->stages);
+  free(job->text);
+  free(job);
+}
+
+Job *job_find(int id)
+{
+  for (Job *j = jobs; j; j = j->next)
+  {
+    if (j->id == id)
+      return j;
+  }
+  return NULL;
+}
+
+Job *job_by_pid(pid_t pid)
+{
+  if (pidcap == 0)
+    return NULL;
+  PidSlot *s = pid_slot(pidmap, pidcap, pid);
+  return s->pid ? s->job : NULL;
+}
+
+Job *jobs_first(void)
+{
+  return jobs;
+}
+
+/* Record the wait status of a reaped child. Returns its stage, or NULL if
+ * the pid is not one of ours.
+ */
+Stage *jobs_reaped(pid_t pid, int status, const struct rusage *ru)
+{
+  if (pidcap == 0)
+    return NULL;
+  PidSlot *s = pid_slot(pidmap, pidcap, pid);
+  if (s->pid == 0)
+    return NULL;
+  TRACE(reap, pid);
+
+  Stage *st = &s->job->stages[s->stage];
+  if (!st->reaped)
+  {
+    st->status = status;
+    st->reaped = 1;
+    st->rusage = *ru;
+    clock_gettime(CLOCK_MONOTONIC, &st->finished);
+    // The hook may start new jobs and grow the pid map under s
+    Job *job = s->job;
+    if (--job->remaining == 0 && jobs_done_hook)
+      jobs_done_hook(job);
+  }
+  return st;
+}
+
+static double ts_seconds(const struct timespec *ts)
+{
+  return (double)ts->tv_sec + (double)ts->tv_nsec / 1e9;
+}
+
+static double tv_seconds(const struct timeval *tv)
+{
+  return (double)tv->tv_sec + (double)tv->tv_usec / 1e6;
+}
+
+/* Per-stage and whole-pipeline resource usage, for the "time" prefix.
+ * Wall time of a stage runs from its spawn to its reap; the pipeline's
+ * from the first spawn to the last reap.
+ */
+void job_report_times(const Job *job, FILE *out)
+{
+  double first = 0, last = 0, user = 0, sys = 0;
+  long maxrss = 0, nvcsw = 0, nivcsw = 0;
+  int any = 0, n = 0;
+
+  fprintf(out, "%-6s %9s %9s %9s %10s %8s %8s  %s\n", "stage", "real", "user", "sys", "maxrss", "vcsw", "ivcsw",
+          "command");
+  for (int i = 0; i < job->nstages; i++)
+  {
+    const Stage *st = &job->stages[i];
+    if (st->hidden)
+      continue;
+    n++; // numbered as typed, without hidden stages
+    if (!st->reaped)
+      continue;
+
+    double start = ts_seconds(&st->started), end = ts_seconds(&st->finished);
+    double u = tv_seconds(&st->rusage.ru_utime), s = tv_seconds(&st->rusage.ru_stime);
+    if (!any || start < first)
+      first = start;
+    if (!any || end > last)
+      last = end;
+    any = 1;
+    user += u;
+    sys += s;
+    if (st->rusage.ru_maxrss > maxrss)
+      maxrss = st->rusage.ru_maxrss;
+    nvcsw += st->rusage.ru_nvcsw;
+    nivcsw += st->rusage.ru_nivcsw;
+
+    fprintf(out, "%-6d %8.3fs %8.3fs %8.3fs %8ldKB %8ld %8ld  %s\n", n, end - start, u, s,
+            st->rusage.ru_maxrss, st->rusage.ru_nvcsw, st->rusage.ru_nivcsw, st->argv ? st->argv[0] : "-");
+  }
+  fprintf(out, "%-6s %8.3fs %8.3fs %8.3fs %8ldKB %8ld %8ld  %s\n", "total", last - first, user, sys, maxrss, nvcsw,
+          nivcsw, job->text ? job->text : "");
+}
+
+/* What a finished job is reported with: its times for "time", and what
+ * its cgroup used if it has one and was timed or limited
+ */
+void job_report(const Job *job, FILE *out)
+{
+  if (job->timed)
+    job_report_times(job, out);
+  if (job->cgroup && (job->timed || cgroup_leaf_limited(job->cgroup)))
+    cgroup_leaf_report(job->cgroup, out);
+}
+
+/* Shell-style exit status of the last stage: its exit code, or 128 plus
+ * the signal that killed it. TIMEOUT_STATUS if the job ran out of time.
+ */
+int job_exit_status(const Job *job)
+{
+  const Stage *last = &job->stages[job->nstages - 1];
+  while (last > job->stages && last->hidden)
+    last--;
+  if (timeout_expired(job->timer))
+    return TIMEOUT_STATUS;
+  if (last->pid <= 0)
+    return 127;
+  if (WIFEXITED(last->status))
+    return WEXITSTATUS(last->status);
+  if (WIFSIGNALED(last->status))
+    return 128 + WTERMSIG(last->status);
+  return 0;
+}
+
+/* Drop background jobs that have finished, telling notify (if not NULL)
+ * about each of them.
+ */
+void jobs_collect(FILE *notify)
+{
+  Job *j = jobs;
+  while (j)
+  {
+    Job *next = j->next;
+    if (j->background && j->remaining == 0)
+    {
+      if (notify)
+        fprintf(notify, "[%d]  Done\t\t%s\n", j->id, j->text ? j->text : "");
+      job_report(j, stderr);
+      job_remove(j);
+    }
+    j = next;
+  }
+}
+
+void jobs_list(FILE *out)
+{
+  for (Job *j = jobs; j; j = j->next)
+  {
+    if (!j->background)
+      continue;
+    fprintf(out, "[%d]  %-8s %d\t%s\n", j->id, j->remaining ? "Running" : "Done", (int)j->pgid,
+            j->text ? j->text : "");
+  }
+}
@@ -0,0 +1,61 @@
+/* Job table. Every pipeline the shell starts is a job, keyed by the process
+ * group its stages run in (see execute_pipeline()). A pid -> stage map gives
+ * O(1) lookup from a reaped child back to its job, so foreground and
+ * background children never get mixed up. Children are reaped by the
+ * event loop (event.c), which reports them through jobs_reaped().
+ */
+#ifndef JOBS_H
+#define JOBS_H
+
+#include <stdio.h>
+#include <sys/types.h>
+
+#include "cgroup.h"
+#include "outcache.h"
+#include "spawn.h"
+
+/* What the prefixes of a command line (time, limit, timeout, cache) ask
+ * of its job
+ */
+typedef struct
+{
+  int timed; // report per-stage times once done
+  CgroupLimits limits;
+  long long timeout; // nanoseconds the job may run, 0 for ever
+  int cache;         // "cache" prefix
+  OutEntry *capture; // cache miss whose output is to be kept, or NULL
+} JobOptions;
+
+typedef struct job
+{
+  int id;
+  pid_t pgid;
+  Stage *stages; // owned by the job
+  int nstages;
+  int remaining; // stages started but not reaped yet
+  int background;
+  int timed;  // report per-stage times once done ("time" prefix)
+  int pooled; // started by the job pool, see pool.h
+  CgroupLeaf *cgroup; // the job's own cgroup, or NULL
+  struct job_timer *timer; // its deadline, see timeout.h, or NULL
+  OutEntry *capture; // output being kept for the cache, or NULL
+  char *text; // command line, for the jobs built-in
+  struct job *next;
+} Job;
+
+extern Job *job_add(Stage *stages, int nstages, pid_t pgid, int background);
+extern void job_remove(Job *job);
+extern Job *job_find(int id);
+extern Job *job_by_pid(pid_t pid);
+extern Stage *jobs_reaped(pid_t pid, int status, const struct rusage *ru);
+extern void job_report_times(const Job *job, FILE *out);
+extern void job_report(const Job *job, FILE *out);
+extern int job_exit_status(const Job *job);
+extern void jobs_collect(FILE *notify);
+extern void jobs_list(FILE *out);
+extern Job *jobs_first(void);
+
+/* Called when the last stage of a job has been reaped */
+extern void (*jobs_done_hook)(Job *job);
+
+#endif
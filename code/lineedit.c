@@ -0,0 +1,102 @@
+/* Readline loaded on demand, see lineedit.h */
+
+#include <dlfcn.h>
+#include <stddef.h>
+#include <stdio.h>
+
+#include "lineedit.h"
+
+#ifndef LSH_READLINE_SONAME
+#define LSH_READLINE_SONAME "libreadline.so.8"
+#endif
+
+LineEdit rl;
+
+#ifdef LSH_READLINE_LINKED
+
+/* Linked in: nothing to look up */
+int lineedit_load(void)
+{
+  rl = (LineEdit){
+      .loaded = 1,
+      .readline = readline,
+      .callback_handler_install = rl_callback_handler_install,
+      .callback_handler_remove = rl_callback_handler_remove,
+      .callback_read_char = rl_callback_read_char,
+      .replace_line = rl_replace_line,
+      .on_new_line = rl_on_new_line,
+      .redisplay = rl_redisplay,
+      .ding = rl_ding,
+      .bind_key = rl_bind_key,
+      .add_history = add_history,
+      .remove_history = remove_history,
+      .free_history_entry = free_history_entry,
+      .clear_history = clear_history,
+      .catch_signals = &rl_catch_signals,
+      .line_buffer = &rl_line_buffer,
+      .point = &rl_point,
+      .end = &rl_end,
+      .last_func = &rl_last_func,
+  };
+  return 0;
+}
+
+#else
+
+/* Where each member of the table comes from */
+static const struct
+{
+  const char *name;
+  size_t offset;
+} symbols[] = {
+    {"readline", offsetof(LineEdit, readline)},
+    {"rl_callback_handler_install", offsetof(LineEdit, callback_handler_install)},
+    {"rl_callback_handler_remove", offsetof(LineEdit, callback_handler_remove)},
+    {"rl_callback_read_char", offsetof(LineEdit, callback_read_char)},
+    {"rl_replace_line", offsetof(LineEdit, replace_line)},
+    {"rl_on_new_line", offsetof(LineEdit, on_new_line)},
+    {"rl_redisplay", offsetof(LineEdit, redisplay)},
+    {"rl_ding", offsetof(LineEdit, ding)},
+    {"rl_bind_key", offsetof(LineEdit, bind_key)},
+    {"add_history", offsetof(LineEdit, add_history)},
+    {"remove_history", offsetof(LineEdit, remove_history)},
+    {"free_history_entry", offsetof(LineEdit, free_history_entry)},
+    {"clear_history", offsetof(LineEdit, clear_history)},
+    {"rl_catch_signals", offsetof(LineEdit, catch_signals)},
+    {"rl_line_buffer", offsetof(LineEdit, line_buffer)},
+    {"rl_point", offsetof(LineEdit, point)},
+    {"rl_end", offsetof(LineEdit, end)},
+    {"rl_last_func", offsetof(LineEdit, last_func)},
+};
+
+/* dlopen() readline and fill the table, once. Returns -1, after saying
+ * why, if it cannot be had; the shell then has no line editing.
+ */
+int lineedit_load(void)
+{
+  if (rl.loaded)
+    return 0;
+  void *lib = dlopen(LSH_READLINE_SONAME, RTLD_NOW | RTLD_LOCAL);
+  if (lib == NULL)
+  {
+    fprintf(stderr, "readline: %s\n", dlerror());
+    return -1;
+  }
+
+  LineEdit table = {.loaded = 1};
+  for (size_t i = 0; i < sizeof(symbols) / sizeof(symbols[0]); i++)
+  {
+    void *p = dlsym(lib, symbols[i].name);
+    if (p == NULL)
+    {
+      fprintf(stderr, "readline: %s: %s not found\n", LSH_READLINE_SONAME, symbols[i].name);
+      dlclose(lib);
+      return -1;
+    }
+    *(void **)((char *)&table + symbols[i].offset) = p;
+  }
+  rl = table;
+  return 0;
+}
+
+#endif
@@ -0,0 +1,49 @@
+/* Readline, loaded on demand. Batch mode, -c and server mode never touch
+ * the line editor, so lsh is not linked against it: the first interactive
+ * prompt dlopen()s libreadline and resolves what the shell uses into the
+ * rl table below, and only then does readline (and the terminfo library
+ * it pulls in) cost a thing. With LSH_STATIC the library is linked into
+ * the binary instead and lineedit_load() just fills the table.
+ *
+ * Until lineedit_load() has succeeded rl.loaded is 0 and none of the
+ * other members may be used.
+ */
+#ifndef LINEEDIT_H
+#define LINEEDIT_H
+
+#include <stdio.h>
+#include <readline/readline.h>
+#include <readline/history.h>
+
+typedef struct
+{
+  int loaded;
+
+  char *(*readline)(const char *prompt);
+  void (*callback_handler_install)(const char *prompt, rl_vcpfunc_t *handler);
+  void (*callback_handler_remove)(void);
+  void (*callback_read_char)(void);
+  void (*replace_line)(const char *text, int clear_undo);
+  int (*on_new_line)(void);
+  void (*redisplay)(void);
+  int (*ding)(void);
+  int (*bind_key)(int key, rl_command_func_t *fn);
+
+  void (*add_history)(const char *line);
+  HIST_ENTRY *(*remove_history)(int which);
+  histdata_t (*free_history_entry)(HIST_ENTRY *entry);
+  void (*clear_history)(void);
+
+  // Readline's variables
+  int *catch_signals;
+  char **line_buffer;
+  int *point;
+  int *end;
+  rl_command_func_t **last_func;
+} LineEdit;
+
+extern LineEdit rl;
+
+extern int lineedit_load(void);
+
+#endif
@@ -18,11 +18,12 @@
  */
 #include <assert.h>
 #include <ctype.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <readline/readline.h>
-#include <readline/history.h>
+#include <sys/resource.h>
+#include <sys/time.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 
@@ -33,102 +34,843 @@
 #include <fcntl.h>
 #include <signal.h>
 
+#include "builtins.h"
+#include "cgroup.h"
+#include "cmdcache.h"
+#include "dirglob.h"
+#include "event.h"
+#include "hints.h"
+#include "histstore.h"
+#include "input.h"
+#include "jobs.h"
+#include "lineedit.h"
 #include "parse.h"
+#include "pathcache.h"
+#include "pool.h"
+#include "server.h"
+#include "spawn.h"
+#include "timeout.h"
+#include "trace.h"
 
-static void sigchld_handler(int sig);
 static void print_cmd(Command *cmd); // Use Linked List to store commands
 static void print_pgm(Pgm *p);
 static int execute_cmd(Command *cmd);
+static int run_cmd(Command *cmd);
+static int builtin_wait(char **argv, int argc);
 void stripwhite(char *);
-static int execute_pipeline(Pgm *p, int cmd_idx, int num_cmds, int *pipefds, Command *cmd);
+static int set_option(const char *name, const char *value);
+static void init_options(void);
+static Stage *build_stages(Command *cmd, const OutEntry *capture, int *nstages);
+static pid_t execute_pipeline(Stage *stages, int nstages, Command *cmd, int cgroup_fd);
+static int strip_prefix(Command *cmd, const char *word);
+static int strip_prefixes(Command *cmd, JobOptions *opts);
+static Job *start_job(Command *cmd, const JobOptions *opts);
+struct builtin;
+static int time_built_in(const struct builtin *b, Command *cmd, int argc);
 
-static void sigchld_handler(int sig)
+/* Interactive (readline) mode, as opposed to batch mode */
+static int interactive;
+
+/* Debug dump of every parsed command, off in batch mode or with -q */
+static int quiet;
+
+/* Exit status of the last line run, 2 for a parse error */
+static int last_status;
+
+/* The line being run is the last of a script, see tail_exec() */
+static int last_line;
+
+/* Server mode, where nothing may replace the worker */
+static int serving;
+
+/* Where the body of a here-document comes from: the lines after the one
+ * being run, in every mode. Returns NULL at the end of the input; a line
+ * stays valid until the next call.
+ */
+static char *(*next_line)(void);
+
+/* Read a here-document's body, up to a line that is just its delimiter,
+ * into cmd->here. Returns the body, to free() once the command has run.
+ */
+static char *read_here(Command *cmd)
 {
-  // Reap all available zombie children
-  while (waitpid(-1, NULL, WNOHANG) > 0)
-    ;
+  size_t len = 0, cap = 256;
+  char *body = malloc(cap), *l;
+  if (body == NULL)
+  {
+    perror("here-document");
+    return NULL;
+  }
+  while ((l = next_line ? next_line() : NULL) != NULL && strcmp(l, cmd->here_end) != 0)
+  {
+    size_t n = strlen(l);
+    if (len + n + 2 > cap)
+    {
+      while (len + n + 2 > cap)
+        cap *= 2;
+      char *p = realloc(body, cap);
+      if (p == NULL)
+      {
+        perror("here-document");
+        free(body);
+        return NULL;
+      }
+      body = p;
+    }
+    memcpy(body + len, l, n);
+    body[len + n] = '\n';
+    len += n + 1;
+  }
+  if (l == NULL)
+    fprintf(stderr, "here-document: input ended before %s\n", cmd->here_end);
+  body[len] = '\0';
+  cmd->here = body;
+  return body;
 }
 
-int main(void)
+/* Strip, parse and run one input line. Returns 1 if the line was not blank
+ * (so it is worth keeping in the history).
+ */
+static int run_line(char *line)
 {
-  signal(SIGINT, SIG_IGN);          // Ignore Ctrl-C in the parent
-  signal(SIGCHLD, sigchld_handler); // Handle child process termination
-  for (;;)
-  {
+  TRACE(read, 0);
+
+  // Remove leading and trailing whitespace from the line
+  stripwhite(line);
+  TRACE(strip, 0);
+  last_status = 0;
+
+  // If stripped line not blank
+  if (*line == '\0')
+    return 0;
 
-    char *line;
-    line = readline("lsh> ");
-    if (line == NULL) // readline() returns NULL on EOF
+  // Scripts repeat lines a lot; a cached line is not parsed again
+  size_t len = strlen(line);
+  Command parsed, *cmd = interactive ? NULL : cmdcache_get(line, len);
+  if (cmd == NULL)
+  {
+    if (parse(line, &parsed) != 1)
     {
-      printf("\nexit\n");
-      break;
+      printf("Parse ERROR\n");
+      last_status = 2;
+      return 1;
     }
-    // Remove leading and trailing whitespace from the line
-    stripwhite(line);
+    cmd = &parsed;
+    if (!interactive && parse_cacheable())
+      cmdcache_put(line, len, cmd);
+  }
+  TRACE(parse, 0);
+
+  char *body = NULL;
+  if (cmd->here_end && (body = read_here(cmd)) == NULL)
+  {
+    last_status = 1;
+    return 1;
+  }
+
+  // Just prints cmd
+  if (!quiet)
+    print_cmd(cmd);
+  last_status = execute_cmd(cmd);
+  free(body);
+  return 1;
+}
+
+/* A request in server mode, answered with its exit status. Lines after
+ * the first are the bodies of its here-documents.
+ */
+static char *serve_rest;
+
+static char *serve_next_line(void)
+{
+  return serve_rest ? strsep(&serve_rest, "\n") : NULL;
+}
+
+static int serve_line(char *line)
+{
+  serve_rest = strchr(line, '\n');
+  if (serve_rest)
+    *serve_rest++ = '\0';
+  next_line = serve_next_line;
+  run_line(line);
+  return last_status;
+}
+
+/* Batch mode: no prompt, no history, input read in large blocks */
+static LineReader *batch_reader;
+
+static char *batch_next_line(void)
+{
+  return reader_getline(batch_reader);
+}
+
+/* Run the lines of a -c string or script file (whole) or of stdin. A
+ * whole script may exec its last command in place, which then ends it
+ * with that command's status, so it returns the status of its last
+ * command either way. Commands read from stdin end with 0.
+ */
+static int run_batch(LineReader *reader, int whole)
+{
+  char *line;
+  int status = 0;
+  reader->wait = event_wait_input; // keep reaping while input is idle
+  batch_reader = reader;
+  next_line = batch_next_line;
+  while ((line = reader_getline(reader)) != NULL)
+  {
+    jobs_collect(NULL);
+    last_line = whole && reader_done(reader);
+    if (run_line(line))
+      status = last_status;
+  }
+  reader_close(reader);
 
-    // If stripped line not blank
-    if (*line)
+  // Commands still queued in a pool would be lost otherwise
+  if (pool_active())
+    pool_close(stderr);
+  return whole ? status : 0;
+}
+
+/* Interactive mode, see the end of main() */
+static int interactive_done;
+static int prompt_active;
+
+static void prompt_line(char *line);
+
+static void prompt_install(void)
+{
+  // Tell about background jobs that finished since the last prompt
+  jobs_collect(stderr);
+  rl.callback_handler_install("lsh> ", prompt_line);
+  prompt_active = 1;
+}
+
+/* Here-document lines at a "> " prompt */
+static char *prompt_next_line(void)
+{
+  static char *line;
+  free(line);
+  line = rl.readline("> ");
+  return line;
+}
+
+/* Readline callback for a complete line */
+static void prompt_line(char *line)
+{
+  // Give the terminal back to its normal mode while the command runs
+  rl.callback_handler_remove();
+  prompt_active = 0;
+
+  if (line == NULL) // readline returns NULL on EOF
+  {
+    printf("\nexit\n");
+    interactive_done = 1;
+    return;
+  }
+
+  if (run_line(line))
+    hist_add(line);
+
+  // Clear memory
+  free(line);
+  prompt_install();
+}
+
+/* Ctrl-C at the prompt throws the current line away */
+static void prompt_sigint(void)
+{
+  if (!prompt_active)
+    return;
+  printf("\n");
+  rl.replace_line("", 0);
+  rl.on_new_line();
+  rl.redisplay();
+}
+
+/* Ctrl-R: replace the line with the newest history entry containing what
+ * has been typed. Pressing it again goes on to older matches.
+ */
+static int prompt_search(int count, int key)
+{
+  static char *query;
+  static int from;
+  (void)count;
+  (void)key;
+
+  if (*rl.last_func != prompt_search)
+  {
+    free(query);
+    query = strdup(*rl.line_buffer);
+    from = hist_count();
+  }
+  int n = query ? hist_search(query, from) : -1;
+  if (n < 0)
+  {
+    rl.ding();
+    return 0;
+  }
+  from = n;
+  rl.replace_line(hist_get(n), 0);
+  *rl.point = *rl.end;
+  return 0;
+}
+
+/* $LSH_HISTFILE, or ~/.lsh_history */
+static void open_history(void)
+{
+  const char *file = getenv("LSH_HISTFILE");
+  const char *home = getenv("HOME");
+  char path[PATH_MAX];
+
+  if (file == NULL && home && *home)
+  {
+    snprintf(path, sizeof(path), "%s/.lsh_history", home);
+    file = path;
+  }
+  hist_open(file);
+}
+
+static void usage(void)
+{
+  fprintf(stderr, "usage: lsh [-q] [-c command | --serve socket [--workers n] | script]\n");
+  exit(2);
+}
+
+int main(int argc, char **argv)
+{
+  const char *command = NULL;
+  const char *script = NULL;
+  const char *serve_path = NULL;
+  long workers = sysconf(_SC_NPROCESSORS_ONLN);
+
+  for (int i = 1; i < argc; i++)
+  {
+    if (strcmp(argv[i], "-c") == 0)
     {
-      add_history(line);
+      if (++i == argc)
+        usage();
+      command = argv[i];
+    }
+    else if (strcmp(argv[i], "--serve") == 0)
+    {
+      if (++i == argc)
+        usage();
+      serve_path = argv[i];
+    }
+    else if (strcmp(argv[i], "--workers") == 0)
+    {
+      char *end;
+      if (++i == argc)
+        usage();
+      workers = strtol(argv[i], &end, 10);
+      if (*end != '\0' || workers <= 0 || workers > 1024)
+        usage();
+    }
+    else if (strcmp(argv[i], "-q") == 0)
+      quiet = 1;
+    else if (argv[i][0] == '-' || script)
+      usage();
+    else
+      script = argv[i];
+  }
+  if ((command != NULL) + (script != NULL) + (serve_path != NULL) > 1)
+    usage();
 
-      Command cmd;
-      if (parse(line, &cmd) == 1)
-      {
-        // Just prints cmd
-        print_cmd(&cmd);
-        execute_cmd(&cmd);
-      }
-      else
+  init_options();
+  pool_start = start_job;
+  jobs_done_hook = pool_job_done;
+  parse_glob = dirglob_expand;
+
+  // Each worker sets up its own event loop
+  if (serve_path)
+  {
+    quiet = 1;
+    serving = 1;
+    return serve(serve_path, workers > 0 ? (int)workers : 1, serve_line);
+  }
+
+  // Ctrl-C and child termination are read from the event loop
+  if (event_init() < 0)
+  {
+    perror("event_init");
+    return 1;
+  }
+
+  // Anything but a terminal on stdin is a script
+  interactive = !command && !script && isatty(STDIN_FILENO);
+
+  // Readline is only loaded for a prompt. Without it a terminal is read
+  // like a script, with no line editing.
+  if (interactive && lineedit_load() != 0)
+    interactive = 0;
+  if (!interactive)
+  {
+    LineReader reader;
+    quiet = 1;
+    if (command)
+      reader_open_string(&reader, command);
+    else if (script)
+    {
+      int fd = open(script, O_RDONLY | O_CLOEXEC);
+      if (fd < 0)
       {
-        printf("Parse ERROR\n");
+        perror(script);
+        return 127;
       }
+      reader_open_fd(&reader, fd);
     }
+    else
+      reader_open_fd(&reader, STDIN_FILENO);
+    return run_batch(&reader, command || script);
+  }
+
+  // We hand the terminal to foreground jobs and take it back afterwards
+  signal(SIGTTOU, SIG_IGN);
 
-    // Clear memory
-    free(line);
+  // Readline is driven from the event loop one character at a time, so
+  // children are reaped while the prompt is up. Signals are ours to handle.
+  *rl.catch_signals = 0;
+  event_sigint_hook = prompt_sigint;
+  rl.bind_key(CTRL('r'), prompt_search);
+  next_line = prompt_next_line;
+  open_history();
+  prompt_install();
+  while (!interactive_done)
+  {
+    event_wait_input(STDIN_FILENO);
+    rl.callback_read_char();
   }
 
   return 0;
 }
 
-static int check_built_ins(Pgm *current_pgm, int argc)
+static const char *get_spawn(void)
 {
-  // Built-in command: cd
-  if (strcmp(current_pgm->pgmlist[0], "cd") == 0)
+  return spawn_engine_name(spawn_engine);
+}
+
+/* Feed "< file" to the first stage through a splicing helper stage */
+static int feeder;
+
+static int set_feeder(const char *value)
+{
+  if (strcmp(value, "on") == 0)
+    feeder = 1;
+  else if (strcmp(value, "off") == 0)
+    feeder = 0;
+  else
+    return -1;
+  return 0;
+}
+
+static const char *get_feeder(void)
+{
+  return feeder ? "on" : "off";
+}
+
+/* Shell options, changed with the "set" built-in or at startup through the
+ * environment variable named in env.
+ */
+static const struct option
+{
+  const char *name;
+  const char *env;
+  int (*set)(const char *);
+  const char *(*get)(void);
+} options[] = {
+    {"spawn", "LSH_SPAWN", spawn_set_engine, get_spawn},
+    {"cmdcache", "LSH_CMDCACHE", cmdcache_set_size, cmdcache_get_size},
+    {"pipesize", "LSH_PIPESIZE", spawn_set_pipe_size, spawn_get_pipe_size},
+    {"feeder", "LSH_FEEDER", set_feeder, get_feeder},
+    {"histsize", "LSH_HISTSIZE", hist_set_size, hist_get_size},
+    {"affinity", "LSH_AFFINITY", hints_set_affinity, hints_get_affinity},
+    {"nice", "LSH_NICE", hints_set_nice, hints_get_nice},
+    {"sched", "LSH_SCHED", hints_set_sched, hints_get_sched},
+    {"numa", "LSH_NUMA", hints_set_numa, hints_get_numa},
+    {"cgroup", "LSH_CGROUP", cgroup_set_mode, cgroup_get_mode},
+    {"grace", "LSH_GRACE", timeout_set_grace, timeout_get_grace},
+    {"globcache", "LSH_GLOBCACHE", dirglob_set_size, dirglob_get_size},
+    {"cachesize", "LSH_CACHESIZE", outcache_set_size, outcache_get_size},
+};
+
+static int set_option(const char *name, const char *value)
+{
+  for (size_t i = 0; i < sizeof(options) / sizeof(options[0]); i++)
   {
+    if (strcmp(options[i].name, name) == 0)
+      return options[i].set(value);
+  }
+  return -1;
+}
 
-    if (argc > 2)
+static void init_options(void)
+{
+  for (size_t i = 0; i < sizeof(options) / sizeof(options[0]); i++)
+  {
+    const char *value = getenv(options[i].env);
+    if (value && options[i].set(value) != 0)
+      fprintf(stderr, "%s: invalid value \"%s\"\n", options[i].env, value);
+  }
+}
+
+/* wait [%job | pid]... */
+static int builtin_wait(char **argv, int argc)
+{
+  int ret = 0;
+
+  if (argc == 1)
+  {
+    if (pool_active())
+      pool_close(stderr);
+    for (Job *j = jobs_first(); j; j = j->next)
     {
-      fprintf(stderr, "cd: too many arguments\n");
-      return -1;
+      if (j->background)
+        event_wait_job(j);
+    }
+  }
+  for (int i = 1; i < argc; i++)
+  {
+    char *end;
+    long n = strtol(argv[i] + (argv[i][0] == '%'), &end, 10);
+    Job *j = NULL;
+    if (*end == '\0' && n > 0)
+      j = argv[i][0] == '%' ? job_find((int)n) : job_by_pid((pid_t)n);
+    if (j == NULL || !j->background)
+    {
+      fprintf(stderr, "wait: %s: no such job\n", argv[i]);
+      ret = 1;
+      continue;
     }
+    event_wait_job(j);
+  }
+  jobs_collect(interactive ? stderr : NULL);
+  return ret;
+}
+
+/* parallel [-j N], queues the following background commands and runs at
+ * most N of them at once (the number of online CPUs by default) until the
+ * next "wait".
+ */
+static int builtin_parallel(char **argv, int argc)
+{
+  long jobs = sysconf(_SC_NPROCESSORS_ONLN);
 
-    if (current_pgm->pgmlist[1] == NULL)
+  if (argc == 3 && strcmp(argv[1], "-j") == 0)
+  {
+    char *end;
+    jobs = strtol(argv[2], &end, 10);
+    if (*end != '\0' || jobs <= 0 || jobs > INT_MAX)
     {
-      fprintf(stderr, "cd : missing argument");
+      fprintf(stderr, "parallel: %s: invalid number of jobs\n", argv[2]);
+      return 1;
     }
-    else if (chdir(current_pgm->pgmlist[1]) != 0)
+  }
+  else if (argc != 1)
+  {
+    fprintf(stderr, "parallel: usage: parallel [-j N]\n");
+    return 1;
+  }
+  pool_open(jobs > 0 ? (int)jobs : 1);
+  return 0;
+}
+
+static int builtin_cd(char **argv, int argc)
+{
+  if (argc > 2)
+  {
+    fprintf(stderr, "cd: too many arguments\n");
+    return 1;
+  }
+
+  if (argv[1] == NULL)
+  {
+    fprintf(stderr, "cd : missing argument");
+    return 1;
+  }
+  if (chdir(argv[1]) != 0)
+  {
+    perror("cd");
+    return 1;
+  }
+  return 0;
+}
+
+static int builtin_exit(char **argv, int argc)
+{
+  (void)argv;
+
+  // exit never takes arguments
+  if (argc > 1)
+  {
+    fprintf(stderr, "exit: too many arguments\n");
+    return 1;
+  }
+
+  printf("\nexit\n");
+  exit(0);
+}
+
+/* exec [command [args]], replaces the shell with command. Without one,
+ * the redirections stay in place for the rest of the session.
+ */
+static int builtin_exec(char **argv, int argc)
+{
+  if (argc == 1)
+    return 0;
+  if (serving)
+  {
+    fprintf(stderr, "exec: not available in server mode\n");
+    return 1;
+  }
+  // Like other shells, a script does not go on after a failed exec
+  int ret = spawn_replace(argv + 1);
+  fprintf(stderr, "exec: %s: %s\n", argv[1], strerror(errno));
+  if (!interactive)
+    exit(ret);
+  return ret;
+}
+
+/* set [option value], lists or changes shell options */
+static int builtin_set(char **argv, int argc)
+{
+  if (argc == 1)
+  {
+    for (size_t i = 0; i < sizeof(options) / sizeof(options[0]); i++)
+      printf("%s %s\n", options[i].name, options[i].get());
+    return 0;
+  }
+  if (argc != 3)
+  {
+    fprintf(stderr, "set: usage: set [option value]\n");
+    return 1;
+  }
+  if (set_option(argv[1], argv[2]) != 0)
+  {
+    fprintf(stderr, "set: invalid option: %s %s\n", argv[1], argv[2]);
+    return 1;
+  }
+  return 0;
+}
+
+/* hash [-r | name...], lists (no args), clears (-r) or pre-warms the
+ * resolved-path cache
+ */
+static int builtin_hash(char **argv, int argc)
+{
+  if (argc == 1)
+  {
+    path_list(stdout);
+    return 0;
+  }
+  if (strcmp(argv[1], "-r") == 0)
+  {
+    path_clear();
+    return 0;
+  }
+  int ret = 0;
+  for (int i = 1; i < argc; i++)
+  {
+    if (path_warm(argv[i]) != 0)
     {
-      perror("cd");
+      fprintf(stderr, "hash: %s: not found\n", argv[i]);
+      ret = 1;
     }
+  }
+  return ret;
+}
+
+/* history [-c | text], lists the history, the entries containing text
+ * (newest first) or, with -c, clears it
+ */
+static int builtin_history(char **argv, int argc)
+{
+  if (argc == 1)
+  {
+    hist_list(stdout);
     return 0;
   }
-  // Built-in command: exit
-  else if (strcmp(current_pgm->pgmlist[0], "exit") == 0)
+  if (argc != 2)
+  {
+    fprintf(stderr, "history: usage: history [-c | text]\n");
+    return 1;
+  }
+  if (strcmp(argv[1], "-c") == 0)
+  {
+    hist_clear();
+    return 0;
+  }
+  int found = 0;
+  for (int n = hist_count(); (n = hist_search(argv[1], n)) >= 0; found = 1)
+    printf("%s\n", hist_get(n));
+  return !found;
+}
+
+/* lshstat [-c], latency histograms of the traced points, see trace.h */
+static int builtin_lshstat(char **argv, int argc)
+{
+  if (argc == 2 && strcmp(argv[1], "-c") == 0)
+  {
+    trace_clear();
+    return 0;
+  }
+  if (argc != 1)
+  {
+    fprintf(stderr, "lshstat: usage: lshstat [-c]\n");
+    return 1;
+  }
+  return trace_report(stdout);
+}
+
+/* jobs, lists the background jobs */
+static int builtin_jobs(char **argv, int argc)
+{
+  (void)argv;
+  (void)argc;
+  jobs_list(stdout);
+  jobs_collect(NULL); // finished jobs were just reported
+  return 0;
+}
+
+/* Built-in dispatch table, sorted by name for bsearch(). BUILTIN_SHELL
+ * ones run in the shell when they are a command of their own. BUILTIN_CHILD
+ * ones can also be a pipeline stage: the stage is forked as usual but runs
+ * the function instead of exec'ing. Without BUILTIN_CHILD a built-in acts
+ * on the shell itself, so as a stage it goes to $PATH like any command;
+ * without BUILTIN_SHELL (tee, which would read the shell's own input) it
+ * is always forked.
+ */
+#define BUILTIN_SHELL 1
+#define BUILTIN_CHILD 2
+#define BUILTIN_ANY (BUILTIN_SHELL | BUILTIN_CHILD)
+
+struct builtin
+{
+  const char *name;
+  BuiltinFn *run;
+  int where;
+};
+
+static const struct builtin builtins[] = {
+    {"[", builtin_test, BUILTIN_ANY},
+    {"cd", builtin_cd, BUILTIN_SHELL},
+    {"echo", builtin_echo, BUILTIN_ANY},
+    {"exec", builtin_exec, BUILTIN_SHELL},
+    {"exit", builtin_exit, BUILTIN_SHELL},
+    {"false", builtin_false, BUILTIN_ANY},
+    {"hash", builtin_hash, BUILTIN_ANY},
+    {"history", builtin_history, BUILTIN_ANY},
+    {"jobs", builtin_jobs, BUILTIN_ANY},
+    {"lshstat", builtin_lshstat, BUILTIN_ANY},
+    {"parallel", builtin_parallel, BUILTIN_SHELL},
+    {"pwd", builtin_pwd, BUILTIN_ANY},
+    {"set", builtin_set, BUILTIN_ANY},
+    {"tee", builtin_tee, BUILTIN_CHILD},
+    {"test", builtin_test, BUILTIN_ANY},
+    {"true", builtin_true, BUILTIN_ANY},
+    {"wait", builtin_wait, BUILTIN_SHELL},
+};
+
+static int builtin_cmp(const void *name, const void *b)
+{
+  return strcmp(name, ((const struct builtin *)b)->name);
+}
+
+static const struct builtin *find_built_in(const char *name)
+{
+  return bsearch(name, builtins, sizeof(builtins) / sizeof(builtins[0]), sizeof(builtins[0]), builtin_cmp);
+}
+
+/* The last line of a script, run in place of the shell: a single
+ * foreground command, nothing around it the shell would have to do once
+ * it is done (timing, deadlines, cgroups, caching, jobs to wait for) and
+ * no scheduling hints, which are set up per stage.
+ */
+static int tail_exec_ok(const Command *cmd, const JobOptions *opts)
+{
+  return !cmd->pgm->next && !cmd->background && !opts->timed && opts->timeout == 0 && !opts->cache &&
+         !cgroup_wanted(&opts->limits) && !hints_active() && !jobs_first() && !pool_active();
+}
+
+/* The last command of a script, failing just as it would if forked */
+static int replace_shell(char **argv, int argc)
+{
+  (void)argc;
+  int ret = spawn_replace(argv);
+  fprintf(stderr, "%s: %s\n", argv[0], strerror(errno));
+  return ret;
+}
+
+static const struct builtin tail_exec = {"exec", replace_shell, BUILTIN_SHELL};
+
+/* Run a built-in in the shell itself, with the command's redirections
+ * applied to the shell's own stdin/stdout for the duration of the call.
+ */
+static int run_built_in(const struct builtin *b, Command *cmd, char **argv, int argc)
+{
+  int saved_in = -1, saved_out = -1, ret;
+
+  serve_local_begin();
+  if (cmd->rstdin || cmd->here)
+  {
+    int fd = cmd->here ? spawn_here(cmd->here, strlen(cmd->here)) : open(cmd->rstdin, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+      perror(cmd->here ? "here-document" : "open input file");
+      ret = 1;
+      goto restore;
+    }
+    saved_in = fcntl(STDIN_FILENO, F_DUPFD_CLOEXEC, 10);
+    dup2(fd, STDIN_FILENO);
+    close(fd);
+  }
+  if (cmd->rstdout)
   {
-    // exit never takes arguments
-    if (argc > 1)
+    int fd = open(cmd->rstdout, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0)
     {
-      fprintf(stderr, "exit: too many arguments\n");
-      return -1;
+      perror("open output file");
+      ret = 1;
+      goto restore;
     }
+    fflush(stdout);
+    saved_out = fcntl(STDOUT_FILENO, F_DUPFD_CLOEXEC, 10);
+    dup2(fd, STDOUT_FILENO);
+    close(fd);
+  }
 
-    printf("\nexit\n");
-    exit(0);
+  ret = b->run(argv, argc);
+
+  // "exec" without a command makes the redirections the shell's own
+  if (b->run == builtin_exec && argc == 1)
+  {
+    fflush(stdout);
+    if (saved_out >= 0)
+      close(saved_out);
+    if (saved_in >= 0)
+      close(saved_in);
+    serve_local_end();
+    return ret;
   }
-  return 1;
+
+restore:
+  if (saved_out >= 0)
+  {
+    fflush(stdout);
+    dup2(saved_out, STDOUT_FILENO);
+    close(saved_out);
+  }
+  if (saved_in >= 0)
+  {
+    dup2(saved_in, STDIN_FILENO);
+    close(saved_in);
+  }
+  serve_local_end();
+  return ret;
 }
 
+/* Run a parsed command. It may come from the parsed-command cache, so the
+ * prefixes stripped off the first stage are put back afterwards.
+ */
 static int execute_cmd(Command *cmd)
 {
   if (cmd == NULL)
@@ -136,123 +878,402 @@ static int execute_cmd(Command *cmd)
     return -1; // Nothing to execute
   }
 
-  char *cmd_name = cmd->pgm->pgmlist[0];
+  Pgm *first = cmd->pgm;
+  while (first->next)
+    first = first->next;
+  char **argv = first->pgmlist;
+  int ret = run_cmd(cmd);
+  first->pgmlist = argv;
+  return ret;
+}
+
+static int run_cmd(Command *cmd)
+{
+  // Prefixes in front of the first stage apply to the whole pipeline
+  JobOptions opts;
+  if (strip_prefixes(cmd, &opts) != 0)
+    return 1;
+
+  // A cached run replays what the command wrote last time; on a miss the
+  // job keeps a copy of its output
+  int ret;
+  if (opts.cache && (opts.capture = outcache_new(cmd)) != NULL)
+  {
+    serve_local_begin();
+    int hit = outcache_replay(opts.capture, cmd->rstdout, &ret) == 0;
+    serve_local_end();
+    if (hit)
+    {
+      outcache_finish(opts.capture, 0, 0);
+      return ret;
+    }
+    if (outcache_begin(opts.capture) != 0)
+    {
+      outcache_finish(opts.capture, 0, 0);
+      opts.capture = NULL;
+    }
+  }
+
   int argc = 0;
   while (cmd->pgm->pgmlist[argc] != NULL)
     argc++;
 
-  Pgm *current_pgm = cmd->pgm;
-
-  if (check_built_ins(current_pgm, argc) != 0)
+  // A built-in on its own runs in the shell, no fork at all, unless it
+  // has limits, a deadline or output to capture and can run as a job of
+  // its own instead
+  const struct builtin *b = cmd->pgm->next ? NULL : find_built_in(cmd->pgm->pgmlist[0]);
+  int limited = opts.limits.cpu_quota > 0 || opts.limits.mem_max > 0 || opts.timeout > 0 || opts.capture;
+  if (b && (b->where & BUILTIN_SHELL) && !(limited && (b->where & BUILTIN_CHILD)))
   {
+    outcache_finish(opts.capture, 0, 0);
+    return opts.timed ? time_built_in(b, cmd, argc) : run_built_in(b, cmd, cmd->pgm->pgmlist, argc);
+  }
 
-    int num_cmds = 0;
-    for (Pgm *tmp = current_pgm; tmp; tmp = tmp->next)
-      num_cmds++;
+  // The last command of a script has no shell to come back to, so it
+  // takes the shell's place instead of being forked and waited for
+  if (last_line && !b && tail_exec_ok(cmd, &opts))
+    return run_built_in(&tail_exec, cmd, cmd->pgm->pgmlist, argc);
 
-    // Each pipe needs 2 fds, and we need (num_cmds - 1) pipes
-    int pipefds[2 * (num_cmds - 1)];
-    for (int i = 0; i < num_cmds - 1; i++)
+  if (cmd->background && pool_active())
+  {
+    if (pool_submit(cmd, &opts) != 0)
     {
-      // create the pipes
-      if (pipe(pipefds + 2 * i) < 0)
-      {
-        perror("pipe");
-        exit(1);
-      }
+      perror("parallel");
+      outcache_finish(opts.capture, 0, 0);
+      return -1;
     }
-    // Execute recursively
-    execute_pipeline(current_pgm, 0, num_cmds, pipefds, cmd);
+    return 0;
+  }
 
-    // Close all pipe fds in parent
-    for (int i = 0; i < 2 * (num_cmds - 1); i++)
-    {
-      close(pipefds[i]);
-    }
+  Job *job = start_job(cmd, &opts);
+  if (job == NULL)
+    return -1;
 
-    if (!cmd->background)
-    {
-      // Wait for children
-      for (int i = 0; i < num_cmds; i++)
-        wait(NULL);
-    }
+  if (cmd->background)
+  {
+    if (interactive)
+      fprintf(stderr, "[%d] %d\n", job->id, (int)job->pgid);
     return 0;
   }
+
+  // Foreground: an interactive shell lends the job the terminal until it
+  // is done, so Ctrl-C goes to the job's process group.
+  if (interactive && job->pgid > 0)
+  {
+    tcsetpgrp(STDIN_FILENO, job->pgid);
+#ifndef HAVE_POSIX_SPAWN_TCSETPGRP
+    // A stage may have touched the terminal before it was handed over
+    kill(-job->pgid, SIGCONT);
+#endif
+  }
+  event_wait_job(job);
+  ret = job_exit_status(job);
+  if (interactive)
+    tcsetpgrp(STDIN_FILENO, getpgrp());
+  job_report(job, stderr);
+
+  job_remove(job);
+  return ret;
 }
 
-// Recursive helper
-static int execute_pipeline(Pgm *p, int cmd_idx, int num_cmds, int *pipefds, Command *cmd)
+/* Remove word from the front of the pipeline's first stage (the last Pgm,
+ * since the list is reversed). Returns 1 if it was there, 0 if not and -1
+ * if nothing is left after it. execute_cmd() puts the word back.
+ */
+static int strip_prefix(Command *cmd, const char *word)
 {
-  if (p == NULL)
-    return 0;
-
-  // Recurse first to reach the earliest command
-  execute_pipeline(p->next, cmd_idx + 1, num_cmds, pipefds, cmd);
+  Pgm *first = cmd->pgm;
+  while (first->next)
+    first = first->next;
 
-  pid_t pid = fork();
+  if (first->pgmlist[0] == NULL || strcmp(first->pgmlist[0], word) != 0)
+    return 0;
+  first->pgmlist++;
+  return first->pgmlist[0] ? 1 : -1;
+}
 
-  if (pid < 0) // Fork failed
-  {
-    perror("Fork failed");
-    return -1;
-  }
+/* The prefixes in front of the first stage, in any order: "time",
+ * "cache", "limit key=value..." and "timeout duration". Returns -1, after saying
+ * why, if they are malformed or leave no command.
+ */
+static int strip_prefixes(Command *cmd, JobOptions *opts)
+{
+  Pgm *first = cmd->pgm;
+  while (first->next)
+    first = first->next;
 
-  if (pid == 0)
+  memset(opts, 0, sizeof(*opts));
+  for (;;)
   {
-    // Child process
-    if (!cmd->background)
-      signal(SIGINT, SIG_DFL);
-
-    // Handle input redirection
-    if (cmd_idx == num_cmds - 1 && cmd->rstdin)
+    int r = strip_prefix(cmd, "time");
+    if (r > 0)
+    {
+      opts->timed = 1;
+      continue;
+    }
+    if (r == 0 && (r = strip_prefix(cmd, "cache")) > 0)
+    {
+      opts->cache = 1;
+      continue;
+    }
+    if (r == 0 && (r = strip_prefix(cmd, "timeout")) > 0)
     {
-      int fd_in = open(cmd->rstdin, O_RDONLY);
-      if (fd_in < 0)
+      if (timeout_parse(first->pgmlist[0], &opts->timeout) != 0)
+      {
+        fprintf(stderr, "timeout: %s: invalid duration\n", first->pgmlist[0]);
+        return -1;
+      }
+      if (*++first->pgmlist == NULL)
       {
-        perror("open input file");
-        exit(1);
+        fprintf(stderr, "timeout: missing command\n");
+        return -1;
       }
-      dup2(fd_in, STDIN_FILENO);
-      close(fd_in);
+      continue;
     }
-    // read previous pipe if not first in pipeline
-    else if (cmd_idx < num_cmds - 1)
+    if (r == 0 && (r = strip_prefix(cmd, "limit")) == 0)
+      return 0;
+    if (r < 0)
     {
-      dup2(pipefds[2 * cmd_idx], STDIN_FILENO);
+      fprintf(stderr, "%s: missing command\n", first->pgmlist[-1]);
+      return -1;
     }
 
-    // Handle output redirection
-    if (cmd_idx == 0 && cmd->rstdout)
+    // limit: key=value words, up to the command
+    int n = 0;
+    for (; first->pgmlist[0] && strchr(first->pgmlist[0], '='); first->pgmlist++, n++)
     {
-      int fd_out = open(cmd->rstdout, O_WRONLY | O_CREAT | O_TRUNC, 0644);
-      if (fd_out < 0)
+      if (cgroup_parse_limit(first->pgmlist[0], &opts->limits) != 0)
       {
-        perror("open output file");
-        exit(1);
+        fprintf(stderr, "limit: %s: invalid limit\n", first->pgmlist[0]);
+        return -1;
       }
-      dup2(fd_out, STDOUT_FILENO);
-      close(fd_out);
     }
-    // write to next pipe
-    else if (cmd_idx > 0)
+    if (n == 0 || first->pgmlist[0] == NULL)
     {
-      dup2(pipefds[2 * (cmd_idx - 1) + 1], STDOUT_FILENO);
+      fprintf(stderr, "limit: usage: limit cpu=N[%%] mem=N[kmg]... command\n");
+      return -1;
     }
+  }
+}
+
+/* "time" in front of a built-in: it runs in the shell, so report the
+ * shell's own usage over the call as a single stage.
+ */
+static int time_built_in(const struct builtin *b, Command *cmd, int argc)
+{
+  Stage st = {.argv = cmd->pgm->pgmlist, .reaped = 1};
+  struct rusage before, after;
+
+  getrusage(RUSAGE_SELF, &before);
+  clock_gettime(CLOCK_MONOTONIC, &st.started);
+  int ret = run_built_in(b, cmd, cmd->pgm->pgmlist, argc);
+  clock_gettime(CLOCK_MONOTONIC, &st.finished);
+  getrusage(RUSAGE_SELF, &after);
+
+  timersub(&after.ru_utime, &before.ru_utime, &st.rusage.ru_utime);
+  timersub(&after.ru_stime, &before.ru_stime, &st.rusage.ru_stime);
+  st.rusage.ru_maxrss = after.ru_maxrss;
+  st.rusage.ru_nvcsw = after.ru_nvcsw - before.ru_nvcsw;
+  st.rusage.ru_nivcsw = after.ru_nivcsw - before.ru_nivcsw;
+
+  Job job = {.stages = &st, .nstages = 1, .text = cmd->pgm->pgmlist[0]};
+  job_report_times(&job, stderr);
+  return ret;
+}
+
+/* Spawn the pipeline and register it as a job */
+static Job *start_job(Command *cmd, const JobOptions *opts)
+{
+  // A job with limits must not run without them
+  CgroupLeaf *cgroup = NULL;
+  if (cgroup_wanted(&opts->limits) && (cgroup = cgroup_leaf_new(&opts->limits)) == NULL &&
+      (opts->limits.cpu_quota || opts->limits.mem_max))
+    return NULL;
+
+  JobTimer *timer = NULL;
+  if (opts->timeout > 0 && (timer = timeout_new(opts->timeout)) == NULL)
+  {
+    cgroup_leaf_free(cgroup);
+    return NULL;
+  }
+
+  int nstages;
+  Stage *stages = build_stages(cmd, opts->capture, &nstages);
+  if (stages == NULL)
+  {
+    cgroup_leaf_free(cgroup);
+    timeout_free(timer);
+    outcache_finish(opts->capture, 0, 0);
+    return NULL;
+  }
+
+  // Don't let buffered shell output end up after (or inside) the
+  // output of the children
+  fflush(stdout);
+
+  // Nothing is reaped before the event loop runs again, so every stage is
+  // in the job table by the time its exit is seen.
+  pid_t pgid = execute_pipeline(stages, nstages, cmd, cgroup_leaf_fd(cgroup));
+  Job *job = job_add(stages, nstages, pgid, cmd->background);
+  if (job == NULL)
+  {
+    perror("job");
+    free(stages);
+    cgroup_leaf_free(cgroup);
+    timeout_free(timer);
+    outcache_finish(opts->capture, 0, 0);
+    return NULL;
+  }
+  job->timed = opts->timed;
+  job->cgroup = cgroup;
+  job->capture = opts->capture;
+  if (timer)
+  {
+    job->timer = timer;
+    timeout_start(timer, job);
+  }
+  for (int i = 0; i < nstages; i++)
+  {
+    if (stages[i].pid > 0)
+      event_watch(&stages[i]);
+  }
+  return job;
+}
+
+/* Flatten the Pgm list, which parse() returns last stage first, into a
+ * Stage array in pipeline order. Output being captured for the cache
+ * goes through a hidden tee stage at the end, and with the feeder on the
+ * input file comes from a hidden feed stage at the start.
+ */
+static Stage *build_stages(Command *cmd, const OutEntry *capture, int *nstages)
+{
+  int n = 0;
+  for (Pgm *p = cmd->pgm; p; p = p->next)
+    n++;
+
+  // With the feeder on, "< file" becomes a stage of its own. The argvs of
+  // the added stages live in the same block as the stages, so they go
+  // away with the job.
+  int feed = feeder && cmd->rstdin;
+  int tee = capture != NULL;
+  Stage *stages = calloc(1, (size_t)(n + feed + tee) * sizeof(Stage) + 7 * sizeof(char *));
+  if (stages == NULL)
+  {
+    perror("execute");
+    return NULL;
+  }
+  if (tee)
+  {
+    char **argv = (char **)(stages + n + feed + tee) + 3;
+    argv[0] = "tee";
+    argv[1] = "-a";
+    argv[2] = (char *)outcache_capture_path(capture);
+    Stage *st = &stages[n + feed];
+    st->argv = argv;
+    st->builtin = builtin_tee;
+    st->hidden = 1;
+    st->in_fd = st->out_fd = st->pidfd = -1;
+  }
+  if (feed)
+  {
+    char **argv = (char **)(stages + n + feed + tee);
+    argv[0] = "feed";
+    argv[1] = cmd->rstdin;
+    stages[0].argv = argv;
+    stages[0].builtin = builtin_feed;
+    stages[0].hidden = 1;
+    stages[0].in_fd = stages[0].out_fd = stages[0].pidfd = -1;
+  }
 
-    // Close all pipe fds in child
-    for (int i = 0; i < 2 * (num_cmds - 1); i++)
+  int i = n + feed;
+  for (Pgm *p = cmd->pgm; p; p = p->next)
+  {
+    Stage *st = &stages[--i];
+    st->argv = p->pgmlist;
+    st->in_fd = st->out_fd = st->pidfd = -1;
+
+    const struct builtin *b = find_built_in(p->pgmlist[0]);
+    if (b && (b->where & BUILTIN_CHILD))
+      st->builtin = b->run;
+  }
+
+  // A here-document is read from a memfd, which execute_pipeline() hands
+  // to the first stage like a pipe
+  if (cmd->here && (stages[0].in_fd = spawn_here(cmd->here, strlen(cmd->here))) < 0)
+  {
+    perror("here-document");
+    free(stages);
+    return NULL;
+  }
+  *nstages = n + feed + tee;
+  return stages;
+}
+
+/* Start the stages from first to last. Each stage creates the
+ * close-on-exec pipe it writes to right before it is started, and the
+ * parent closes its copies as soon as the reading side has its own, so at
+ * most three pipe fds are open whatever the length of the pipeline.
+ *
+ * Background jobs, and every job of an interactive shell, get a process
+ * group of their own, led by the first stage. Without a terminal to hand
+ * over, foreground jobs stay in the shell's group so a Ctrl-C sent to it
+ * reaches them directly. Returns the job's process group (0 if it was to
+ * get its own but no stage could be started).
+ */
+static pid_t execute_pipeline(Stage *stages, int nstages, Command *cmd, int cgroup_fd)
+{
+  pid_t pgid = interactive || cmd->background ? 0 : getpgrp();
+
+  hints_plan(nstages);
+  for (int i = 0; i < nstages; i++)
+  {
+    Stage *st = &stages[i];
+    SpawnSpec spec = {
+        .in_fd = st->in_fd,
+        .out_fd = -1,
+        .foreground = !cmd->background,
+        .pgid = pgid, // the first stage started leads the job's group
+        .tty_fd = interactive && !cmd->background ? STDIN_FILENO : -1,
+        .builtin = st->builtin,
+        .cpus = hints_cpus(i),
+        .cgroup_fd = cgroup_fd,
+    };
+
+    // Handle input redirection, unless a feed stage does it
+    if (i == 0 && cmd->rstdin && st->builtin != builtin_feed)
+      spec.rstdin = cmd->rstdin;
+
+    // Handle output redirection, or write to next pipe
+    if (i == nstages - 1)
+      spec.rstdout = cmd->rstdout;
+    else
     {
-      close(pipefds[i]);
+      int pipefd[2];
+      if (spawn_pipe(pipefd) < 0)
+      {
+        perror("pipe");
+        if (st->in_fd >= 0)
+          close(st->in_fd);
+        st->in_fd = -1;
+        break;
+      }
+      st->out_fd = spec.out_fd = pipefd[1];
+      stages[i + 1].in_fd = pipefd[0];
     }
 
-    // Execute command
-    execvp(p->pgmlist[0], p->pgmlist);
-    perror("execvp");
-    exit(1);
-  }
+    clock_gettime(CLOCK_MONOTONIC, &st->started);
+    st->pid = spawn_stage(st->argv, &spec);
+    if (st->pid > 0 && pgid == 0)
+      pgid = st->pid;
 
-  // Parent process continues to next iteration
-  return 0;
+    // The child has its own copies now
+    if (st->in_fd >= 0)
+      close(st->in_fd);
+    if (st->out_fd >= 0)
+      close(st->out_fd);
+    st->in_fd = st->out_fd = -1;
+  }
+  return pgid;
 }
 
 /*
@@ -317,6 +1338,10 @@ void stripwhite(char *string)
     memmove(string, string + i, strlen(string + i) + 1);
   }
 
+  // Blank line, nothing left to strip
+  if (*string == '\0')
+    return;
+
   i = strlen(string) - 1;
   while (i > 0 && isspace(string[i]))
   {
@@ -0,0 +1,419 @@
+/* On-disk store of command output, see outcache.h */
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "outcache.h"
+
+#define MAGIC "LSHC"
+#define HEADER_SIZE 12 // magic, int32 status, uint32 key length
+#define STALE_TMP (24 * 3600) // seconds before a left-over capture is removed
+
+struct out_entry
+{
+  char *key;
+  size_t keylen;
+  char name[33];      // hex hash of the key
+  char tmp[PATH_MAX]; // capture file while the command runs, or ""
+};
+
+static long long limit = 64LL << 20;
+static char limit_text[32] = "64m";
+
+static char store[PATH_MAX]; // "" until made
+static unsigned next_tmp;
+
+/* $XDG_CACHE_HOME/lsh or ~/.cache/lsh, made on first use */
+static const char *store_dir(void)
+{
+  if (store[0])
+    return store;
+  const char *xdg = getenv("XDG_CACHE_HOME"), *home = getenv("HOME");
+  char base[PATH_MAX];
+  if (xdg && xdg[0] == '/')
+    snprintf(base, sizeof(base), "%s", xdg);
+  else if (home && home[0])
+    snprintf(base, sizeof(base), "%s/.cache", home);
+  else
+    return NULL;
+  if (mkdir(base, 0700) != 0 && errno != EEXIST)
+    return NULL;
+  if (snprintf(store, sizeof(store), "%s/lsh", base) >= (int)sizeof(store) ||
+      (mkdir(store, 0700) != 0 && errno != EEXIST))
+  {
+    store[0] = '\0';
+    return NULL;
+  }
+  return store;
+}
+
+typedef struct
+{
+  char *buf;
+  size_t len, cap;
+  int failed;
+} Key;
+
+static void key_add(Key *k, const char *s, size_t len)
+{
+  if (k->failed)
+    return;
+  if (k->len + len > k->cap)
+  {
+    size_t cap = k->cap ? 2 * k->cap : 256;
+    while (cap < k->len + len)
+      cap *= 2;
+    char *p = realloc(k->buf, cap);
+    if (p == NULL)
+    {
+      k->failed = 1;
+      return;
+    }
+    k->buf = p;
+    k->cap = cap;
+  }
+  memcpy(k->buf + k->len, s, len);
+  k->len += len;
+}
+
+static void key_str(Key *k, const char *s)
+{
+  key_add(k, s, strlen(s) + 1);
+}
+
+/* Stages in pipeline order, each argv NUL separated and ended by "\x01" */
+static void key_pgms(Key *k, const Pgm *p)
+{
+  if (p == NULL)
+    return;
+  key_pgms(k, p->next); // the list is last stage first
+  for (char **a = p->pgmlist; *a; a++)
+    key_str(k, *a);
+  key_add(k, "\x01", 1);
+}
+
+static uint64_t hash(const char *s, size_t len, uint64_t h)
+{
+  for (size_t i = 0; i < len; i++)
+  {
+    h ^= (unsigned char)s[i];
+    h *= 0x100000001b3ull;
+  }
+  return h ^ (h >> 31);
+}
+
+/* The entry for cmd, or NULL if it cannot be cached (no cwd, its input
+ * file is missing). Nothing is looked up yet.
+ */
+OutEntry *outcache_new(const Command *cmd)
+{
+  Key k = {0};
+  char cwd[PATH_MAX], text[96];
+
+  key_pgms(&k, cmd->pgm);
+  if (getcwd(cwd, sizeof(cwd)) == NULL)
+    goto fail;
+  key_str(&k, cwd);
+  if (cmd->rstdin)
+  {
+    struct stat st;
+    if (stat(cmd->rstdin, &st) != 0)
+      goto fail;
+    snprintf(text, sizeof(text), "%llu:%llu:%lld:%lld.%09ld", (unsigned long long)st.st_dev,
+             (unsigned long long)st.st_ino, (long long)st.st_size, (long long)st.st_mtim.tv_sec,
+             st.st_mtim.tv_nsec);
+    key_add(&k, "<", 1);
+    key_str(&k, cmd->rstdin);
+    key_str(&k, text);
+  }
+  if (cmd->here)
+  {
+    key_add(&k, "<<", 2);
+    key_str(&k, cmd->here);
+  }
+
+  OutEntry *e = malloc(sizeof(OutEntry));
+  if (k.failed || k.len > UINT32_MAX || e == NULL)
+  {
+    free(e);
+    goto fail;
+  }
+  e->key = k.buf;
+  e->keylen = k.len;
+  e->tmp[0] = '\0';
+  snprintf(e->name, sizeof(e->name), "%016llx%016llx",
+           (unsigned long long)hash(k.buf, k.len, 0xcbf29ce484222325ull),
+           (unsigned long long)hash(k.buf, k.len, 0x84222325cbf29ce4ull));
+  return e;
+
+fail:
+  free(k.buf);
+  return NULL;
+}
+
+static int read_full(int fd, char *buf, size_t len)
+{
+  while (len > 0)
+  {
+    ssize_t n = read(fd, buf, len);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return -1;
+    buf += n;
+    len -= (size_t)n;
+  }
+  return 0;
+}
+
+/* Copy the rest of in to out; sendfile() where it can */
+static int copy_out(int in, int out)
+{
+  ssize_t n;
+  while ((n = sendfile(out, in, NULL, 1 << 30)) > 0)
+    ;
+  if (n == 0)
+    return 0;
+  if (errno != EINVAL && errno != ENOSYS)
+    return -1;
+
+  char buf[65536];
+  while ((n = read(in, buf, sizeof(buf))) > 0)
+  {
+    for (char *p = buf; n > 0;)
+    {
+      ssize_t w = write(out, p, (size_t)n);
+      if (w < 0 && errno == EINTR)
+        continue;
+      if (w < 0)
+        return -1;
+      p += w;
+      n -= w;
+    }
+  }
+  return n < 0 ? -1 : 0;
+}
+
+/* On a hit, write the stored output to rstdout (or stdout) and set
+ * *status. Returns 0 on a hit, -1 on a miss.
+ */
+int outcache_replay(OutEntry *e, const char *rstdout, int *status)
+{
+  const char *dir = store_dir();
+  char path[PATH_MAX], header[HEADER_SIZE];
+  if (dir == NULL || snprintf(path, sizeof(path), "%s/%s", dir, e->name) >= (int)sizeof(path))
+    return -1;
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return -1;
+
+  int32_t stored;
+  uint32_t keylen;
+  char *key = malloc(e->keylen);
+  int hit = key && read_full(fd, header, HEADER_SIZE) == 0 && memcmp(header, MAGIC, 4) == 0;
+  if (hit)
+  {
+    memcpy(&stored, header + 4, 4);
+    memcpy(&keylen, header + 8, 4);
+    hit = keylen == e->keylen && read_full(fd, key, keylen) == 0 && memcmp(key, e->key, keylen) == 0;
+  }
+  free(key);
+  if (!hit)
+  {
+    close(fd);
+    return -1;
+  }
+
+  int out = STDOUT_FILENO;
+  fflush(stdout);
+  if (rstdout && (out = open(rstdout, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) < 0)
+  {
+    perror("open output file");
+    close(fd);
+    *status = 1;
+    return 0;
+  }
+  if (copy_out(fd, out) != 0)
+    perror("cache");
+  if (out != STDOUT_FILENO)
+    close(out);
+
+  futimens(fd, NULL); // recently used, see trim()
+  close(fd);
+  *status = stored;
+  return 0;
+}
+
+/* Start capturing for a miss: the capture file gets the header and key,
+ * the output goes after them. Returns -1 if the store cannot be used.
+ */
+int outcache_begin(OutEntry *e)
+{
+  const char *dir = store_dir();
+  if (dir == NULL || snprintf(e->tmp, sizeof(e->tmp), "%s/tmp.%d.%u", dir, (int)getpid(), next_tmp++) >=
+                         (int)sizeof(e->tmp))
+  {
+    e->tmp[0] = '\0';
+    return -1;
+  }
+
+  char header[HEADER_SIZE];
+  int32_t status = -1;
+  uint32_t keylen = (uint32_t)e->keylen;
+  memcpy(header, MAGIC, 4);
+  memcpy(header + 4, &status, 4);
+  memcpy(header + 8, &keylen, 4);
+
+  int fd = open(e->tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+  if (fd >= 0 && write(fd, header, HEADER_SIZE) == HEADER_SIZE &&
+      write(fd, e->key, e->keylen) == (ssize_t)e->keylen)
+  {
+    close(fd);
+    return 0;
+  }
+  if (fd >= 0)
+    close(fd);
+  unlink(e->tmp);
+  e->tmp[0] = '\0';
+  return -1;
+}
+
+/* Where the tee stage appends the output */
+const char *outcache_capture_path(const OutEntry *e)
+{
+  return e->tmp;
+}
+
+typedef struct
+{
+  char name[40];
+  off_t size;
+  time_t used;
+} Stored;
+
+static int by_use(const void *a, const void *b)
+{
+  const Stored *x = a, *y = b;
+  return x->used < y->used ? -1 : x->used > y->used;
+}
+
+/* Drop least recently used entries until the store fits the limit, and
+ * captures left behind by shells that died
+ */
+static void trim(const char *dir)
+{
+  DIR *d = opendir(dir);
+  if (d == NULL)
+    return;
+  Stored *v = NULL;
+  size_t n = 0, cap = 0;
+  long long total = 0;
+  time_t now = time(NULL);
+  struct dirent *de;
+  while ((de = readdir(d)) != NULL)
+  {
+    struct stat st;
+    if (de->d_name[0] == '.' || strlen(de->d_name) >= sizeof(v->name) ||
+        fstatat(dirfd(d), de->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0 || !S_ISREG(st.st_mode))
+      continue;
+    if (strncmp(de->d_name, "tmp.", 4) == 0)
+    {
+      if (now - st.st_mtime > STALE_TMP)
+        unlinkat(dirfd(d), de->d_name, 0);
+      continue;
+    }
+    if (n == cap)
+    {
+      cap = cap ? 2 * cap : 64;
+      Stored *p = realloc(v, cap * sizeof(Stored));
+      if (p == NULL)
+        break;
+      v = p;
+    }
+    strcpy(v[n].name, de->d_name);
+    v[n].size = st.st_size;
+    v[n].used = st.st_mtime;
+    total += st.st_size;
+    n++;
+  }
+
+  if (total > limit)
+  {
+    qsort(v, n, sizeof(Stored), by_use);
+    for (size_t i = 0; i < n && total > limit; i++)
+    {
+      if (unlinkat(dirfd(d), v[i].name, 0) == 0)
+        total -= v[i].size;
+    }
+  }
+  closedir(d);
+  free(v);
+}
+
+/* The command has finished: keep what was captured as the entry if ok
+ * (every stage exited normally), with its exit status. Frees e.
+ */
+void outcache_finish(OutEntry *e, int ok, int status)
+{
+  if (e == NULL)
+    return;
+  if (e->tmp[0])
+  {
+    struct stat st;
+    int32_t stored = status;
+    int fd = ok ? open(e->tmp, O_WRONLY | O_CLOEXEC) : -1;
+    ok = fd >= 0 && pwrite(fd, &stored, 4, 4) == 4 && fstat(fd, &st) == 0 && st.st_size <= limit;
+    if (fd >= 0)
+      close(fd);
+
+    char path[PATH_MAX];
+    if (ok && snprintf(path, sizeof(path), "%s/%s", store, e->name) < (int)sizeof(path) &&
+        rename(e->tmp, path) == 0)
+      trim(store);
+    else
+      unlink(e->tmp);
+  }
+  free(e->key);
+  free(e);
+}
+
+/* "set cachesize <bytes>[k|m|g]", 0 to keep nothing */
+int outcache_set_size(const char *value)
+{
+  char *end;
+  long long n = strtoll(value, &end, 10);
+  if (end == value || n < 0 || n > 1LL << 40 || strlen(value) >= sizeof(limit_text))
+    return -1;
+  switch (*end)
+  {
+  case 'g':
+    n <<= 10;
+    // fall through
+  case 'm':
+    n <<= 10;
+    // fall through
+  case 'k':
+    n <<= 10;
+    end++;
+  }
+  if (*end != '\0' || n > 1LL << 50)
+    return -1;
+  limit = n;
+  strcpy(limit_text, value);
+  return 0;
+}
+
+const char *outcache_get_size(void)
+{
+  return limit_text;
+}
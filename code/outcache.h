@@ -0,0 +1,33 @@
+/* Memoized command output, the "cache" prefix. A command line run with it
+ * is looked up by its argv (every stage, after wildcard expansion), the
+ * shell's cwd, the identity, size and mtime of its "< file" and the text
+ * of its here-document. A hit writes the stored stdout to the command's
+ * stdout (or its "> file") and returns the stored exit status without
+ * forking anything. On a miss the pipeline runs with a tee stage behind
+ * it that passes the output on and keeps a copy, which becomes the entry
+ * once every stage has exited normally.
+ *
+ * Entries are files under $XDG_CACHE_HOME/lsh (~/.cache/lsh), named by a
+ * hash of the key, and hold the key itself to rule out collisions. The
+ * store is kept under the cachesize option by dropping the least recently
+ * used entries. Only stdout and the status are kept, nothing the command
+ * may have done besides; the prefix is for commands whose output depends
+ * on nothing else.
+ */
+#ifndef OUTCACHE_H
+#define OUTCACHE_H
+
+#include "parse.h"
+
+typedef struct out_entry OutEntry;
+
+extern OutEntry *outcache_new(const Command *cmd);
+extern int outcache_replay(OutEntry *e, const char *rstdout, int *status);
+extern int outcache_begin(OutEntry *e);
+extern const char *outcache_capture_path(const OutEntry *e);
+extern void outcache_finish(OutEntry *e, int ok, int status);
+
+extern int outcache_set_size(const char *value);
+extern const char *outcache_get_size(void);
+
+#endif
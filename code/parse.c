@@ -4,8 +4,9 @@
 
 #include <stdio.h>
 #include <stdbool.h>
+#include <stdlib.h>
 #include <string.h>
-#include <ctype.h>
+#include "arena.h"
 #include "parse.h"
 
 #define PIPE ('|')
@@ -19,22 +20,54 @@
 #define isrut(c) ((c) == RUT)
 #define isspec(c) (ispipe(c) || isbg(c) || isrin(c) || isrut(c))
 
-static Pgm cmdbuf[20], *cmds;
-static char cbuf[256], *cp;
-static char *pbuf[50], **pp;
+/* Byte classes for the tokenizer: isspace(), isspec() and the identifier
+ * characters (isalnum() or one of "_-.,/~+") of the C locale, one lookup
+ * per byte.
+ */
+#define C_SPACE 1
+#define C_SPEC 2
+#define C_ID 4
+#define C_END 8
+#define C_STOP (C_SPACE | C_SPEC | C_END) // ends a word
+
+static const unsigned char cclass[256] = {
+    ['\0'] = C_END,
+    [' '] = C_SPACE, ['\t'] = C_SPACE, ['\n'] = C_SPACE, ['\v'] = C_SPACE, ['\f'] = C_SPACE, ['\r'] = C_SPACE,
+    [PIPE] = C_SPEC, [BG] = C_SPEC, [RIN] = C_SPEC, [RUT] = C_SPEC,
+    ['0' ... '9'] = C_ID, ['A' ... 'Z'] = C_ID, ['a' ... 'z'] = C_ID,
+    ['_'] = C_ID, ['-'] = C_ID, ['.'] = C_ID, [','] = C_ID, ['/'] = C_ID, ['~'] = C_ID, ['+'] = C_ID,
+};
+
+#define cclassof(c) (cclass[(unsigned char)(c)])
+
+/* Everything parse() returns lives in this arena until the next call.
+ * Arguments of the Pgm being built are collected in argbuf first and
+ * copied to the arena once the Pgm is complete; argbuf only grows.
+ */
+static Arena arena;
+static char **argbuf;
+static size_t argcap;
+
+int (*parse_glob)(const char *word, GlobAddFn *add, void *ctx);
+static int uncacheable; // the last line parsed depends on more than its text
+
+static int scan_token(char *s, char **tok, int *ident);
 
 int parse(char *buf, Command *c)
 {
-  int n;
+  int n, ident;
   Pgm *cmd0;
 
   char *t = buf;
   char *tok;
 
   init();
+  uncacheable = 0;
   c->rstdin = NULL;
   c->rstdout = NULL;
   c->rstderr = NULL;
+  c->here = NULL;
+  c->here_end = NULL;
   c->background = false;
   c->pgm = NULL;
 
@@ -74,16 +107,45 @@ newtoken:
       return -1;
     }
   case RIN:
-    if (c->rstdin != NULL)
+    if (c->rstdin != NULL || c->here != NULL || c->here_end != NULL)
     {
       fprintf(stderr, "duplicate redirection of stdin\n");
       return -1;
     }
-    if ((n = nexttoken(t, &(c->rstdin))) < 0)
+    if (isrin(*t)) // "<<" and "<<<"
+    {
+      int string = isrin(t[1]);
+      t += string ? 2 : 1;
+      if ((n = scan_token(t, &tok, &ident)) < 0)
+      {
+        return -1;
+      }
+      if (*tok == '\0' || isspec(*tok))
+      {
+        fprintf(stderr, string ? "missing here-string\n" : "missing here-document delimiter\n");
+        return -1;
+      }
+      if (string)
+      {
+        // The word and a newline, as a one-line here-document
+        size_t len = strlen(tok);
+        c->here = arena_alloc(&arena, len + 2);
+        memcpy(c->here, tok, len);
+        memcpy(c->here + len, "\n", 2);
+      }
+      else
+      {
+        c->here_end = tok; // the body comes from the lines after this one
+        uncacheable = 1;
+      }
+      t += n;
+      goto newtoken;
+    }
+    if ((n = scan_token(t, &(c->rstdin), &ident)) < 0)
     {
       return -1;
     }
-    if (!isidentifier(c->rstdin))
+    if (!ident)
     {
       fprintf(stderr, "Illegal filename: \"%s\"\n", c->rstdin);
       return -1;
@@ -96,11 +158,11 @@ newtoken:
       fprintf(stderr, "duplicate redirection of stdout\n");
       return -1;
     }
-    if ((n = nexttoken(t, &(c->rstdout))) < 0)
+    if ((n = scan_token(t, &(c->rstdout), &ident)) < 0)
     {
       return -1;
     }
-    if (!isidentifier(c->rstdout))
+    if (!ident)
     {
       fprintf(stderr, "Illegal filename: \"%s\"\n", c->rstdout);
       return -1;
@@ -114,87 +176,181 @@ newtoken:
 
 void init(void)
 {
-  int i;
-  for (i = 0; i < 19; i++)
-  {
-    cmdbuf[i].next = &cmdbuf[i + 1];
-  }
-  cmdbuf[19].next = NULL;
-  cmds = cmdbuf;
-  cp = cbuf;
-  pp = pbuf;
+  arena_reset(&arena);
 }
 
-int nexttoken(char *s, char **tok)
+/* Cut the next token out of s into the arena, and tell in the same pass
+ * whether it is made of identifier characters only. Returns how far s was
+ * consumed, 0 (and an empty token) at the end of the input.
+ */
+static int scan_token(char *s, char **tok, int *ident)
 {
   char *s0 = s;
-  char c;
+  char *start;
+  unsigned char all = C_ID;
 
-  *tok = cp;
-  while (isspace(c = *s++) && c)
-    ;
-  if (c == '\0')
+  while (cclassof(*s) & C_SPACE)
+    s++;
+  if (*s == '\0')
   {
+    *tok = arena_strndup(&arena, s, 0);
+    *ident = 1;
     return 0;
   }
-  if (isspec(c))
+  start = s;
+  if (cclassof(*s) & C_SPEC)
   {
-    *cp++ = c;
-    *cp++ = '\0';
+    s++;
+    all = 0;
   }
   else
   {
-    *cp++ = c;
     do
-    {
-      c = *cp++ = *s++;
-    } while (!isspace(c) && !isspec(c) && (c != '\0'));
-    --s;
-    --cp;
-    *cp++ = '\0';
+      all &= cclassof(*s++);
+    while (!(cclassof(*s) & C_STOP));
   }
+  *ident = all != 0;
+  *tok = arena_strndup(&arena, start, (size_t)(s - start));
   return (int)(s - s0);
 }
 
+int nexttoken(char *s, char **tok)
+{
+  int ident;
+  return scan_token(s, tok, &ident);
+}
+
+/* Make room in argbuf for argument argc */
+static void reserve_arg(size_t argc)
+{
+  if (argc < argcap)
+    return;
+  while (argcap <= argc)
+    argcap = argcap ? 2 * argcap : 64;
+  argbuf = realloc(argbuf, argcap * sizeof(*argbuf));
+  if (argbuf == NULL)
+  {
+    perror("acmd");
+    exit(1);
+  }
+}
+
+static void add_match(const char *match, size_t len, void *ctx)
+{
+  size_t *argc = ctx;
+  reserve_arg(*argc);
+  argbuf[(*argc)++] = arena_strndup(&arena, match, len);
+}
+
 int acmd(char *s, Pgm **cmd)
 {
   char *tok;
   int n, cnt = 0;
-  Pgm *cmd0 = cmds;
-  cmds = cmds->next;
+  size_t argc = 0;
+  Pgm *cmd0 = arena_alloc(&arena, sizeof(Pgm));
   cmd0->next = NULL;
-  cmd0->pgmlist = pp;
 
 next:
+  reserve_arg(argc);
   n = nexttoken(s, &tok);
   if (n == 0 || isspec(*tok))
   {
+    argbuf[argc++] = NULL;
+    cmd0->pgmlist = arena_alloc(&arena, argc * sizeof(char *));
+    memcpy(cmd0->pgmlist, argbuf, argc * sizeof(char *));
     *cmd = cmd0;
-    *pp++ = NULL;
     return cnt;
   }
   else
   {
-    *pp++ = tok;
+    // A word with wildcards becomes its matches, if there are any. Either
+    // way it depends on the directory, which may have changed next time
+    if (parse_glob && strpbrk(tok, "*?[") != NULL)
+      uncacheable = 1;
+    if (!parse_glob || parse_glob(tok, add_match, &argc) <= 0)
+      argbuf[argc++] = tok;
     cnt += n;
     s += n;
     goto next;
   }
 }
 
-#define IDCHARS "_-.,/~+"
-
 int isidentifier(char *s)
 {
   while (*s)
   {
-    char *p = strrchr(IDCHARS, *s);
-    if (!isalnum(*s++) && (p == NULL))
+    if (!(cclassof(*s++) & C_ID))
       return 0;
   }
   return 1;
 }
 
+/* Whether the last line parsed may be cached: not once its meaning
+ * depends on what is on disk or on the lines after it
+ */
+int parse_cacheable(void)
+{
+  return !uncacheable;
+}
+
+static size_t strsize(const char *s)
+{
+  return s ? strlen(s) + 1 : 0;
+}
+
+static char *strput(char **pos, const char *s)
+{
+  if (s == NULL)
+    return NULL;
+  char *d = *pos;
+  *pos = stpcpy(d, s) + 1;
+  return d;
+}
+
+/* Copy a parsed Command out of the parser's arena, so it outlives the next
+ * parse(). Everything goes into a single block: free() the result.
+ */
+Command *cmd_clone(const Command *c)
+{
+  size_t npgm = 0, nargs = 0, strs = 0;
+  for (const Pgm *p = c->pgm; p; p = p->next)
+  {
+    npgm++;
+    for (char **a = p->pgmlist; *a; a++, nargs++)
+      strs += strlen(*a) + 1;
+    nargs++; // the NULL
+  }
+  strs += strsize(c->rstdin) + strsize(c->rstdout) + strsize(c->rstderr) + strsize(c->here) + strsize(c->here_end);
+
+  Command *copy = malloc(sizeof(Command) + npgm * sizeof(Pgm) + nargs * sizeof(char *) + strs);
+  if (copy == NULL)
+    return NULL;
+  Pgm *pgms = (Pgm *)(copy + 1);
+  char **args = (char **)(pgms + npgm);
+  char *pos = (char *)(args + nargs);
+
+  *copy = *c;
+  copy->rstdin = strput(&pos, c->rstdin);
+  copy->rstdout = strput(&pos, c->rstdout);
+  copy->rstderr = strput(&pos, c->rstderr);
+  copy->here = strput(&pos, c->here);
+  copy->here_end = strput(&pos, c->here_end);
+
+  Pgm **link = &copy->pgm;
+  for (const Pgm *p = c->pgm; p; p = p->next)
+  {
+    Pgm *q = pgms++;
+    q->pgmlist = args;
+    for (char **a = p->pgmlist; *a; a++)
+      *args++ = strput(&pos, *a);
+    *args++ = NULL;
+    *link = q;
+    link = &q->next;
+  }
+  *link = NULL;
+  return copy;
+}
+
 /* Print a (linked) list of Pgm:s.
  *
  * Helper function, no need to change. Might be useful to study as inpsiration.
@@ -1,3 +1,8 @@
+#ifndef PARSE_H
+#define PARSE_H
+
+#include <stddef.h>
+
 typedef struct c
 {
   char **pgmlist;
@@ -10,11 +15,25 @@ typedef struct node
   char *rstdin;
   char *rstdout;
   char *rstderr;
+  char *here;     // stdin text of "<<< word" or a here-document, or NULL
+  char *here_end; // delimiter of a here-document ("<<EOF"), or NULL
   int background;
 } Command;
 
+/* Called by a wildcard expansion for each match, in order */
+typedef void GlobAddFn(const char *match, size_t len, void *ctx);
+
+/* Expands a word of a command's arguments, see dirglob.h. Set by the
+ * shell; with NULL words are left as they are.
+ */
+extern int (*parse_glob)(const char *word, GlobAddFn *add, void *ctx);
+
 extern void init(void);
 extern int parse(char *, Command *);
 extern int nexttoken(char *, char **);
 extern int acmd(char *, Pgm **);
 extern int isidentifier(char *);
+extern Command *cmd_clone(const Command *);
+extern int parse_cacheable(void);
+
+#endif
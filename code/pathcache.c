@@ -0,0 +1,210 @@
+/* Resolved-path hash table, see pathcache.h */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "pathcache.h"
+
+typedef struct
+{
+  char *name; // NULL for a free slot
+  char *path;
+  unsigned hits;
+} PathEntry;
+
+static PathEntry *table;
+static size_t capacity; // always a power of two
+static size_t used;
+static char *cached_path_env; // value of PATH the table was built for
+
+static uint32_t hash_name(const char *s)
+{
+  // FNV-1a, command names are short so this is plenty
+  uint32_t h = 2166136261u;
+  while (*s)
+  {
+    h ^= (unsigned char)*s++;
+    h *= 16777619u;
+  }
+  return h;
+}
+
+static PathEntry *find_slot(PathEntry *tab, size_t cap, const char *name)
+{
+  size_t i = hash_name(name) & (cap - 1);
+  while (tab[i].name && strcmp(tab[i].name, name) != 0)
+    i = (i + 1) & (cap - 1);
+  return &tab[i];
+}
+
+static int grow(void)
+{
+  size_t newcap = capacity ? capacity * 2 : 64;
+  PathEntry *newtab = calloc(newcap, sizeof(*newtab));
+  if (newtab == NULL)
+    return -1;
+  for (size_t i = 0; i < capacity; i++)
+  {
+    if (table[i].name)
+      *find_slot(newtab, newcap, table[i].name) = table[i];
+  }
+  free(table);
+  table = newtab;
+  capacity = newcap;
+  return 0;
+}
+
+void path_clear(void)
+{
+  for (size_t i = 0; i < capacity; i++)
+  {
+    free(table[i].name);
+    free(table[i].path);
+  }
+  free(table);
+  free(cached_path_env);
+  table = NULL;
+  capacity = used = 0;
+  cached_path_env = NULL;
+}
+
+/* Drop everything if PATH no longer is what the table was built for */
+static void check_path_env(void)
+{
+  const char *env = getenv("PATH");
+  if (env == NULL)
+    env = "";
+  if (cached_path_env && strcmp(cached_path_env, env) == 0)
+    return;
+  path_clear();
+  cached_path_env = strdup(env);
+}
+
+/* Walk $PATH like execvp() does. Hits in relative directories ("." or an
+ * empty component) are returned through *relative so they are not cached:
+ * they would go stale on the next cd.
+ */
+static char *resolve(const char *name, int *relative)
+{
+  const char *dir = cached_path_env;
+  size_t namelen = strlen(name);
+  struct stat st;
+
+  while (dir)
+  {
+    const char *end = strchr(dir, ':');
+    size_t dirlen = end ? (size_t)(end - dir) : strlen(dir);
+    char *full = malloc(dirlen + namelen + 3);
+    if (full == NULL)
+      return NULL;
+
+    if (dirlen == 0)
+      full[0] = '.', dirlen = 1;
+    else
+      memcpy(full, dir, dirlen);
+    full[dirlen] = '/';
+    memcpy(full + dirlen + 1, name, namelen + 1);
+
+    if (stat(full, &st) == 0 && S_ISREG(st.st_mode) && access(full, X_OK) == 0)
+    {
+      *relative = full[0] != '/';
+      return full;
+    }
+    free(full);
+    dir = end ? end + 1 : NULL;
+  }
+  return NULL;
+}
+
+static const char *lookup(const char *name, unsigned hit)
+{
+  if (strchr(name, '/') != NULL)
+    return NULL;
+
+  check_path_env();
+  if (capacity)
+  {
+    PathEntry *e = find_slot(table, capacity, name);
+    if (e->name)
+    {
+      e->hits += hit;
+      return e->path;
+    }
+  }
+
+  int relative = 0;
+  char *path = resolve(name, &relative);
+  if (path == NULL || relative)
+  {
+    free(path);
+    return NULL;
+  }
+
+  // Keep the load factor below 1/2
+  if (2 * (used + 1) > capacity && grow() != 0)
+  {
+    free(path);
+    return NULL;
+  }
+  PathEntry *e = find_slot(table, capacity, name);
+  e->name = strdup(name);
+  e->path = path;
+  e->hits = hit;
+  used++;
+  return e->path;
+}
+
+/* Returns the absolute path for name, or NULL when it should be left to
+ * execvp() (names containing '/', unknown or relative-PATH commands).
+ */
+const char *path_lookup(const char *name)
+{
+  return lookup(name, 1);
+}
+
+/* Pre-warm an entry without counting it as a hit */
+int path_warm(const char *name)
+{
+  return lookup(name, 0) ? 0 : -1;
+}
+
+void path_forget(const char *name)
+{
+  if (capacity == 0)
+    return;
+  PathEntry *e = find_slot(table, capacity, name);
+  if (e->name == NULL)
+    return;
+
+  free(e->name);
+  free(e->path);
+  e->name = e->path = NULL;
+  used--;
+
+  // Re-insert the rest of the probe chain so lookups don't stop early
+  size_t i = (size_t)(e - table);
+  for (i = (i + 1) & (capacity - 1); table[i].name; i = (i + 1) & (capacity - 1))
+  {
+    PathEntry moved = table[i];
+    table[i].name = NULL;
+    *find_slot(table, capacity, moved.name) = moved;
+  }
+}
+
+void path_list(FILE *out)
+{
+  if (used == 0)
+  {
+    fprintf(out, "hash: hash table empty\n");
+    return;
+  }
+  fprintf(out, "hits\tcommand\n");
+  for (size_t i = 0; i < capacity; i++)
+  {
+    if (table[i].name)
+      fprintf(out, "%4u\t%s\n", table[i].hits, table[i].path);
+  }
+}
@@ -0,0 +1,17 @@
+/* Cache of resolved command paths, so a stage can be started with a direct
+ * execve() instead of letting execvp() try every $PATH directory. The table
+ * is dropped when PATH changes and single entries are dropped when an exec
+ * through them fails with ENOENT. Inspected with the "hash" built-in.
+ */
+#ifndef PATHCACHE_H
+#define PATHCACHE_H
+
+#include <stdio.h>
+
+extern const char *path_lookup(const char *name);
+extern int path_warm(const char *name);
+extern void path_forget(const char *name);
+extern void path_clear(void);
+extern void path_list(FILE *out);
+
+#endif
@@ -0,0 +1,115 @@
+/* Bounded job pool, see pool.h */
+
+#include <stdlib.h>
+#include <time.h>
+
+#include "event.h"
+#include "pool.h"
+
+typedef struct pooled
+{
+  Command *cmd; // from cmd_clone()
+  JobOptions opts;
+  struct pooled *next;
+} Pooled;
+
+Job *(*pool_start)(Command *cmd, const JobOptions *opts);
+
+static Pooled *queue; // oldest first
+static Pooled **queue_tail = &queue;
+static int limit;     // most jobs running at once, 0 while no pool is open
+static int running;
+static unsigned long started, finished;
+static struct timespec first_start, last_finish;
+
+static double elapsed(const struct timespec *from, const struct timespec *to)
+{
+  return (double)(to->tv_sec - from->tv_sec) + (double)(to->tv_nsec - from->tv_nsec) / 1e9;
+}
+
+/* Start queued commands until the limit is reached */
+static void fill(void)
+{
+  while (running < limit && queue)
+  {
+    Pooled *p = queue;
+    queue = p->next;
+    if (queue == NULL)
+      queue_tail = &queue;
+
+    if (started++ == 0)
+      clock_gettime(CLOCK_MONOTONIC, &first_start);
+    Job *job = pool_start(p->cmd, &p->opts);
+    free(p->cmd); // a background job does not keep its argv
+    free(p);
+
+    if (job && job->remaining > 0)
+    {
+      job->pooled = 1;
+      running++;
+    }
+    else
+    {
+      // Nothing could be started, it will never be reported as done
+      finished++;
+      clock_gettime(CLOCK_MONOTONIC, &last_finish);
+    }
+  }
+}
+
+void pool_open(int jobs)
+{
+  if (limit == 0)
+    started = finished = 0;
+  limit = jobs;
+  fill();
+}
+
+int pool_active(void)
+{
+  return limit > 0;
+}
+
+int pool_submit(const Command *cmd, const JobOptions *opts)
+{
+  Pooled *p = malloc(sizeof(Pooled));
+  if (p == NULL || (p->cmd = cmd_clone(cmd)) == NULL)
+  {
+    free(p);
+    return -1;
+  }
+  p->opts = *opts;
+  p->next = NULL;
+  *queue_tail = p;
+  queue_tail = &p->next;
+  fill();
+  return 0;
+}
+
+void pool_job_done(Job *job)
+{
+  if (!job->pooled)
+    return;
+  job->pooled = 0;
+  running--;
+  finished++;
+  clock_gettime(CLOCK_MONOTONIC, &last_finish);
+  fill();
+}
+
+/* Wait for every queued and running command, then close the pool and
+ * report the throughput it got.
+ */
+void pool_close(FILE *report)
+{
+  while (queue || running > 0)
+    event_run(-1);
+
+  if (report && started > 0)
+  {
+    double secs = elapsed(&first_start, &last_finish);
+    fprintf(report, "parallel: %lu jobs in %.3fs, %.1f jobs/s with -j %d\n", finished, secs,
+            secs > 0 ? (double)finished / secs : 0.0, limit);
+  }
+  limit = 0;
+}
@@ -0,0 +1,24 @@
+/* Bounded pool for background commands. While a pool is open (the
+ * "parallel" built-in), commands run with '&' are queued and at most a
+ * given number of them run at once. The job table reports every finished
+ * job through jobs_done_hook, which starts the next queued command, so the
+ * pool keeps going while the shell waits for input or for other jobs.
+ */
+#ifndef POOL_H
+#define POOL_H
+
+#include <stdio.h>
+
+#include "jobs.h"
+#include "parse.h"
+
+/* Starts a queued command, set by the shell. Returns its job or NULL. */
+extern Job *(*pool_start)(Command *cmd, const JobOptions *opts);
+
+extern void pool_open(int jobs);
+extern int pool_active(void);
+extern int pool_submit(const Command *cmd, const JobOptions *opts);
+extern void pool_job_done(Job *job);
+extern void pool_close(FILE *report);
+
+#endif
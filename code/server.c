@@ -0,0 +1,393 @@
+/* Unix socket server with preforked workers, see server.h */
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "event.h"
+#include "jobs.h"
+#include "server.h"
+
+#define CAPTURE_PIPE_SIZE (1 << 20)
+
+/* One captured stream of the current request */
+typedef struct
+{
+  EventFd ev; // read end of the pipe the command writes to
+  int client;
+  char type; // 'o' or 'e'
+} Capture;
+
+static int send_all(int fd, const void *buf, size_t len)
+{
+  const char *p = buf;
+  while (len > 0)
+  {
+    ssize_t n = send(fd, p, len, MSG_NOSIGNAL);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n < 0)
+      return -1;
+    p += n;
+    len -= (size_t)n;
+  }
+  return 0;
+}
+
+static int send_frame(int fd, char type, const void *payload, uint32_t len)
+{
+  char head[5];
+  uint32_t be = htonl(len);
+  head[0] = type;
+  memcpy(head + 1, &be, 4);
+  if (send_all(fd, head, sizeof(head)) != 0)
+    return -1;
+  return send_all(fd, payload, len);
+}
+
+/* Read exactly len bytes, running the event loop (and so reaping
+ * background jobs) while the client is idle. -1 on EOF or error.
+ */
+static int recv_all(int fd, void *buf, size_t len)
+{
+  char *p = buf;
+  while (len > 0)
+  {
+    event_wait_input(fd);
+    ssize_t n = read(fd, p, len);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return -1;
+    p += n;
+    len -= (size_t)n;
+  }
+  return 0;
+}
+
+/* Send what can be read from fd to c's client */
+static void forward(Capture *c, int fd)
+{
+  char buf[65536];
+  ssize_t n;
+
+  while ((n = read(fd, buf, sizeof(buf))) > 0)
+  {
+    // A client that went away just stops getting output
+    if (c->client >= 0 && send_frame(c->client, c->type, buf, (uint32_t)n) != 0)
+      c->client = -1;
+  }
+}
+
+/* Forward whatever the pipe holds to the client */
+static void capture_ready(EventFd *ev)
+{
+  forward((Capture *)ev, ev->fd);
+}
+
+/* Point fd (1 or 2) at a fresh pipe whose read end feeds c. Returns a
+ * copy of the old fd to put back, or -1.
+ */
+static int capture_start(Capture *c, int fd, char type, int client)
+{
+  int p[2];
+  if (pipe2(p, O_CLOEXEC) < 0)
+    return -1;
+  // The command's own output must not block before we get to read it
+  fcntl(p[0], F_SETPIPE_SZ, CAPTURE_PIPE_SIZE);
+  fcntl(p[0], F_SETFL, O_NONBLOCK);
+
+  int saved = fcntl(fd, F_DUPFD_CLOEXEC, 3);
+  if (saved < 0 || dup2(p[1], fd) < 0)
+  {
+    if (saved >= 0)
+      close(saved);
+    close(p[0]);
+    close(p[1]);
+    return -1;
+  }
+  close(p[1]);
+
+  c->ev.fd = p[0];
+  c->ev.ready = capture_ready;
+  c->client = client;
+  c->type = type;
+  if (event_add_fd(&c->ev) != 0)
+  {
+    dup2(saved, fd);
+    close(saved);
+    close(p[0]);
+    return -1;
+  }
+  return saved;
+}
+
+/* Put fd back and send what is left in the pipe */
+static void capture_end(Capture *c, int fd, int saved)
+{
+  dup2(saved, fd);
+  close(saved);
+  event_del_fd(&c->ev);
+  capture_ready(&c->ev);
+  close(c->ev.fd);
+}
+
+/* The streams of the request running, while they are captured. Nothing
+ * reads a capture pipe while the worker itself is writing to it, so what
+ * the worker writes in-process is spooled to a memfd around the call and
+ * sent once it returns, see serve_local_begin().
+ */
+static Capture *captured[2];
+static int spool[2] = {-1, -1}, spool_saved[2] = {-1, -1};
+static int local_depth;
+
+void serve_local_begin(void)
+{
+  if (local_depth++ > 0)
+    return;
+  fflush(stdout);
+  fflush(stderr);
+  for (int i = 0; i < 2; i++)
+  {
+    if (captured[i] == NULL || (spool[i] = memfd_create("lsh-spool", MFD_CLOEXEC)) < 0)
+      continue;
+    spool_saved[i] = fcntl(i + 1, F_DUPFD_CLOEXEC, 3);
+    if (spool_saved[i] < 0 || dup2(spool[i], i + 1) < 0)
+    {
+      if (spool_saved[i] >= 0)
+        close(spool_saved[i]);
+      close(spool[i]);
+      spool[i] = spool_saved[i] = -1;
+    }
+  }
+}
+
+void serve_local_end(void)
+{
+  if (--local_depth > 0)
+    return;
+  fflush(stdout);
+  fflush(stderr);
+  for (int i = 0; i < 2; i++)
+  {
+    if (spool[i] < 0)
+      continue;
+    dup2(spool_saved[i], i + 1);
+    close(spool_saved[i]);
+    // What the pipe holds was written first
+    capture_ready(&captured[i]->ev);
+    if (lseek(spool[i], 0, SEEK_SET) == 0)
+      forward(captured[i], spool[i]);
+    close(spool[i]);
+    spool[i] = spool_saved[i] = -1;
+  }
+}
+
+static int run_request(int client, char *line, int flags, ServeFn *run)
+{
+  Capture out, err;
+  int saved_out = -1, saved_err = -1;
+
+  fflush(stdout);
+  fflush(stderr);
+  if (flags & SERVE_CAPTURE)
+  {
+    saved_out = capture_start(&out, STDOUT_FILENO, 'o', client);
+    saved_err = capture_start(&err, STDERR_FILENO, 'e', client);
+  }
+  captured[0] = saved_out >= 0 ? &out : NULL;
+  captured[1] = saved_err >= 0 ? &err : NULL;
+
+  int status = run(line);
+
+  fflush(stdout);
+  fflush(stderr);
+  captured[0] = captured[1] = NULL;
+  if (saved_out >= 0)
+    capture_end(&out, STDOUT_FILENO, saved_out);
+  if (saved_err >= 0)
+    capture_end(&err, STDERR_FILENO, saved_err);
+
+  uint32_t be = htonl((uint32_t)status);
+  return send_frame(client, 's', &be, 4);
+}
+
+static void serve_client(int client, ServeFn *run)
+{
+  char *line = NULL;
+  unsigned char head[5];
+
+  while (recv_all(client, head, sizeof(head)) == 0)
+  {
+    uint32_t len;
+    memcpy(&len, head, 4);
+    len = ntohl(len);
+    if (len > SERVE_MAX_LINE)
+      break;
+    char *p = realloc(line, len + 1);
+    if (p == NULL)
+      break;
+    line = p;
+    if (recv_all(client, line, len) != 0)
+      break;
+    line[len] = '\0';
+
+    if (run_request(client, line, head[4], run) != 0)
+      break;
+    jobs_collect(NULL);
+  }
+  free(line);
+}
+
+static _Noreturn void worker(int listener, ServeFn *run)
+{
+  sigset_t set;
+  sigemptyset(&set);
+  sigaddset(&set, SIGTERM);
+  sigprocmask(SIG_UNBLOCK, &set, NULL);
+
+  // Commands must not read the server's own stdin
+  int null = open("/dev/null", O_RDONLY);
+  if (null >= 0 && null != STDIN_FILENO)
+  {
+    dup2(null, STDIN_FILENO);
+    close(null);
+  }
+  if (event_init() < 0)
+  {
+    perror("event_init");
+    _exit(1);
+  }
+
+  for (;;)
+  {
+    // All workers wait on the one listener; whoever wins gets the client
+    event_wait_input(listener);
+    int client = accept4(listener, NULL, NULL, SOCK_CLOEXEC);
+    if (client < 0)
+    {
+      if (errno == EAGAIN || errno == EINTR || errno == ECONNABORTED)
+        continue;
+      perror("accept");
+      _exit(1);
+    }
+    // The listener is non-blocking, the client must not be
+    fcntl(client, F_SETFL, fcntl(client, F_GETFL) & ~O_NONBLOCK);
+    serve_client(client, run);
+    close(client);
+    jobs_collect(NULL);
+  }
+}
+
+static pid_t start_worker(int listener, ServeFn *run)
+{
+  pid_t pid = fork();
+  if (pid == 0)
+    worker(listener, run);
+  if (pid < 0)
+    perror("fork");
+  return pid;
+}
+
+static int listen_on(const char *path)
+{
+  struct sockaddr_un addr = {.sun_family = AF_UNIX};
+  if (strlen(path) >= sizeof(addr.sun_path))
+  {
+    fprintf(stderr, "%s: socket path too long\n", path);
+    return -1;
+  }
+  strcpy(addr.sun_path, path);
+
+  // A socket left behind by an earlier server is in the way
+  struct stat st;
+  if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode))
+    unlink(path);
+
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd < 0 || bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, SOMAXCONN) < 0)
+  {
+    perror(path);
+    if (fd >= 0)
+      close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+/* Serve path with the given number of workers until SIGINT or SIGTERM.
+ * Workers that die (a client ran "exit", say) are replaced.
+ */
+int serve(const char *path, int workers, ServeFn *run)
+{
+  sigset_t set;
+  sigemptyset(&set);
+  sigaddset(&set, SIGCHLD);
+  sigaddset(&set, SIGINT);
+  sigaddset(&set, SIGTERM);
+  sigprocmask(SIG_BLOCK, &set, NULL);
+
+  int listener = listen_on(path);
+  if (listener < 0)
+    return 1;
+
+  pid_t *pids = calloc((size_t)workers, sizeof(pid_t));
+  if (pids == NULL)
+  {
+    perror("serve");
+    return 1;
+  }
+  fflush(stdout);
+  fflush(stderr);
+  for (int i = 0; i < workers; i++)
+    pids[i] = start_worker(listener, run);
+
+  int sig;
+  while (sigwait(&set, &sig) == 0 && sig == SIGCHLD)
+  {
+    int status;
+    pid_t pid;
+    while ((pid = waitpid(-1, &status, WNOHANG)) > 0)
+    {
+      for (int i = 0; i < workers; i++)
+      {
+        if (pids[i] != pid)
+          continue;
+        // A worker that fails at startup would fail again right away
+        if (WIFEXITED(status) && WEXITSTATUS(status) == 1)
+        {
+          fprintf(stderr, "serve: worker %d failed\n", (int)pid);
+          pids[i] = 0;
+        }
+        else
+          pids[i] = start_worker(listener, run);
+      }
+    }
+  }
+
+  for (int i = 0; i < workers; i++)
+  {
+    if (pids[i] > 0)
+      kill(pids[i], SIGTERM);
+  }
+  for (int i = 0; i < workers; i++)
+  {
+    if (pids[i] > 0)
+      waitpid(pids[i], NULL, 0);
+  }
+  free(pids);
+  close(listener);
+  unlink(path);
+  return 0;
+}
@@ -0,0 +1,40 @@
+/* Server mode (lsh --serve <socket>). The shell listens on a Unix domain
+ * socket and a fixed number of preforked workers accept clients from it,
+ * each worker a long-lived batch shell, so a client pays neither process
+ * startup nor readline setup per command. The parent only keeps the
+ * workers running and removes the socket when it is told to stop.
+ *
+ * Every request is one command line, sent as a frame:
+ *
+ *   u32 length (big endian), u8 flags, length bytes of command line
+ *
+ * With SERVE_CAPTURE in flags the command's stdout and stderr come back as
+ * they are written, in 'o' and 'e' frames; without it they go wherever the
+ * server's own output goes. Either way the answer ends with an 's' frame
+ * holding the exit status:
+ *
+ *   u8 type, u32 length (big endian), length bytes of payload
+ *
+ * 's' payloads are a big endian int32. Output of background commands is
+ * only captured while the request that started them runs.
+ */
+#ifndef SERVER_H
+#define SERVER_H
+
+#define SERVE_CAPTURE 0x01
+#define SERVE_MAX_LINE (1 << 20)
+
+/* Runs one command line in a worker, returns its exit status */
+typedef int ServeFn(char *line);
+
+extern int serve(const char *path, int workers, ServeFn *run);
+
+/* Bracket output the worker writes itself (built-ins run in the shell,
+ * cache replays). A captured stream is only drained by the event loop, so
+ * such output is held back and sent when the call is over instead of
+ * blocking once the pipe is full. Outside a request these do nothing.
+ */
+extern void serve_local_begin(void);
+extern void serve_local_end(void);
+
+#endif
@@ -0,0 +1,387 @@
+/* Spawn engines for pipeline stages, see spawn.h */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <spawn.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "cgroup.h"
+#include "hints.h"
+#include "pathcache.h"
+#include "spawn.h"
+#include "trace.h"
+
+extern char **environ;
+
+SpawnEngine spawn_engine = SPAWN_POSIX;
+
+static long pipe_size; // bytes, 0 for the kernel default
+
+static pid_t spawn_fork(char **argv, const SpawnSpec *spec);
+static pid_t spawn_posix(char **argv, const SpawnSpec *spec);
+
+pid_t spawn_stage(char **argv, const SpawnSpec *spec)
+{
+  uint64_t start = TRACE_NOW();
+  pid_t pid;
+
+  // A built-in stage needs a copy of the shell to run in, and scheduling
+  // hints and cgroups need code of ours in the child
+  if (spawn_engine == SPAWN_FORK || spec->builtin || hints_active() || spec->cgroup_fd >= 0)
+    pid = spawn_fork(argv, spec);
+  else
+  {
+    pid = spawn_posix(argv, spec);
+    // posix_spawn() only returns once the child has exec'ed
+    if (pid > 0)
+      TRACE(exec, pid);
+  }
+  if (pid > 0)
+    TRACE_AT(fork, start, pid);
+  return pid;
+}
+
+int spawn_set_engine(const char *name)
+{
+  if (strcmp(name, "fork") == 0)
+    spawn_engine = SPAWN_FORK;
+  else if (strcmp(name, "posix_spawn") == 0 || strcmp(name, "posix") == 0)
+    spawn_engine = SPAWN_POSIX;
+  else
+    return -1;
+  return 0;
+}
+
+const char *spawn_engine_name(SpawnEngine engine)
+{
+  return engine == SPAWN_FORK ? "fork" : "posix_spawn";
+}
+
+/* A close-on-exec pipe for the next stage. With the default 64 KiB, the
+ * stages of a high-bandwidth pipeline take turns blocking on each other;
+ * a bigger buffer lets them run longer between switches.
+ */
+int spawn_pipe(int fds[2])
+{
+  if (pipe2(fds, O_CLOEXEC) < 0)
+    return -1;
+  // Best effort: the user may be over their pipe memory quota
+  if (pipe_size > 0)
+    fcntl(fds[1], F_SETPIPE_SZ, (int)pipe_size);
+  return 0;
+}
+
+/* Text for a stage's stdin, as a sealed memfd: a here-document never
+ * touches the filesystem, and the stage cannot change it. Returns the fd,
+ * at offset 0, or -1.
+ */
+int spawn_here(const char *text, size_t len)
+{
+  int fd = memfd_create("lsh-here", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+  if (fd < 0)
+    return -1;
+  while (len > 0)
+  {
+    ssize_t n = write(fd, text, len);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n < 0)
+    {
+      close(fd);
+      return -1;
+    }
+    text += n;
+    len -= (size_t)n;
+  }
+  if (fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL) < 0 ||
+      lseek(fd, 0, SEEK_SET) < 0)
+  {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+/* Largest buffer an unprivileged process may ask for */
+static long pipe_max_size(void)
+{
+  long max = 1 << 20; // the kernel's default limit
+  FILE *f = fopen("/proc/sys/fs/pipe-max-size", "re");
+  if (f)
+  {
+    if (fscanf(f, "%ld", &max) != 1)
+      max = 1 << 20;
+    fclose(f);
+  }
+  return max;
+}
+
+/* "set pipesize <bytes>[k|m]", "default" or 0 for the kernel default.
+ * Sizes above /proc/sys/fs/pipe-max-size are capped to it.
+ */
+int spawn_set_pipe_size(const char *value)
+{
+  char *end;
+  long size;
+
+  if (strcmp(value, "default") == 0)
+    size = 0;
+  else
+  {
+    size = strtol(value, &end, 10);
+    if (end == value || size < 0)
+      return -1;
+    if (*end == 'k' || *end == 'K')
+      size <<= 10, end++;
+    else if (*end == 'm' || *end == 'M')
+      size <<= 20, end++;
+    if (*end != '\0')
+      return -1;
+  }
+
+  long max = pipe_max_size();
+  pipe_size = size > max ? max : size;
+  return 0;
+}
+
+const char *spawn_get_pipe_size(void)
+{
+  static char buf[24];
+  if (pipe_size == 0)
+    return "default";
+  snprintf(buf, sizeof(buf), "%ld", pipe_size);
+  return buf;
+}
+
+/* Classic engine: the child copies the parent's address space and does the
+ * redirections itself before calling execvp(). Also used for built-in
+ * stages whatever the engine.
+ */
+static pid_t spawn_fork(char **argv, const SpawnSpec *spec)
+{
+  const char *path = spec->builtin ? NULL : path_lookup(argv[0]);
+  // The execve() below fails in the child, out of reach of the cache, so
+  // a binary that went away is noticed here and its entry dropped
+  if (path && access(path, X_OK) < 0 && errno == ENOENT)
+  {
+    path_forget(argv[0]);
+    path = NULL;
+  }
+  pid_t pid = spec->cgroup_fd >= 0 ? cgroup_fork(spec->cgroup_fd) : fork();
+
+  if (pid < 0) // Fork failed
+  {
+    perror("Fork failed");
+    return -1;
+  }
+
+  if (pid == 0)
+  {
+    // Child process, join the job's process group first so the terminal
+    // can be handed over before anything else runs.
+    setpgid(0, spec->pgid);
+    if (spec->tty_fd >= 0)
+      tcsetpgrp(spec->tty_fd, getpgrp());
+    signal(SIGTTOU, SIG_DFL);
+    if (spec->foreground)
+      signal(SIGINT, SIG_DFL);
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigprocmask(SIG_SETMASK, &mask, NULL);
+
+    // Handle input redirection
+    if (spec->rstdin)
+    {
+      int fd_in = open(spec->rstdin, O_RDONLY);
+      if (fd_in < 0)
+      {
+        perror("open input file");
+        exit(1);
+      }
+      dup2(fd_in, STDIN_FILENO);
+      close(fd_in);
+    }
+    // read previous pipe if not first in pipeline
+    else if (spec->in_fd >= 0)
+    {
+      dup2(spec->in_fd, STDIN_FILENO);
+    }
+
+    // Handle output redirection
+    if (spec->rstdout)
+    {
+      int fd_out = open(spec->rstdout, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+      if (fd_out < 0)
+      {
+        perror("open output file");
+        exit(1);
+      }
+      dup2(fd_out, STDOUT_FILENO);
+      close(fd_out);
+    }
+    // write to next pipe
+    else if (spec->out_fd >= 0)
+    {
+      dup2(spec->out_fd, STDOUT_FILENO);
+    }
+
+    if (hints_active())
+      hints_apply(spec->cpus);
+
+    // A built-in runs right here, without an exec
+    if (spec->builtin)
+    {
+      int argc = 0;
+      while (argv[argc])
+        argc++;
+      int status = spec->builtin(argv, argc);
+      fflush(stdout);
+      _exit(status);
+    }
+
+    TRACE(exec, getpid());
+
+    // Execute command, straight through the cached path when we have one
+    if (path)
+    {
+      execve(path, argv, environ);
+      if (errno != ENOENT)
+      {
+        perror("execve");
+        exit(1);
+      }
+    }
+    execvp(argv[0], argv);
+    perror("execvp");
+    exit(1);
+  }
+
+  // Parent process continues to next stage. Set the group here as well so
+  // it exists no matter which of us runs first.
+  setpgid(pid, spec->pgid ? spec->pgid : pid);
+  return pid;
+}
+
+/* posix_spawn engine: the redirections are expressed as file actions that
+ * glibc runs in a CLONE_VM|CLONE_VFORK child, so nothing is copied and exec
+ * failures are reported back to us as the return value. Redirection files
+ * are opened here in the parent, so a missing one is reported as by the fork
+ * engine and not as the program's error, and an ENOENT only comes from exec.
+ */
+static pid_t spawn_posix(char **argv, const SpawnSpec *spec)
+{
+  posix_spawn_file_actions_t fa;
+  posix_spawnattr_t attr;
+  sigset_t mask;
+  pid_t pid;
+  int err;
+  int fd_in = -1, fd_out = -1;
+
+  if (spec->rstdin && (fd_in = open(spec->rstdin, O_RDONLY | O_CLOEXEC)) < 0)
+  {
+    perror("open input file");
+    return -1;
+  }
+  if (spec->rstdout && (fd_out = open(spec->rstdout, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) < 0)
+  {
+    perror("open output file");
+    if (fd_in >= 0)
+      close(fd_in);
+    return -1;
+  }
+
+  posix_spawn_file_actions_init(&fa);
+  posix_spawnattr_init(&attr);
+
+  if (fd_in >= 0)
+    posix_spawn_file_actions_adddup2(&fa, fd_in, STDIN_FILENO);
+  else if (spec->in_fd >= 0)
+    posix_spawn_file_actions_adddup2(&fa, spec->in_fd, STDIN_FILENO);
+
+  if (fd_out >= 0)
+    posix_spawn_file_actions_adddup2(&fa, fd_out, STDOUT_FILENO);
+  else if (spec->out_fd >= 0)
+    posix_spawn_file_actions_adddup2(&fa, spec->out_fd, STDOUT_FILENO);
+
+#ifdef HAVE_POSIX_SPAWN_TCSETPGRP
+  if (spec->tty_fd >= 0)
+    posix_spawn_file_actions_addtcsetpgrp_np(&fa, spec->tty_fd);
+#endif
+
+  // Same signal setup as the fork engine: SIGINT back to default for
+  // foreground stages, and never leak a blocked mask into the program.
+  sigemptyset(&mask);
+  posix_spawnattr_setsigmask(&attr, &mask);
+  sigaddset(&mask, SIGTTOU);
+  if (spec->foreground)
+    sigaddset(&mask, SIGINT);
+  posix_spawnattr_setsigdefault(&attr, &mask);
+  posix_spawnattr_setpgroup(&attr, spec->pgid);
+  posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF | POSIX_SPAWN_SETPGROUP);
+
+  // A cached path lets us skip the $PATH walk; if the binary went away,
+  // drop the entry and fall back to searching. The redirections are open
+  // already, so ENOENT can only mean the exec itself found nothing.
+  const char *path = path_lookup(argv[0]);
+  err = ENOENT;
+  if (path)
+  {
+    err = posix_spawn(&pid, path, &fa, &attr, argv, environ);
+    if (err == ENOENT)
+      path_forget(argv[0]);
+  }
+  if (err == ENOENT)
+    err = posix_spawnp(&pid, argv[0], &fa, &attr, argv, environ);
+
+  posix_spawnattr_destroy(&attr);
+  posix_spawn_file_actions_destroy(&fa);
+  if (fd_in >= 0)
+    close(fd_in);
+  if (fd_out >= 0)
+    close(fd_out);
+
+  if (err != 0)
+  {
+    fprintf(stderr, "%s: %s\n", argv[0], strerror(err));
+    return -1;
+  }
+  return pid;
+}
+
+/* Replace the shell itself with argv, as a stage would be replaced after
+ * its fork: the signals the event loop blocks are unblocked and SIGTTOU
+ * gets its default action back. Only returns if the program could not be
+ * run, with the shell as it was, errno set and 127 (not found) or 126.
+ */
+int spawn_replace(char **argv)
+{
+  struct sigaction ttou, dfl = {.sa_handler = SIG_DFL};
+  sigset_t mask, saved;
+
+  fflush(stdout);
+  sigaction(SIGTTOU, &dfl, &ttou);
+  sigemptyset(&mask);
+  sigprocmask(SIG_SETMASK, &mask, &saved);
+  TRACE(exec, getpid());
+
+  const char *path = path_lookup(argv[0]);
+  if (path)
+  {
+    execve(path, argv, environ);
+    if (errno == ENOENT)
+      path_forget(argv[0]);
+  }
+  if (path == NULL || errno == ENOENT)
+    execvp(argv[0], argv);
+  int err = errno;
+
+  sigprocmask(SIG_SETMASK, &saved, NULL);
+  sigaction(SIGTTOU, &ttou, NULL);
+  errno = err;
+  return err == ENOENT ? 127 : 126;
+}
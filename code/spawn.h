@@ -0,0 +1,74 @@
+/* Spawn engine used by execute_pipeline() to start the programs of a
+ * pipeline. Two engines exist: a classic fork()+execvp() and a
+ * posix_spawn() based one, which glibc implements with
+ * clone(CLONE_VM|CLONE_VFORK) so no page tables are copied. The engine is
+ * picked at runtime (LSH_SPAWN environment variable or "set spawn ...").
+ */
+#ifndef SPAWN_H
+#define SPAWN_H
+
+#include <sched.h>
+#include <sys/resource.h>
+#include <sys/types.h>
+#include <time.h>
+
+#include "builtins.h"
+
+typedef enum
+{
+  SPAWN_FORK,
+  SPAWN_POSIX,
+} SpawnEngine;
+
+/* Describes the descriptor wiring of one stage. The child dups in_fd and
+ * out_fd onto stdin/stdout (or opens rstdin/rstdout instead). Any other
+ * descriptor the shell wants kept from the program must be close-on-exec.
+ */
+typedef struct
+{
+  int in_fd;           // fd to use as stdin, -1 to inherit
+  int out_fd;          // fd to use as stdout, -1 to inherit
+  const char *rstdin;  // file to open as stdin, NULL if none
+  const char *rstdout; // file to create/truncate as stdout, NULL if none
+  int foreground; // restore the default SIGINT disposition in the child
+  pid_t pgid;     // process group to join, 0 to lead a new one
+  int tty_fd;     // terminal to hand to the process group, or -1
+  BuiltinFn *builtin; // run this in a forked child instead of exec'ing
+  const cpu_set_t *cpus; // CPUs to confine the child to, NULL to inherit
+  int cgroup_fd;         // cgroup v2 directory to start the child in, or -1
+} SpawnSpec;
+
+/* One program of a pipeline. execute_cmd() flattens the reversed Pgm list
+ * into an array of these in pipeline order (stages[0] reads the pipeline's
+ * input, the last stage writes its output) and starts them in a loop.
+ */
+typedef struct
+{
+  char **argv;
+  BuiltinFn *builtin; // built-in to run instead of argv[0], or NULL
+  int in_fd;  // read end of the pipe from the previous stage, or -1
+  int out_fd; // write end of the pipe to the next stage, or -1
+  pid_t pid;  // 0 before it is started, -1 if it could not be
+  int pidfd;  // watched by the event loop until reaped, or -1
+  int reaped;
+  int hidden; // added by the shell, not part of the command line
+  int status; // wait status, valid once the stage has been reaped
+  struct timespec started;  // CLOCK_MONOTONIC when spawned
+  struct timespec finished; // CLOCK_MONOTONIC when reaped
+  struct rusage rusage;     // from wait4()
+} Stage;
+
+extern SpawnEngine spawn_engine;
+
+extern pid_t spawn_stage(char **argv, const SpawnSpec *spec);
+extern int spawn_replace(char **argv);
+extern int spawn_set_engine(const char *name);
+extern const char *spawn_engine_name(SpawnEngine engine);
+
+/* Pipes between stages, with the buffer size of the pipesize option */
+extern int spawn_pipe(int fds[2]);
+extern int spawn_here(const char *text, size_t len);
+extern int spawn_set_pipe_size(const char *value);
+extern const char *spawn_get_pipe_size(void);
+
+#endif
@@ -0,0 +1,199 @@
+/* Job deadlines on timerfds, see timeout.h */
+
+#include <errno.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+#include "event.h"
+#include "timeout.h"
+
+#define NS 1000000000LL
+
+struct job_timer
+{
+  EventFd ev; // first, so the loop's EventFd is the timer
+  Job *job;
+  long long ns;
+  int phase; // 0 armed, 1 SIGTERM sent, 2 SIGKILL sent
+};
+
+static long long grace_ns = 5 * NS;
+static char grace_text[32] = "5s";
+
+/* "10", "2.5s", "300ms", "5m" or "1h" into nanoseconds */
+static int parse_duration(const char *text, long long *ns)
+{
+  char *end;
+  double value = strtod(text, &end);
+  double unit = NS;
+  if (end == text || value < 0)
+    return -1;
+  if (strcmp(end, "ms") == 0)
+    unit = NS / 1000;
+  else if (strcmp(end, "m") == 0)
+    unit = 60.0 * NS;
+  else if (strcmp(end, "h") == 0)
+    unit = 3600.0 * NS;
+  else if (*end != '\0' && strcmp(end, "s") != 0)
+    return -1;
+  if (value * unit > 1e18) // far beyond any sensible deadline
+    return -1;
+  *ns = (long long)(value * unit);
+  return 0;
+}
+
+int timeout_parse(const char *text, long long *ns)
+{
+  return parse_duration(text, ns) == 0 && *ns > 0 ? 0 : -1;
+}
+
+static void set_timer(int fd, long long ns)
+{
+  struct itimerspec its = {.it_value = {.tv_sec = ns / NS, .tv_nsec = ns % NS}};
+  timerfd_settime(fd, 0, &its, NULL);
+}
+
+/* A foreground job of a non-interactive shell shares the shell's process
+ * group, so then its stages are signalled one by one.
+ */
+static void signal_job(const Job *job, int sig)
+{
+  if (job->pgid > 0 && job->pgid != getpgrp())
+  {
+    killpg(job->pgid, sig);
+    killpg(job->pgid, SIGCONT); // a stopped stage would never see it
+    return;
+  }
+  for (int i = 0; i < job->nstages; i++)
+  {
+    const Stage *st = &job->stages[i];
+    if (st->pid > 0 && !st->reaped)
+    {
+      kill(st->pid, sig);
+      kill(st->pid, SIGCONT);
+    }
+  }
+}
+
+/* "timeout: sleep 9 | cat: after 2s still running: stage 1 (sleep, pid
+ * 123); sending SIGTERM". Background jobs no longer have their argvs, so
+ * stages are named by what the kernel says they run.
+ */
+static void report(const JobTimer *t, const char *sig)
+{
+  const Job *job = t->job;
+  fprintf(stderr, "timeout: %s: ", job->text ? job->text : "job");
+  if (t->phase == 1)
+    fprintf(stderr, "after %gs still running:", (double)t->ns / NS);
+  else
+    fprintf(stderr, "%gs after SIGTERM still running:", (double)grace_ns / NS);
+
+  const char *sep = " ";
+  int n = 0; // stages as the user typed them, without hidden ones
+  for (int i = 0; i < job->nstages; i++)
+  {
+    const Stage *st = &job->stages[i];
+    if (st->hidden)
+      continue;
+    n++;
+    if (st->pid <= 0 || st->reaped)
+      continue;
+
+    char path[64], comm[32] = "?";
+    snprintf(path, sizeof(path), "/proc/%d/comm", (int)st->pid);
+    FILE *f = fopen(path, "re");
+    if (f)
+    {
+      if (fgets(comm, sizeof(comm), f))
+        comm[strcspn(comm, "\n")] = '\0';
+      fclose(f);
+    }
+    fprintf(stderr, "%sstage %d (%s, pid %d)", sep, n, comm, (int)st->pid);
+    sep = ", ";
+  }
+  fprintf(stderr, "; sending %s\n", sig);
+}
+
+static void expired(EventFd *ev)
+{
+  JobTimer *t = (JobTimer *)ev;
+  uint64_t n;
+  if (read(ev->fd, &n, sizeof(n)) != sizeof(n))
+    return;
+  if (t->job == NULL || t->job->remaining == 0 || t->phase == 2)
+    return;
+
+  // No grace period: straight to SIGKILL
+  t->phase = grace_ns > 0 ? t->phase + 1 : 2;
+  const char *sig = t->phase == 1 ? "SIGTERM" : "SIGKILL";
+  report(t, sig);
+  signal_job(t->job, t->phase == 1 ? SIGTERM : SIGKILL);
+  if (t->phase == 1)
+    set_timer(ev->fd, grace_ns);
+}
+
+/* A timer for a job about to be started; NULL, after saying why, if the
+ * shell is out of fds.
+ */
+JobTimer *timeout_new(long long ns)
+{
+  JobTimer *t = calloc(1, sizeof(JobTimer));
+  if (t == NULL)
+  {
+    perror("timeout");
+    return NULL;
+  }
+  t->ns = ns;
+  t->ev.ready = expired;
+  t->ev.fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  if (t->ev.fd < 0 || event_add_fd(&t->ev) != 0)
+  {
+    perror("timeout");
+    if (t->ev.fd >= 0)
+      close(t->ev.fd);
+    free(t);
+    return NULL;
+  }
+  return t;
+}
+
+/* Start counting, once the job's stages are running */
+void timeout_start(JobTimer *timer, Job *job)
+{
+  timer->job = job;
+  set_timer(timer->ev.fd, timer->ns);
+}
+
+int timeout_expired(const JobTimer *timer)
+{
+  return timer && timer->phase > 0;
+}
+
+void timeout_free(JobTimer *timer)
+{
+  if (timer == NULL)
+    return;
+  event_del_fd(&timer->ev);
+  close(timer->ev.fd);
+  free(timer);
+}
+
+int timeout_set_grace(const char *value)
+{
+  long long ns;
+  if (strlen(value) >= sizeof(grace_text) || parse_duration(value, &ns) != 0)
+    return -1;
+  grace_ns = ns;
+  strcpy(grace_text, value);
+  return 0;
+}
+
+const char *timeout_get_grace(void)
+{
+  return grace_text;
+}
@@ -0,0 +1,25 @@
+/* Deadlines for jobs, the "timeout" prefix. A job started with one gets a
+ * timerfd in the event loop. When it expires the stages still running are
+ * reported and sent SIGTERM, and whatever is left after the grace period
+ * (the grace option) SIGKILL. A job that ran out of time exits with
+ * TIMEOUT_STATUS, like timeout(1).
+ */
+#ifndef TIMEOUT_H
+#define TIMEOUT_H
+
+#include "jobs.h"
+
+#define TIMEOUT_STATUS 124
+
+typedef struct job_timer JobTimer;
+
+extern int timeout_parse(const char *text, long long *ns);
+extern JobTimer *timeout_new(long long ns);
+extern void timeout_start(JobTimer *timer, Job *job);
+extern int timeout_expired(const JobTimer *timer);
+extern void timeout_free(JobTimer *timer);
+
+extern int timeout_set_grace(const char *value);
+extern const char *timeout_get_grace(void);
+
+#endif
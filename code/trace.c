@@ -0,0 +1,240 @@
+/* Trace ring and lshstat report, see trace.h */
+
+#include "trace.h"
+
+#ifdef LSH_TRACE
+
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+
+#define RING_SIZE 8192 // records, a power of two
+
+typedef struct
+{
+  _Atomic uint32_t seq; // low bits of index + 1 once the record is complete
+  uint32_t point;
+  int32_t pid;
+  uint64_t ns;
+} Record;
+
+/* Shared with every child forked after it is mapped. Writers claim a
+ * record with one atomic add, so children never wait for the shell.
+ */
+typedef struct
+{
+  _Atomic uint64_t head;
+  uint64_t base; // records before this were cleared by "lshstat -c"
+  Record rec[RING_SIZE];
+} Ring;
+
+static Ring *ring;
+
+static int ring_map(void)
+{
+  void *p = mmap(NULL, sizeof(Ring), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (p == MAP_FAILED)
+    return -1;
+  ring = p;
+  return 0;
+}
+
+void trace_record(enum trace_point point, uint64_t ns, pid_t pid)
+{
+  if (ring == NULL && ring_map() != 0)
+    return;
+  uint64_t i = atomic_fetch_add_explicit(&ring->head, 1, memory_order_relaxed);
+  Record *r = &ring->rec[i & (RING_SIZE - 1)];
+  atomic_store_explicit(&r->seq, 0, memory_order_relaxed);
+  r->point = point;
+  r->pid = pid;
+  r->ns = ns;
+  atomic_store_explicit(&r->seq, (uint32_t)i + 1, memory_order_release);
+}
+
+void trace_clear(void)
+{
+  if (ring)
+    ring->base = atomic_load(&ring->head);
+}
+
+static int by_time(const void *a, const void *b)
+{
+  const Record *x = a, *y = b;
+  return x->ns < y->ns ? -1 : x->ns > y->ns;
+}
+
+static int by_value(const void *a, const void *b)
+{
+  uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+  return x < y ? -1 : x > y;
+}
+
+/* Intervals reported by lshstat */
+enum
+{
+  S_STRIP,    // read -> strip
+  S_PARSE,    // strip -> parse
+  S_DISPATCH, // parse -> first fork of the line
+  S_EXEC,     // fork -> exec, per stage
+  S_LINE,     // read -> exec of the line's first stage
+  S_RUN,      // exec -> reap, per stage
+  NSTATS
+};
+
+static const char *const stat_names[NSTATS] = {"strip", "parse", "dispatch", "exec", "line", "run"};
+
+typedef struct
+{
+  uint64_t *v;
+  size_t n;
+} Samples;
+
+static void add(Samples *s, uint64_t from, uint64_t to)
+{
+  if (from && to >= from)
+    s->v[s->n++] = to - from;
+}
+
+/* pid -> start times of the stage, open addressing */
+typedef struct
+{
+  pid_t pid;
+  uint64_t fork, exec;
+} PidTimes;
+
+static PidTimes *pid_times(PidTimes *map, size_t cap, pid_t pid)
+{
+  size_t i = ((unsigned)pid * 2654435769u) & (cap - 1);
+  while (map[i].pid && map[i].pid != pid)
+    i = (i + 1) & (cap - 1);
+  map[i].pid = pid;
+  return &map[i];
+}
+
+static void print_us(FILE *out, uint64_t ns)
+{
+  fprintf(out, " %10.1fus", (double)ns / 1e3);
+}
+
+/* lshstat: p50/p99/max of each interval over the records in the ring */
+int trace_report(FILE *out)
+{
+  uint64_t head = ring ? atomic_load_explicit(&ring->head, memory_order_acquire) : 0;
+  uint64_t start = ring ? ring->base : 0;
+  if (head - start > RING_SIZE)
+    start = head - RING_SIZE;
+
+  size_t n = 0, cap = 2;
+  while (cap < 2 * (head - start))
+    cap *= 2;
+  Record *recs = malloc((head - start + 1) * sizeof(Record));
+  uint64_t *values = malloc((NSTATS * (head - start) + 1) * sizeof(uint64_t));
+  PidTimes *pids = calloc(cap, sizeof(PidTimes));
+  if (recs == NULL || values == NULL || pids == NULL)
+  {
+    free(recs);
+    free(values);
+    free(pids);
+    perror("lshstat");
+    return 1;
+  }
+
+  // Copy out the complete records; writers may be at it meanwhile
+  for (uint64_t i = start; i < head; i++)
+  {
+    Record *r = &ring->rec[i & (RING_SIZE - 1)];
+    if (atomic_load_explicit(&r->seq, memory_order_acquire) != (uint32_t)i + 1)
+      continue;
+    recs[n].point = r->point;
+    recs[n].pid = r->pid;
+    recs[n].ns = r->ns;
+    if (atomic_load_explicit(&r->seq, memory_order_acquire) == (uint32_t)i + 1)
+      n++;
+  }
+  // Children stamp from other CPUs, so ring order is only roughly time order
+  qsort(recs, n, sizeof(Record), by_time);
+
+  Samples s[NSTATS];
+  for (int k = 0; k < NSTATS; k++)
+    s[k] = (Samples){values + k * (head - start), 0};
+
+  uint64_t read = 0, strip = 0, parse = 0;
+  pid_t first = 0; // first stage started for the current line
+  for (size_t i = 0; i < n; i++)
+  {
+    const Record *r = &recs[i];
+    PidTimes *t;
+    switch (r->point)
+    {
+    case TP_read:
+      read = r->ns;
+      strip = parse = 0;
+      first = -1;
+      break;
+    case TP_strip:
+      add(&s[S_STRIP], read, r->ns);
+      strip = r->ns;
+      break;
+    case TP_parse:
+      add(&s[S_PARSE], strip, r->ns);
+      parse = r->ns;
+      break;
+    case TP_fork:
+      t = pid_times(pids, cap, r->pid);
+      t->fork = r->ns;
+      t->exec = 0;
+      if (first < 0)
+      {
+        add(&s[S_DISPATCH], parse, r->ns);
+        first = r->pid;
+      }
+      break;
+    case TP_exec:
+      t = pid_times(pids, cap, r->pid);
+      add(&s[S_EXEC], t->fork, r->ns);
+      t->exec = r->ns;
+      if (r->pid == first)
+        add(&s[S_LINE], read, r->ns);
+      break;
+    case TP_reap:
+      t = pid_times(pids, cap, r->pid);
+      add(&s[S_RUN], t->exec ? t->exec : t->fork, r->ns);
+      break;
+    }
+  }
+
+  fprintf(out, "%-9s %8s %12s %12s %12s\n", "interval", "count", "p50", "p99", "max");
+  for (int k = 0; k < NSTATS; k++)
+  {
+    fprintf(out, "%-9s %8zu", stat_names[k], s[k].n);
+    if (s[k].n)
+    {
+      qsort(s[k].v, s[k].n, sizeof(uint64_t), by_value);
+      print_us(out, s[k].v[s[k].n / 2]);
+      print_us(out, s[k].v[s[k].n * 99 / 100]);
+      print_us(out, s[k].v[s[k].n - 1]);
+    }
+    fputc('\n', out);
+  }
+
+  free(recs);
+  free(values);
+  free(pids);
+  return 0;
+}
+
+#else
+
+int trace_report(FILE *out)
+{
+  (void)out;
+  fprintf(stderr, "lshstat: built without tracing, configure with -DLSH_TRACE=ON\n");
+  return 1;
+}
+
+void trace_clear(void)
+{
+}
+
+#endif
@@ -0,0 +1,66 @@
+/* Hot-path tracing, compiled in with -DLSH_TRACE=ON and gone otherwise.
+ * TRACE(point, pid) timestamps one of the points below into a ring buffer
+ * in shared memory, so a forked child can stamp the moment it execs into
+ * the same ring as the shell. The lshstat built-in turns the ring into
+ * latency histograms. Where <sys/sdt.h> is available every point is also
+ * a USDT probe lsh:<point> with the pid as its argument, for perf and
+ * bpftrace.
+ */
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/types.h>
+#include <time.h>
+
+/* The names double as USDT probe names */
+enum trace_point
+{
+  TP_read,  // a line arrived
+  TP_strip, // after stripwhite()
+  TP_parse, // after parse() or a parse cache hit
+  TP_fork,  // a stage is being started (stamped before fork/posix_spawn)
+  TP_exec,  // the stage's program is being exec'ed
+  TP_reap,  // the stage was reaped
+};
+
+#ifdef LSH_TRACE
+
+#ifdef HAVE_SYS_SDT_H
+#include <sys/sdt.h>
+#define TRACE_PROBE(point, pid) DTRACE_PROBE1(lsh, point, pid)
+#else
+#define TRACE_PROBE(point, pid) ((void)0)
+#endif
+
+static inline uint64_t trace_now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+extern void trace_record(enum trace_point point, uint64_t ns, pid_t pid);
+
+#define TRACE_NOW() trace_now()
+#define TRACE_AT(point, ns, pid)             \
+  do                                         \
+  {                                          \
+    trace_record(TP_##point, ns, pid);       \
+    TRACE_PROBE(point, pid);                 \
+  } while (0)
+#define TRACE(point, pid) TRACE_AT(point, trace_now(), pid)
+
+#else
+
+#define TRACE_NOW() ((uint64_t)0)
+#define TRACE_AT(point, ns, pid) ((void)(ns))
+#define TRACE(point, pid) ((void)0)
+
+#endif
+
+extern int trace_report(FILE *out);
+extern void trace_clear(void);
+
+#endif
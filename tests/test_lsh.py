@@ -1,8 +1,11 @@
 from datetime import datetime
 from os import mkdir, setsid, kill, killpg, getpgid
+from os import environ, openpty, close as os_close, read as os_read, write as os_write
 from pathlib import Path
-from signal import SIGINT, SIGTERM
-from socket import gethostname
+from resource import setrlimit, RLIMIT_FSIZE
+from signal import signal, SIGINT, SIGTERM, SIGXFSZ, SIG_IGN
+from socket import gethostname, socket, AF_UNIX, SOCK_STREAM, MSG_WAITALL
+from struct import pack, unpack
 from subprocess import run, PIPE, Popen, TimeoutExpired
 from tempfile import gettempdir
 from time import sleep, time
@@ -205,6 +208,19 @@ class TestLsh(unittest.TestCase):
         self.run_cmd_and_exit("grep hello < test.txt > test_out.txt")
         self.check_test_txt(out)
 
+    def test_missing_redirection_file(self):
+        """
+        Tests that both spawn engines report a redirection file that cannot be opened as such,
+        and not as an error of the program.
+        """
+        for engine in ["posix_spawn", "fork"]:
+            script = "set spawn %s\ncat < /nonexistent | cat\ncat > /nonexistent/out" % engine
+            self.lsh = Popen([str(self.lsh_path), "-c", script], stdout=PIPE, stderr=PIPE)
+            _, err = self.lsh.communicate(timeout=3)
+            self.assertEqual(["open input file: No such file or directory",
+                              "open output file: No such file or directory"], err.decode().splitlines(),
+                             msg="Unexpected errors with the %s engine" % engine)
+
     def test_cd(self):
         """
         Verifies the functionality of the 'cd' command in lsh.
@@ -323,5 +339,588 @@ class TestLsh(unittest.TestCase):
         kill(bg_pid, SIGTERM)
         self.exit_with_eof()
 
+    def test_hash(self):
+        """
+        Tests the 'hash' built-in: commands that have been run are listed with their resolved path,
+        and 'hash -r' empties the table.
+        """
+        self.start_lsh()
+        self.run_cmd("ls")
+        self.run_cmd("hash")
+        self.run_cmd("hash -r")
+        out = self.run_cmd_and_exit("hash")
+        self.assertIn("/ls", out, msg="Expected ls to be listed by hash after running it")
+        self.assertIn("hash table empty", out, msg="Expected an empty table after hash -r")
+
+    def test_hash_stale_entry(self):
+        """
+        Tests that both spawn engines drop a cached path once the binary it points to is gone.
+        """
+        tmp_dir = self.make_tmp_dir()
+        for engine in ["posix_spawn", "fork"]:
+            run(["cp", "/bin/true", str(tmp_dir.joinpath("mytrue"))], check=True)
+            script = "set spawn %s\nmytrue\nrm %s/mytrue\nmytrue\nhash" % (engine, tmp_dir)
+            self.lsh = Popen([str(self.lsh_path), "-c", script], stdout=PIPE, stderr=PIPE,
+                             env={"PATH": "%s:/usr/bin:/bin" % tmp_dir})
+            out, _ = self.lsh.communicate(timeout=3)
+            self.assertNotIn("mytrue", out.decode(), msg="The %s engine kept a stale entry" % engine)
+
+    def test_long_command_line(self):
+        """
+        Tests a command line well beyond the old fixed parser buffers:
+        2000 arguments piped through 30 stages.
+        """
+        self.start_lsh()
+        args = " ".join(f"arg{i}" for i in range(2000))
+        out = self.run_cmd_and_exit(f"echo {args} | " + " | ".join(["cat"] * 30) + " | wc -w")
+        self.assertIn("2000", out.split())
+
+    def test_batch_command(self):
+        """
+        Tests batch mode with '-c': the command string is run without prompt or debug output
+        and lsh exits by itself at the end of it.
+        """
+        self.lsh = Popen([str(self.lsh_path), "-c", "echo ananab | rev\necho second"], stdout=PIPE, stderr=PIPE)
+        out, err = self.lsh.communicate(timeout=3)
+        self.assertEqual(0, self.lsh.returncode)
+        self.assertEqual("", err.decode())
+        self.assertEqual("banana\nsecond\n", out.decode(), msg="Batch mode should only print the commands' output")
+
+    def test_jobs_and_wait(self):
+        """
+        Tests the 'jobs' and 'wait' built-ins: a background job is listed while it runs,
+        and 'wait' returns only after it has been reaped, leaving no zombies behind.
+        """
+        self.start_lsh()
+        self.run_cmd("sleep 2 &")
+        self.run_cmd("jobs")
+        self.run_cmd("wait")
+        lsh_info = ProcessInfo(self.lsh.pid)
+        self.assertEqual(0, len(lsh_info.children()), msg="wait returned before the background job was reaped")
+        out = self.exit_with_eof()
+        self.assertIn("Running", out)
+        self.assertIn("sleep 2 &", out)
+
+    def test_time(self):
+        """
+        Tests the 'time' prefix: the pipeline runs as usual and a row per stage plus a total
+        row is reported on stderr once it is done.
+        """
+        self.lsh = Popen([str(self.lsh_path), "-c", "time sleep 0.2 | echo timed"], stdout=PIPE, stderr=PIPE)
+        out, err = self.lsh.communicate(timeout=3)
+        self.assertEqual("timed\n", out.decode())
+        rows = err.decode().splitlines()
+        self.assertEqual(4, len(rows), msg="Expected a header, two stages and a total")
+        self.assertTrue(rows[1].startswith("1 ") and rows[1].endswith("sleep"))
+        self.assertTrue(rows[3].startswith("total"))
+        real = float(rows[3].split()[1].rstrip("s"))
+        self.assertGreaterEqual(real, 0.2, msg="The total should cover the slowest stage")
+
+    def test_parallel(self):
+        """
+        Tests the 'parallel' built-in: background commands are queued so that at most
+        -j of them run at once, and 'wait' drains the pool and reports its throughput.
+        """
+        script = "parallel -j 2\n" + "sleep 0.3 &\n" * 4 + "wait\necho done"
+        start = time()
+        self.lsh = Popen([str(self.lsh_path), "-c", script], stdout=PIPE, stderr=PIPE)
+        out, err = self.lsh.communicate(timeout=5)
+        elapsed = time() - start
+        self.assertEqual("done\n", out.decode())
+        self.assertIn("parallel: 4 jobs in", err.decode())
+        self.assertGreaterEqual(elapsed, 0.55, msg="More than two jobs ran at once")
+        self.assertLess(elapsed, 1.1, msg="The pool did not run two jobs at once")
+
+    def test_builtins_without_exec(self):
+        """
+        Tests the in-process built-ins: with an unusable PATH, echo, pwd, test, true and false
+        still work on their own, with redirections, and as pipeline stages.
+        """
+        tmp_dir = self.make_tmp_dir()
+        script = ("echo one\n"
+                  "echo -n two | echo three\n"
+                  "pwd > where.txt\n"
+                  "test -f where.txt | [ 1 -lt 2 ]\n"
+                  "true\n"
+                  "false\n")
+        self.lsh = Popen([str(self.lsh_path), "-c", script], stdout=PIPE, stderr=PIPE, cwd=tmp_dir,
+                         env={"PATH": "/nonexistent"})
+        out, err = self.lsh.communicate(timeout=3)
+        self.assertEqual("", err.decode(), msg="A built-in was looked up in PATH")
+        self.assertEqual("one\nthree\n", out.decode())
+        self.assertEqual(str(tmp_dir) + "\n", tmp_dir.joinpath("where.txt").read_text())
+
+    def test_cmdcache_repeated_lines(self):
+        """
+        Tests the parsed-command cache of batch mode: repeated lines, including ones with a
+        prefix the shell strips before running them, behave the same on every repetition,
+        also after the cache is turned off by a cached line.
+        """
+        script = "time echo again\n" * 3 + "set cmdcache 0\n" * 2 + "time echo again\n"
+        self.lsh = Popen([str(self.lsh_path), "-c", script], stdout=PIPE, stderr=PIPE)
+        out, err = self.lsh.communicate(timeout=3)
+        self.assertEqual(0, self.lsh.returncode)
+        self.assertEqual("again\n" * 4, out.decode())
+        totals = [row for row in err.decode().splitlines() if row.startswith("total")]
+        self.assertEqual(4, len(totals), msg="A cached line lost its time prefix")
+
+    def test_pipesize(self):
+        """
+        Tests the 'pipesize' option: sizes take k/m suffixes, are capped at the system's
+        pipe-max-size, and pipelines still carry all their data with a resized buffer.
+        """
+        max_size = int(Path("/proc/sys/fs/pipe-max-size").read_text())
+        script = ("set pipesize 64k\nset\n"
+                  "set pipesize 1024m\nset\n"
+                  "head -c 3000000 /dev/zero | cat | wc -c")
+        self.lsh = Popen([str(self.lsh_path), "-c", script], stdout=PIPE, stderr=PIPE)
+        out, err = self.lsh.communicate(timeout=5)
+        self.assertEqual("", err.decode())
+        out = out.decode()
+        self.assertIn("pipesize 65536\n", out)
+        self.assertIn(f"pipesize {max_size}\n", out, msg="The size was not capped at pipe-max-size")
+        self.assertTrue(out.endswith("3000000\n"))
+
+    def test_tee_builtin(self):
+        """
+        Tests the tee built-in: as a pipe-to-pipe stage (spliced in the kernel) every file and
+        the next stage get the whole stream, and with files on both sides it copies the same.
+        """
+        tmp_dir = self.make_tmp_dir()
+        script = ("head -c 3000000 /dev/urandom | tee a.bin b.bin | cat > c.bin\n"
+                  "tee d.bin < a.bin > e.bin\n"
+                  "echo more | tee -a d.bin | cat")
+        self.lsh = Popen([str(self.lsh_path), "-c", script], stdout=PIPE, stderr=PIPE, cwd=tmp_dir)
+        out, err = self.lsh.communicate(timeout=5)
+        self.assertEqual("", err.decode())
+        self.assertEqual("more\n", out.decode())
+        data = tmp_dir.joinpath("a.bin").read_bytes()
+        self.assertEqual(3000000, len(data))
+        for name in ["b.bin", "c.bin", "e.bin"]:
+            self.assertEqual(data, tmp_dir.joinpath(name).read_bytes(), msg=f"{name} differs")
+        self.assertEqual(data + b"more\n", tmp_dir.joinpath("d.bin").read_bytes())
+
+    def test_tee_write_error(self):
+        """
+        Tests that the spliced tee built-in drops a file it can no longer write to, whether it
+        gets its copy through the spare pipe or last, and keeps the rest of the pipeline going.
+        """
+        def limit_file_size():
+            signal(SIGXFSZ, SIG_IGN)
+            setrlimit(RLIMIT_FSIZE, (100000, 100000))
+
+        tmp_dir = self.make_tmp_dir()
+        script = ("head -c 5000000 /dev/zero | tee small.bin /dev/null | wc -c\n"
+                  "head -c 5000000 /dev/zero | tee /dev/null small.bin | wc -c")
+        self.lsh = Popen([str(self.lsh_path), "-c", script], stdout=PIPE, stderr=PIPE, cwd=tmp_dir,
+                         preexec_fn=limit_file_size)
+        out, _ = self.lsh.communicate(timeout=10)
+        self.assertEqual("5000000\n5000000\n", out.decode())
+
+    def test_feeder(self):
+        """
+        Tests the 'feeder' option: input redirection is fed to the first stage by a splicing
+        helper stage, which must hand over the whole file and report a missing one, and which
+        is left out of the job text and the stage numbers of 'time'.
+        """
+        tmp_dir = self.make_tmp_dir()
+        tmp_dir.joinpath("in.txt").write_text("line\n" * 100000)
+        script = ("set feeder on\n"
+                  "wc -l < in.txt\n"
+                  "sort < in.txt | uniq -c\n"
+                  "sleep 0.2 < in.txt | cat &\n"
+                  "jobs\n"
+                  "wait\n"
+                  "time cat < in.txt | wc -l\n"
+                  "cat < missing.txt")
+        self.lsh = Popen([str(self.lsh_path), "-c", script], stdout=PIPE, stderr=PIPE, cwd=tmp_dir)
+        out, err = self.lsh.communicate(timeout=5)
+        lines = [l.strip() for l in out.decode().splitlines()]
+        self.assertEqual(["100000", "100000 line"], lines[:2])
+        self.assertRegex(lines[2], r"^\[1\] +Running +\d+\s+sleep 0.2 \| cat &$")
+        self.assertEqual("100000", lines[3])
+        err = err.decode()
+        self.assertRegex(err, r"\n1 .* cat\n2 .* wc\ntotal .* cat \| wc -l\n")
+        self.assertIn("open input file", err)
+
+    def test_history(self):
+        """
+        Tests the history: lines are kept distinct and capped at 'histsize', persisted to
+        $HOME/.lsh_history and loaded again by the next interactive shell, and Ctrl-R
+        brings back the newest line containing what was typed.
+        """
+        tmp_dir = self.make_tmp_dir()
+
+        def session(lines):
+            master, slave = openpty()
+            env = dict(environ, HOME=str(tmp_dir), LSH_HISTSIZE="3")
+            self.lsh = Popen(str(self.lsh_path), stdin=slave, stdout=slave, stderr=slave, env=env,
+                             preexec_fn=setsid)
+            os_close(slave)
+            for line in lines:
+                os_write(master, (line + "\n").encode())
+                sleep(0.1)
+            self.lsh.wait(timeout=5)
+            out = b""
+            try:
+                while chunk := os_read(master, 4096):
+                    out += chunk
+            except OSError:
+                pass  # EIO once the shell is gone
+            os_close(master)
+            return [l.strip() for l in out.decode(errors="replace").splitlines()]
+
+        session(["echo one", "echo two", "echo one", "echo three", "echo four", "exit"])
+        saved = tmp_dir.joinpath(".lsh_history").read_text().splitlines()
+        self.assertEqual(["echo one", "echo two", "echo one", "echo three", "echo four"], saved)
+
+        out = session(["history", "thr\x12", "exit"])
+        self.assertEqual(["1  echo one", "2  echo three", "3  echo four"],
+                         [l for l in out if l[:1].isdigit()], msg="Expected the newest 3 distinct lines")
+        self.assertIn("three", out, msg="Ctrl-R should have run 'echo three'")
+
+        # The loaded lines must survive the file being truncated under the shell
+        # (a file without duplicates, so loading it does not replace it)
+        tmp_dir.joinpath(".lsh_history").write_text("echo one\necho two\necho three\n")
+        truncate = "/bin/true > %s" % tmp_dir.joinpath(".lsh_history")
+        out = session([truncate, "history", "exit"])
+        self.assertEqual(0, self.lsh.returncode, msg="lsh died after its history file was truncated")
+        self.assertEqual(["1  echo two", "2  echo three", "3  " + truncate], [l for l in out if l[:1].isdigit()])
+
+    def test_serve(self):
+        """
+        Tests --serve: framed command lines over a Unix socket get their captured output and
+        exit status back, several clients are served at once by the workers, and the socket
+        is removed when the server is stopped.
+        """
+        path = self.make_tmp_dir().joinpath("lsh.sock")
+        self.lsh = Popen([str(self.lsh_path), "--serve", str(path), "--workers", "3"], stdout=PIPE, stderr=PIPE)
+        for _ in range(100):
+            if path.exists():
+                break
+            sleep(0.05)
+
+        def request(conn, line, flags=1):
+            data = line.encode()
+            conn.sendall(pack(">IB", len(data), flags) + data)
+            out = {b"o": b"", b"e": b""}
+            while True:
+                head = conn.recv(5, MSG_WAITALL)
+                kind, n = head[:1], unpack(">I", head[1:])[0]
+                payload = conn.recv(n, MSG_WAITALL) if n else b""
+                if kind == b"s":
+                    return unpack(">i", payload)[0], out[b"o"].decode(), out[b"e"].decode()
+                out[kind] += payload
+
+        def connect():
+            conn = socket(AF_UNIX, SOCK_STREAM)
+            conn.connect(str(path))
+            return conn
+
+        with connect() as conn:
+            self.assertEqual((0, "hello\n", ""), request(conn, "echo hello"))
+            self.assertEqual((0, "3000000\n", ""), request(conn, "head -c 3000000 /dev/zero | wc -c"))
+            status, out, err = request(conn, "ls /nonexistent")
+            self.assertNotEqual(0, status)
+            self.assertIn("nonexistent", err)
+            self.assertEqual((2, "Parse ERROR\n", ""), request(conn, "echo |"))
+
+        # Three workers, six clients sleeping 0.3s each: two rounds
+        conns = [connect() for _ in range(6)]
+        start = time()
+        for conn in conns:
+            conn.sendall(pack(">IB", 9, 0) + b"sleep 0.3")
+        for conn in conns:
+            self.assertEqual(b"s", conn.recv(9, MSG_WAITALL)[:1])
+            conn.close()
+        self.assertLess(time() - start, 1.5, msg="Expected the workers to serve clients concurrently")
+
+        self.lsh.terminate()
+        self.lsh.wait(timeout=5)
+        self.assertFalse(path.exists(), msg="Expected the socket to be removed")
+
+    def test_serve_cache_replay(self):
+        """
+        Tests --serve with output the worker writes itself: a 'cache' replay larger than the
+        capture pipe comes back whole instead of hanging the worker, and in-shell built-ins
+        still act on the worker.
+        """
+        tmp_dir = self.make_tmp_dir()
+        path = tmp_dir.joinpath("lsh.sock")
+        env = dict(environ, XDG_CACHE_HOME=str(tmp_dir / "xdg"))
+        self.lsh = Popen([str(self.lsh_path), "--serve", str(path)], stdout=PIPE, stderr=PIPE, env=env)
+        for _ in range(100):
+            if path.exists():
+                break
+            sleep(0.05)
+
+        def request(conn, line):
+            data = line.encode()
+            conn.sendall(pack(">IB", len(data), 1) + data)
+            out = b""
+            while True:
+                head = conn.recv(5, MSG_WAITALL)
+                kind, n = head[:1], unpack(">I", head[1:])[0]
+                payload = conn.recv(n, MSG_WAITALL) if n else b""
+                if kind == b"s":
+                    return unpack(">i", payload)[0], out
+                if kind == b"o":
+                    out += payload
+
+        with socket(AF_UNIX, SOCK_STREAM) as conn:
+            conn.connect(str(path))
+            line = "cache head -c 3000000 /dev/urandom"
+            status, first = request(conn, line)
+            self.assertEqual((0, 3000000), (status, len(first)))
+            self.assertEqual((0, first), request(conn, line), msg="Expected the whole output to be replayed")
+            self.assertEqual(0, request(conn, "set pipesize 64k")[0])
+            self.assertIn(b"pipesize 65536\n", request(conn, "set")[1])
+        self.lsh.terminate()
+        self.lsh.wait(timeout=3)
+
+    def test_lshstat(self):
+        """
+        Tests tracing: a build with LSH_TRACE=ON reports every traced interval in lshstat,
+        while the default build says tracing is not compiled in.
+        """
+        self.lsh = Popen([str(self.lsh_path), "-c", "lshstat"], stdout=PIPE, stderr=PIPE)
+        _, err = self.lsh.communicate(timeout=5)
+        self.assertIn("built without tracing", err.decode())
+
+        build_dir = self.make_tmp_dir()
+        code_dir = Path(__file__).parent.parent.joinpath("code")
+        run(["cmake", "-B", build_dir, "-S", code_dir, "-DLSH_TRACE=ON"], check=True, stdout=PIPE)
+        run(["cmake", "--build", build_dir, "--target", "lsh"], check=True, stdout=PIPE)
+        script = "echo one > /dev/null\n" * 10 + "/bin/true | /bin/true\n" * 10 + "lshstat"
+        self.lsh = Popen([str(build_dir.joinpath("lsh")), "-c", script], stdout=PIPE, stderr=PIPE)
+        out, err = self.lsh.communicate(timeout=10)
+        self.assertEqual("", err.decode())
+        counts = {l.split()[0]: int(l.split()[1]) for l in out.decode().splitlines()[1:]}
+        self.assertEqual({"strip": 21, "parse": 21, "dispatch": 10, "exec": 20, "line": 10, "run": 20}, counts)
+
+    def test_sched_hints(self):
+        """
+        Tests the scheduling hints: 'nice', 'sched batch' and an 'affinity' CPU list reach
+        the stages, and 'affinity pack' pins every stage to a single CPU.
+        """
+        script = ("set nice 5\n"
+                  "set sched batch\n"
+                  "set affinity 0\n"
+                  "nice\n"
+                  "grep policy /proc/self/sched\n"
+                  "grep Cpus_allowed_list /proc/self/status\n"
+                  "set affinity pack\n"
+                  "grep Cpus_allowed_list /proc/self/status | cat\n"
+                  "set affinity 99999")
+        self.lsh = Popen([str(self.lsh_path), "-c", script], stdout=PIPE, stderr=PIPE)
+        out, err = self.lsh.communicate(timeout=5)
+        lines = out.decode().splitlines()
+        self.assertEqual("5", lines[0])
+        self.assertEqual("3", lines[1].split()[-1], msg="Expected SCHED_BATCH (3)")
+        self.assertEqual("0", lines[2].split()[-1])
+        self.assertRegex(lines[3].split()[-1], r"^\d+$", msg="Expected a single CPU with 'pack'")
+        self.assertIn("invalid option", err.decode())
+
+    def test_cgroup(self):
+        """
+        Tests cgroup placement: with 'set cgroup on' a job runs in a job-<n> cgroup of its own
+        under lsh-<pid>, 'time' adds what the cgroup used, and malformed limits are refused.
+        """
+        with open("/proc/self/mountinfo") as f:
+            if not any(" - cgroup2 " in line for line in f):
+                self.skipTest("no cgroup v2 hierarchy")
+        script = ("limit cpu=x true\n"
+                  "limit mem=1m\n"
+                  "set cgroup on\n"
+                  "grep 0:: /proc/self/cgroup\n"
+                  "time sleep 0")
+        self.lsh = Popen([str(self.lsh_path), "-c", script], stdout=PIPE, stderr=PIPE)
+        out, err = self.lsh.communicate(timeout=5)
+        err = err.decode()
+        if "invalid option" in err:
+            self.skipTest("cannot create cgroups here")
+        self.assertRegex(out.decode(), r"/lsh-%d/job-1\n" % self.lsh.pid)
+        self.assertIn("limit: cpu=x: invalid limit", err)
+        self.assertIn("limit: usage:", err)
+        self.assertRegex(err, r"cgroup job-2: cpu \d+\.\d+s")
+
+    def test_timeout(self):
+        """
+        Tests the 'timeout' prefix: a stuck pipeline is reported with the stages still running
+        and stopped with SIGTERM, and one ignoring that gets SIGKILL after the grace period.
+        """
+        trapper = Path(gettempdir()) / "lsh_trap_term.sh"
+        trapper.write_text("trap '' TERM\nexec sleep 5\n")
+        script = ("timeout 0.2 sleep 5 | cat\n"
+                  "set grace 0.2\n"
+                  "timeout 0.2 sh %s\n"
+                  "timeout 0.5s echo quick\n"
+                  "timeout soon true" % trapper)
+        start = time()
+        self.lsh = Popen([str(self.lsh_path), "-c", script], stdout=PIPE, stderr=PIPE)
+        out, err = self.lsh.communicate(timeout=5)
+        elapsed = time() - start
+        trapper.unlink()
+        err = err.decode()
+        self.assertLess(elapsed, 2, msg="Expected the stuck stages to be killed")
+        self.assertRegex(err, r"timeout: sleep 5 \| cat: after 0.2s still running: "
+                              r"stage 1 \(sleep, pid \d+\), stage 2 \(cat, pid \d+\); sending SIGTERM")
+        self.assertRegex(err, r"0.2s after SIGTERM still running: stage 1 \(sleep, pid \d+\); sending SIGKILL")
+        self.assertIn("quick", out.decode())
+        self.assertIn("timeout: soon: invalid duration", err)
+
+    def test_glob(self):
+        """
+        Tests wildcard expansion: matches are sorted, hidden files only match a leading '.',
+        words without matches stay literal, patterns work across directories, and a repeated
+        line sees files created since it last ran.
+        """
+        tmp_dir = Path(gettempdir()) / ("lsh_glob_" + str(time()))
+        for name in ["b.c", "a.c", ".hidden.c", "notes.txt", "src/x.c", "src/y.h", "lib/z.c"]:
+            (tmp_dir / name).parent.mkdir(parents=True, exist_ok=True)
+            (tmp_dir / name).touch()
+        script = ("cd %s\n"
+                  "echo *.c\n"
+                  "echo .*.c\n"
+                  "echo *.none\n"
+                  "echo */*.[ch]\n"
+                  "echo */\n"
+                  "echo ?.c\n"
+                  "touch c.c\n"
+                  "echo ?.c" % tmp_dir)
+        self.lsh = Popen([str(self.lsh_path), "-q", "-c", script], stdout=PIPE, stderr=PIPE)
+        out, _ = self.lsh.communicate(timeout=5)
+        run(["rm", "-rf", str(tmp_dir)])
+        self.assertEqual(["a.c b.c", ".hidden.c", "*.none", "lib/z.c src/x.c src/y.h", "lib/ src/",
+                          "a.c b.c", "a.c b.c c.c"], out.decode().splitlines())
+
+    def test_glob_cmdcache(self):
+        """
+        Tests that a repeated line whose wildcard matched nothing is not replayed from the
+        parsed-command cache: once a file matches, the next run of the line expands to it.
+        """
+        tmp_dir = self.make_tmp_dir()
+        script = ("/bin/echo %s/*.x\n"
+                  "touch %s/a.x\n"
+                  "/bin/echo %s/*.x" % (tmp_dir, tmp_dir, tmp_dir))
+        self.lsh = Popen([str(self.lsh_path), "-c", script], stdout=PIPE, stderr=PIPE)
+        out, err = self.lsh.communicate(timeout=5)
+        self.assertEqual("", err.decode())
+        self.assertEqual(["%s/*.x" % tmp_dir, "%s/a.x" % tmp_dir], out.decode().splitlines(),
+                         msg="The line with the unmatched wildcard was run from the cache")
+
+    def test_here_document(self):
+        """
+        Tests '<<END' here-documents and '<<<' here-strings: the text reaches the first stage
+        through a memfd, the same line with another body is not run from the cache, and a
+        duplicate stdin redirection is refused.
+        """
+        script = ("cat <<END | tr a-z A-Z\n"
+                  "first\n"
+                  "  body\n"
+                  "END\n"
+                  "cat <<END | tr a-z A-Z\n"
+                  "second\n"
+                  "END\n"
+                  "wc -c <<< abcdef\n"
+                  "ls -l /proc/self/fd/0 <<< x\n"
+                  "cat < /dev/null <<< x\n"
+                  "cat <<NEVER\n"
+                  "unterminated")
+        self.lsh = Popen([str(self.lsh_path), "-c", script], stdout=PIPE, stderr=PIPE)
+        out, err = self.lsh.communicate(timeout=5)
+        lines = out.decode().splitlines()
+        self.assertEqual(["FIRST", "  BODY", "SECOND", "7"], lines[:4])
+        self.assertIn("/memfd:lsh-here", lines[4])
+        self.assertEqual("unterminated", lines[-1])
+        self.assertIn("duplicate redirection of stdin", err.decode())
+        self.assertIn("here-document: input ended before NEVER", err.decode())
+
+    def test_cache(self):
+        """
+        Tests the 'cache' prefix: a repeated command line is answered from the store with the
+        same output, a changed '< file' runs the command again, and the output of a pipeline is
+        kept once, whatever it is redirected to, in a store under XDG_CACHE_HOME.
+        """
+        tmp_dir = self.make_tmp_dir()
+        data = tmp_dir / "in.txt"
+        data.write_text("b\na\n")
+        script = ("cd %s\n"
+                  "cache date +%%N\n"
+                  "cache date +%%N\n"
+                  "cache sort < in.txt\n"
+                  "cache sort < in.txt > out.txt\n" % tmp_dir)
+        env = dict(environ, XDG_CACHE_HOME=str(tmp_dir / "xdg"))
+        self.lsh = Popen([str(self.lsh_path), "-c", script], stdout=PIPE, stderr=PIPE, env=env)
+        lines = self.lsh.communicate(timeout=5)[0].decode().splitlines()
+        self.assertEqual(lines[0], lines[1], msg="Expected the second date to be replayed")
+        self.assertEqual(["a", "b"], lines[2:])
+        self.assertEqual("a\nb\n", (tmp_dir / "out.txt").read_text())
+        self.assertEqual(2, len(list((tmp_dir / "xdg" / "lsh").iterdir())))
+
+        data.write_text("d\nc\n")
+        self.lsh = Popen([str(self.lsh_path), "-c", script], stdout=PIPE, stderr=PIPE, env=env)
+        again = self.lsh.communicate(timeout=5)[0].decode().splitlines()
+        self.assertEqual(lines[0], again[0], msg="Expected the date to be replayed by another shell")
+        self.assertEqual(["c", "d"], again[2:])
+
+    def test_exec(self):
+        """
+        Tests 'exec' and the tail exec of a script's last command: the program takes the
+        shell's pid, 'exec' without a command keeps its redirection, a failed exec ends the
+        script, and a last command with a prefix is still forked.
+        """
+        tmp_dir = self.make_tmp_dir()
+        self.lsh = Popen([str(self.lsh_path), "-c", "echo forked\ncat /proc/self/stat\n"], stdout=PIPE, stderr=PIPE)
+        out = self.lsh.communicate(timeout=5)[0].decode().splitlines()
+        self.assertEqual("forked", out[0])
+        self.assertEqual("%d" % self.lsh.pid, out[1].split()[0], msg="Expected the last command to be exec'd")
+
+        self.lsh = Popen([str(self.lsh_path), "-c", "time cat /proc/self/stat"], stdout=PIPE, stderr=PIPE)
+        out = self.lsh.communicate(timeout=5)[0].decode()
+        self.assertEqual("%d" % self.lsh.pid, out.split()[3], msg="Expected the timed command to be forked")
+
+        script = ("cd %s\n"
+                  "exec > out.txt\n"
+                  "echo redirected\n"
+                  "exec nonexistent_cmd\n"
+                  "echo not reached\n" % tmp_dir)
+        self.lsh = Popen([str(self.lsh_path), "-c", script], stdout=PIPE, stderr=PIPE)
+        out, err = self.lsh.communicate(timeout=5)
+        self.assertEqual(127, self.lsh.returncode)
+        self.assertIn("exec: nonexistent_cmd: No such file or directory", err.decode())
+        self.assertEqual("redirected\n", (tmp_dir / "out.txt").read_text())
+
+        # A missing last command fails the same whether it is exec'd in place or
+        # forked, here because a background job is left to wait for
+        for script in ["nonexistent_cmd", "sleep 0.1 &\nnonexistent_cmd"]:
+            self.lsh = Popen([str(self.lsh_path), "-c", script], stdout=PIPE, stderr=PIPE)
+            _, err = self.lsh.communicate(timeout=5)
+            self.assertEqual(127, self.lsh.returncode)
+            self.assertEqual("nonexistent_cmd: No such file or directory\n", err.decode())
+
+    def test_lazy_readline(self):
+        """
+        Tests that readline is only loaded for an interactive prompt: a shell reading a script
+        from a pipe never maps it, one at a terminal does.
+        """
+        self.start_lsh()
+        self.run_cmd("/bin/echo ready")
+        maps = Path("/proc/%d/maps" % self.lsh.pid).read_text()
+        self.assertNotIn("libreadline", maps, msg="Expected batch mode not to load readline")
+        self.exit_with_eof()
+
+        master, slave = openpty()
+        self.lsh = Popen(str(self.lsh_path), stdin=slave, stdout=slave, stderr=slave, preexec_fn=setsid,
+                         env=dict(environ, LSH_HISTFILE=""))
+        os_close(slave)
+        sleep(0.5)
+        maps = Path("/proc/%d/maps" % self.lsh.pid).read_text()
+        os_write(master, b"exit\n")
+        self.lsh.wait(timeout=5)
+        os_close(master)
+        self.assertIn("libreadline", maps, msg="Expected the prompt to load readline")
+        self.assertEqual(0, self.lsh.returncode)
+
 if __name__ == "__main__":
     unittest.main(testRunner=HTMLTestRunner(report_name="test-lsh", open_in_browser=True, description="Lab 1 tests"))
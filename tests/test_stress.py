@@ -0,0 +1,324 @@
+from datetime import datetime
+from json import dumps
+from os import listdir, getpgid, killpg, kill, setsid
+from pathlib import Path
+from resource import setrlimit, RLIMIT_NOFILE
+from signal import SIGINT, SIGTERM
+from subprocess import run, PIPE, Popen, DEVNULL
+from tempfile import gettempdir
+from time import sleep, time
+import unittest
+from typing import Optional
+
+from HTMLTestRunner.runner import HTMLTestRunner
+from psutil import Process as ProcessInfo, NoSuchProcess
+from psutil import STATUS_ZOMBIE
+
+# Sizes of the stress cases and the slowest they may get. The limits are
+# far below what a development machine does, so only a real regression
+# (a reaping stall, a quadratic job table, a leak) trips them.
+BG_JOBS = 10000
+BG_MIN_JOBS_PER_SEC = 250
+PIPELINE_STAGES = 200
+PIPELINE_BYTES = 8 << 20
+PIPELINE_MIN_MB_PER_SEC = 1.0
+PIPELINE_FD_LIMIT = 64
+STORM_ROUNDS = 50
+STORM_MAX_LATENCY = 1.0
+
+# Every case appends its numbers here, one JSON object per line in the
+# format of lsh_bench, so results can be compared from run to run.
+RESULTS = Path("reports").joinpath("stress.jsonl")
+
+
+class TestStress(unittest.TestCase):
+
+    lsh_path: Path
+    lsh: Optional[Popen]
+
+    @classmethod
+    def setUpClass(cls) -> None:
+        """
+        Compile lsh from source before running the tests.
+        """
+        code_dir = Path.joinpath(Path(__file__).parent.parent, "code")
+        build_dir = cls.make_tmp_dir()
+        run(["cmake", "-B", build_dir, "-S", code_dir, "-DCMAKE_BUILD_TYPE=Release"], check=True)
+        run(["cmake", "--build", build_dir, "--target", "lsh"], check=True)
+        cls.lsh_path = build_dir.joinpath("lsh")
+
+    def setUp(self):
+        """
+        Initializes before each test; ensures that no leftover lsh process exists.
+        """
+        self.lsh = None
+        self.syncs = 0
+
+    def tearDown(self):
+        """
+        Cleanup after each test; kills lsh and whatever it left running.
+        """
+        self.assertIsNotNone(self.lsh)
+        if self.lsh.poll() is None:
+            for child in ProcessInfo(self.lsh.pid).children(recursive=True):
+                child.kill()
+            self.lsh.kill()
+            self.lsh.wait(timeout=3)
+        for pipe in (self.lsh.stdin, self.lsh.stdout):
+            pipe.close()
+
+    @staticmethod
+    def make_tmp_dir() -> Path:
+        """
+        Creates a temporary directory.
+        """
+        tmp_dir = Path(gettempdir()).joinpath("test_stress_" + str(time()))
+        tmp_dir.mkdir()
+        return tmp_dir
+
+    def start_lsh(self, cwd: Path = None, fd_limit: int = None):
+        """
+        Launches lsh in a session of its own, reading commands from a pipe.
+        """
+        def preexec():
+            setsid()
+            if fd_limit:
+                setrlimit(RLIMIT_NOFILE, (fd_limit, fd_limit))
+
+        self.assertIsNone(self.lsh)
+        self.lsh = Popen(str(self.lsh_path), stdin=PIPE, stdout=PIPE, stderr=DEVNULL, cwd=cwd, preexec_fn=preexec)
+
+    def send(self, text: str):
+        """
+        Writes command lines to lsh's stdin.
+        """
+        self.lsh.stdin.write(text.encode())
+        self.lsh.stdin.flush()
+
+    def sync(self, timeout: float = 120) -> list:
+        """
+        Waits until lsh has run everything sent so far, and returns the lines it printed meanwhile.
+        /bin/echo writes straight to the pipe, the built-in would leave it in the shell's buffer.
+        """
+        self.syncs += 1
+        marker = "sync-%d" % self.syncs
+        self.send("/bin/echo %s\n" % marker)
+        lines = []
+        deadline = time() + timeout
+        while time() < deadline:
+            line = self.lsh.stdout.readline().decode()
+            self.assertNotEqual("", line, msg="lsh exited before " + marker)
+            if line.strip() == marker:
+                return lines
+            lines.append(line)
+        self.fail("lsh did not reach " + marker)
+
+    def fd_count(self) -> int:
+        """
+        Number of descriptors lsh has open, from /proc/<pid>/fd.
+        """
+        return len(listdir("/proc/%d/fd" % self.lsh.pid))
+
+    def settle(self, timeout: float = 120) -> list:
+        """
+        Like sync(), and also waits for the sync command itself to be reaped: foreground jobs share
+        the shell's process group, so then none is left in it.
+        """
+        lines = self.sync(timeout)
+        pgid = getpgid(self.lsh.pid)
+        deadline = time() + 2
+        while time() < deadline and any(self.pgid(c) == pgid for c in ProcessInfo(self.lsh.pid).children()):
+            sleep(0.005)
+        return lines
+
+    @staticmethod
+    def pgid(child: ProcessInfo) -> int:
+        """
+        Process group of a child, or -1 once it is gone.
+        """
+        try:
+            return getpgid(child.pid)
+        except ProcessLookupError:
+            return -1
+
+    def baseline(self) -> int:
+        """
+        Descriptors lsh has open when idle, once it has started up.
+        """
+        self.settle()
+        return self.fd_count()
+
+    def children(self) -> list:
+        """
+        lsh's children that are still running, leaving out ones that exited and are about to be reaped.
+        """
+        return [c for c in ProcessInfo(self.lsh.pid).children() if self.alive(c)]
+
+    @staticmethod
+    def alive(child: ProcessInfo) -> bool:
+        """
+        Whether a child is still running, as opposed to gone or dead and not yet reaped.
+        """
+        try:
+            return child.status() != STATUS_ZOMBIE
+        except NoSuchProcess:
+            return False
+
+    def check_clean(self, fds: int, timeout: float = 2):
+        """
+        Asserts that lsh has no children left, zombie or not, and no more descriptors than it started with.
+        The last command run may have exited but not been reaped yet, so both get a moment to settle.
+        """
+        deadline = time() + timeout
+        while True:
+            kids, count = ProcessInfo(self.lsh.pid).children(), self.fd_count()
+            if (not kids and count == fds) or time() > deadline:
+                break
+            sleep(0.01)
+        for child in kids:
+            self.assertTrue(self.alive(child), msg="Zombie detected: pid %d" % child.pid)
+        self.assertEqual([], [c.pid for c in kids], msg="Expected every job to be reaped")
+        self.assertEqual(fds, count, msg="Expected no leaked descriptors")
+
+    @staticmethod
+    def record(bench: str, variant: str, ops: int, seconds: float, **extra):
+        """
+        Appends one result line to the results file.
+        """
+        result = {"bench": bench, "variant": variant, "ops": ops, "seconds": round(seconds, 6),
+                  "ops_per_sec": round(ops / seconds, 1), "date": datetime.now().isoformat(timespec="seconds")}
+        result.update(extra)
+        RESULTS.parent.mkdir(exist_ok=True)
+        with open(RESULTS, "a") as f:
+            f.write(dumps(result) + "\n")
+
+    def test_background_spawns(self):
+        """
+        Starts 10k background jobs in one burst, so SIGCHLDs pile up and coalesce while the shell
+        is still reading, then waits for them: every job must be reaped, no descriptor leaked and
+        the shell must keep up a minimum job rate.
+        """
+        self.start_lsh()
+        fds = self.baseline()
+
+        start = time()
+        self.send("/bin/true &\n" * BG_JOBS + "wait\njobs\n")
+        out = self.sync()
+        elapsed = time() - start
+
+        self.assertEqual([], out, msg="Expected no jobs to be left after wait")
+        self.check_clean(fds)
+        self.record("stress_bg", "spawn", BG_JOBS, elapsed)
+        self.assertGreater(BG_JOBS / elapsed, BG_MIN_JOBS_PER_SEC, msg="Background jobs started too slowly")
+
+        # Jobs that outlive the burst and are only reaped later, between lines
+        self.send("sleep 0.2 &\n" * 500)
+        self.sync()
+        sleep(1)
+        self.send("jobs\n")
+        self.sync()
+        self.check_clean(fds)
+        self.lsh.stdin.close()
+        self.assertEqual(0, self.lsh.wait(timeout=10))
+
+    def test_long_pipeline(self):
+        """
+        Pushes 8 MiB through a 200-stage pipeline of cat, then runs it again with the shell held to
+        64 descriptors: the output must be complete, the throughput above the threshold and the
+        shell's descriptors and children back to what they were.
+        """
+        tmp_dir = self.make_tmp_dir()
+        tmp_dir.joinpath("in.bin").write_bytes(bytes(range(256)) * (PIPELINE_BYTES // 256))
+        pipeline = " | ".join(["cat"] * PIPELINE_STAGES)
+
+        self.start_lsh(cwd=tmp_dir)
+        fds = self.baseline()
+        start = time()
+        self.send("%s < in.bin > out.bin\n" % pipeline)
+        self.sync()
+        elapsed = time() - start
+        self.assertEqual(PIPELINE_BYTES, tmp_dir.joinpath("out.bin").stat().st_size)
+        self.check_clean(fds)
+
+        start = time()
+        self.send("%s\n" % " | ".join(["/bin/true"] * PIPELINE_STAGES) * 10)
+        self.sync()
+        spawn = (time() - start) / 10
+        self.check_clean(fds)
+
+        mb_per_sec = PIPELINE_BYTES / elapsed / 1e6
+        self.record("stress_pipeline", "cat", PIPELINE_STAGES, elapsed, bytes=PIPELINE_BYTES,
+                    mb_per_sec=round(mb_per_sec, 1), spawn_seconds=round(spawn, 6))
+        self.assertGreater(mb_per_sec, PIPELINE_MIN_MB_PER_SEC, msg="Long pipeline too slow")
+        self.lsh.stdin.close()
+        self.lsh.wait(timeout=10)
+        self.lsh.stdout.close()
+
+        # Far fewer descriptors than stages
+        self.lsh = None
+        tmp_dir.joinpath("out.bin").unlink()
+        self.start_lsh(cwd=tmp_dir, fd_limit=PIPELINE_FD_LIMIT)
+        fds = self.baseline()
+        self.send("%s < in.bin > out.bin\n" % pipeline)
+        self.sync()
+        self.assertEqual(PIPELINE_BYTES, tmp_dir.joinpath("out.bin").stat().st_size,
+                         msg="Expected the pipeline to run within %d descriptors" % PIPELINE_FD_LIMIT)
+        self.check_clean(fds)
+        self.lsh.stdin.close()
+        self.assertEqual(0, self.lsh.wait(timeout=10))
+
+    def test_ctrl_c_storm(self):
+        """
+        Interrupts 50 foreground commands in a row with SIGINT to the shell's process group while
+        background jobs pile up: each foreground job must go within the latency threshold, every
+        background job must survive, and nothing may be left once they are stopped.
+        """
+        self.start_lsh()
+        fds = self.baseline()
+        pgid = getpgid(self.lsh.pid)
+
+        latencies = []
+        background = 0
+        for n in range(STORM_ROUNDS):
+            # A background job only leaves the shell's process group as it
+            # starts, so it is given that moment before the next SIGINT
+            if n % 5 == 0:
+                self.send("sleep 60 &\n")
+                self.settle()
+                background += 1
+            self.send("sleep 60\n")
+
+            # The foreground job is the one in the shell's own process group
+            deadline = time() + 5
+            while time() < deadline:
+                fg = [c for c in self.children() if self.pgid(c) == pgid]
+                if fg:
+                    break
+                sleep(0.005)
+            self.assertTrue(fg, msg="Foreground command %d did not start" % n)
+
+            start = time()
+            killpg(pgid, SIGINT)
+            while time() - start < 5 and any(self.alive(c) for c in fg):
+                sleep(0.001)
+            self.settle(timeout=5)
+            latencies.append(time() - start)
+            self.assertEqual(background, len(self.children()), msg="Expected the background jobs to survive")
+
+        self.assertIsNone(self.lsh.poll(), msg="Expected lsh to survive SIGINT")
+        for child in self.children():
+            kill(child.pid, SIGTERM)
+        self.send("wait\n")
+        self.sync()
+        self.check_clean(fds)
+
+        latencies.sort()
+        self.record("stress_sigint", "storm", STORM_ROUNDS, sum(latencies),
+                    p50_seconds=round(latencies[len(latencies) // 2], 6), max_seconds=round(latencies[-1], 6))
+        self.assertLess(latencies[-1], STORM_MAX_LATENCY, msg="A Ctrl-C took too long to take effect")
+        self.lsh.stdin.close()
+        self.assertEqual(0, self.lsh.wait(timeout=10))
+
+
+if __name__ == "__main__":
+    unittest.main(testRunner=HTMLTestRunner(report_name="test-stress", open_in_browser=True, description="Stress tests"))